@@ -36,13 +36,17 @@
 
 #include "asn1.h"
 #define P11_DEBUG_FLAG P11_DEBUG_TRUST
+#include "compat.h"
 #include "debug.h"
+#include "hash.h"
 #include "oid.h"
 
+#include "basic.asn.h"
 #include "openssl.asn.h"
 #include "pkix.asn.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -60,11 +64,44 @@ struct {
 } asn1_tabs[] = {
 	{ pkix_asn1_tab, "PKIX1.", 6 },
 	{ openssl_asn1_tab, "OPENSSL.", 8 },
+	{ basic_asn1_tab, "BASIC.", 6 },
 	{ NULL, },
 };
 
-p11_dict *
-p11_asn1_defs_load (void)
+/*
+ * The definitions are built once and shared by everyone in the process.
+ * They are never changed after being built, so lookups don't need a lock,
+ * only taking and dropping a reference does.
+ */
+
+static struct {
+	p11_dict *defs;
+	int refs;
+} shared = { NULL, 0 };
+
+#ifdef OS_UNIX
+
+static pthread_mutex_t shared_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+#define shared_lock() \
+	(pthread_mutex_lock (&shared_mutex))
+#define shared_unlock() \
+	(pthread_mutex_unlock (&shared_mutex))
+
+#else /* OS_WIN32 */
+
+/* A CRITICAL_SECTION can't be statically initialized */
+static LONG shared_spin = 0;
+
+#define shared_lock() \
+	while (InterlockedCompareExchange (&shared_spin, 1, 0) != 0) Sleep (0)
+#define shared_unlock() \
+	(InterlockedExchange (&shared_spin, 0))
+
+#endif /* OS_WIN32 */
+
+static p11_dict *
+load_defs (void)
 {
 	char message[ASN1_MAX_ERROR_DESCRIPTION_SIZE] = { 0, };
 	node_asn *def;
@@ -81,6 +118,7 @@ p11_asn1_defs_load (void)
 		if (ret != ASN1_SUCCESS) {
 			p11_debug_precond ("failed to load %s* definitions: %s: %s\n",
 			                   asn1_tabs[i].prefix, asn1_strerror (ret), message);
+			p11_dict_free (defs);
 			return NULL;
 		}
 
@@ -91,6 +129,45 @@ p11_asn1_defs_load (void)
 	return defs;
 }
 
+p11_dict *
+p11_asn1_defs_load (void)
+{
+	p11_dict *defs;
+
+	shared_lock ();
+
+	if (shared.defs == NULL)
+		shared.defs = load_defs ();
+	if (shared.defs != NULL)
+		shared.refs++;
+	defs = shared.defs;
+
+	shared_unlock ();
+
+	return defs;
+}
+
+void
+p11_asn1_defs_unref (p11_dict *defs)
+{
+	if (!defs)
+		return;
+
+	shared_lock ();
+
+	if (defs != shared.defs || shared.refs <= 0) {
+		shared_unlock ();
+		return_if_reached ();
+	}
+
+	if (--shared.refs == 0) {
+		p11_dict_free (shared.defs);
+		shared.defs = NULL;
+	}
+
+	shared_unlock ();
+}
+
 static node_asn *
 lookup_def (p11_dict *asn1_defs,
             const char *struct_name)
@@ -215,17 +292,50 @@ p11_asn1_tlv_length (const unsigned char *data,
 	return -1;
 }
 
-typedef struct {
-	node_asn *node;
-	char *struct_name;
+/*
+ * The cache is keyed by the contents of the DER, so that the same
+ * certificate in several files is only decoded once. It holds at most
+ * cache->max items, and throws out the one least recently used when
+ * more are added.
+ */
+
+typedef struct _asn1_item {
+	unsigned char *der;
 	size_t length;
+	char *struct_name;
+	node_asn *node;
+	struct _asn1_item *newer;
+	struct _asn1_item *older;
 } asn1_item;
 
+static unsigned int
+asn1_item_hash (const void *data)
+{
+	const asn1_item *item = data;
+	uint32_t hash;
+
+	p11_hash_murmur3 (&hash, item->der, item->length, NULL);
+	return hash;
+}
+
+static bool
+asn1_item_equal (const void *one,
+                 const void *two)
+{
+	const asn1_item *item_one = one;
+	const asn1_item *item_two = two;
+
+	return item_one->length == item_two->length &&
+	       memcmp (item_one->der, item_two->der, item_one->length) == 0 &&
+	       strcmp (item_one->struct_name, item_two->struct_name) == 0;
+}
+
 static void
 free_asn1_item (void *data)
 {
 	asn1_item *item = data;
 	free (item->struct_name);
+	free (item->der);
 	asn1_delete_structure (&item->node);
 	free (item);
 }
@@ -233,8 +343,66 @@ free_asn1_item (void *data)
 struct _p11_asn1_cache {
 	p11_dict *defs;
 	p11_dict *items;
+	asn1_item *newest;
+	asn1_item *oldest;
+	unsigned int max;
+	p11_asn1_cache_stats stats;
 };
 
+static void
+cache_unlink (p11_asn1_cache *cache,
+              asn1_item *item)
+{
+	if (item->newer)
+		item->newer->older = item->older;
+	else
+		cache->newest = item->older;
+	if (item->older)
+		item->older->newer = item->newer;
+	else
+		cache->oldest = item->newer;
+	item->newer = item->older = NULL;
+}
+
+static void
+cache_link (p11_asn1_cache *cache,
+            asn1_item *item)
+{
+	item->older = cache->newest;
+	item->newer = NULL;
+	if (cache->newest)
+		cache->newest->newer = item;
+	else
+		cache->oldest = item;
+	cache->newest = item;
+}
+
+static void
+cache_evict (p11_asn1_cache *cache,
+             unsigned int max)
+{
+	asn1_item *item;
+
+	while (p11_dict_size (cache->items) > max) {
+		item = cache->oldest;
+		return_if_fail (item != NULL);
+		cache_unlink (cache, item);
+		if (!p11_dict_remove (cache->items, item))
+			return_if_reached ();
+		cache->stats.evictions++;
+	}
+}
+
+static asn1_item *
+cache_lookup (p11_asn1_cache *cache,
+              const char *struct_name,
+              const unsigned char *der,
+              size_t der_len)
+{
+	asn1_item key = { (unsigned char *)der, der_len, (char *)struct_name, };
+	return p11_dict_get (cache->items, &key);
+}
+
 p11_asn1_cache *
 p11_asn1_cache_new (void)
 {
@@ -246,13 +414,25 @@ p11_asn1_cache_new (void)
 	cache->defs = p11_asn1_defs_load ();
 	return_val_if_fail (cache->defs != NULL, NULL);
 
-	cache->items = p11_dict_new (p11_dict_direct_hash, p11_dict_direct_equal,
+	/* The item is both key and value, and is freed as the value */
+	cache->items = p11_dict_new (asn1_item_hash, asn1_item_equal,
 	                             NULL, free_asn1_item);
 	return_val_if_fail (cache->items != NULL, NULL);
 
+	cache->max = P11_ASN1_CACHE_MAX;
 	return cache;
 }
 
+void
+p11_asn1_cache_set_max (p11_asn1_cache *cache,
+                        unsigned int max)
+{
+	return_if_fail (cache != NULL);
+
+	cache->max = max;
+	cache_evict (cache, max);
+}
+
 node_asn *
 p11_asn1_cache_get (p11_asn1_cache *cache,
                     const char *struct_name,
@@ -265,14 +445,16 @@ p11_asn1_cache_get (p11_asn1_cache *cache,
 	return_val_if_fail (struct_name != NULL, NULL);
 	return_val_if_fail (der != NULL, NULL);
 
-	item = p11_dict_get (cache->items, der);
-	if (item != NULL) {
-		return_val_if_fail (item->length == der_len, NULL);
-		return_val_if_fail (strcmp (item->struct_name, struct_name) == 0, NULL);
-		return item->node;
+	item = cache_lookup (cache, struct_name, der, der_len);
+	if (item == NULL) {
+		cache->stats.misses++;
+		return NULL;
 	}
 
-	return NULL;
+	cache->stats.hits++;
+	cache_unlink (cache, item);
+	cache_link (cache, item);
+	return item->node;
 }
 
 void
@@ -289,16 +471,60 @@ p11_asn1_cache_take (p11_asn1_cache *cache,
 	return_if_fail (der != NULL);
 	return_if_fail (der_len != 0);
 
+	/* Replaces any node already cached for this DER */
+	item = cache_lookup (cache, struct_name, der, der_len);
+	if (item != NULL) {
+		if (item->node != node)
+			asn1_delete_structure (&item->node);
+		item->node = node;
+		cache_unlink (cache, item);
+		cache_link (cache, item);
+		return;
+	}
+
+	/* Make room for the new item, which is never itself thrown out */
+	cache_evict (cache, cache->max ? cache->max - 1 : 0);
+
 	item = calloc (1, sizeof (asn1_item));
 	return_if_fail (item != NULL);
 
 	item->length = der_len;
 	item->node = node;
+	item->der = memdup (der, der_len);
+	return_if_fail (item->der != NULL);
 	item->struct_name = strdup (struct_name);
 	return_if_fail (item->struct_name != NULL);
 
-	if (!p11_dict_set (cache->items, (void *)der, item))
+	if (!p11_dict_set (cache->items, item, item))
 		return_if_reached ();
+	cache_link (cache, item);
+}
+
+node_asn *
+p11_asn1_cache_steal (p11_asn1_cache *cache,
+                      const char *struct_name,
+                      const unsigned char *der,
+                      size_t der_len)
+{
+	asn1_item *item;
+	node_asn *node;
+
+	return_val_if_fail (cache != NULL, NULL);
+	return_val_if_fail (struct_name != NULL, NULL);
+	return_val_if_fail (der != NULL, NULL);
+
+	item = cache_lookup (cache, struct_name, der, der_len);
+	if (item == NULL)
+		return NULL;
+
+	cache_unlink (cache, item);
+	if (!p11_dict_steal (cache->items, item, NULL, NULL))
+		return_val_if_reached (NULL);
+
+	node = item->node;
+	item->node = NULL;
+	free_asn1_item (item);
+	return node;
 }
 
 void
@@ -306,6 +532,16 @@ p11_asn1_cache_flush (p11_asn1_cache *cache)
 {
 	return_if_fail (cache != NULL);
 	p11_dict_clear (cache->items);
+	cache->newest = cache->oldest = NULL;
+}
+
+void
+p11_asn1_cache_get_stats (p11_asn1_cache *cache,
+                          p11_asn1_cache_stats *stats)
+{
+	return_if_fail (cache != NULL);
+	return_if_fail (stats != NULL);
+	memcpy (stats, &cache->stats, sizeof (p11_asn1_cache_stats));
 }
 
 p11_dict *
@@ -321,6 +557,6 @@ p11_asn1_cache_free (p11_asn1_cache *cache)
 	if (!cache)
 		return;
 	p11_dict_free (cache->items);
-	p11_dict_free (cache->defs);
+	p11_asn1_defs_unref (cache->defs);
 	free (cache);
 }
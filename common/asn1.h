@@ -41,8 +41,19 @@
 
 typedef struct _p11_asn1_cache p11_asn1_cache;
 
+typedef struct {
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} p11_asn1_cache_stats;
+
+/* The number of decoded structures a cache holds by default */
+#define P11_ASN1_CACHE_MAX 256
+
 p11_dict *       p11_asn1_defs_load                 (void);
 
+void             p11_asn1_defs_unref                (p11_dict *asn1_defs);
+
 node_asn *       p11_asn1_decode                    (p11_dict *asn1_defs,
                                                      const char *struct_name,
                                                      const unsigned char *der,
@@ -62,6 +73,9 @@ p11_asn1_cache * p11_asn1_cache_new                 (void);
 
 p11_dict *       p11_asn1_cache_defs                (p11_asn1_cache *cache);
 
+void             p11_asn1_cache_set_max             (p11_asn1_cache *cache,
+                                                     unsigned int max);
+
 node_asn *       p11_asn1_cache_get                 (p11_asn1_cache *cache,
                                                      const char *struct_name,
                                                      const unsigned char *der,
@@ -73,8 +87,16 @@ void             p11_asn1_cache_take                (p11_asn1_cache *cache,
                                                      const unsigned char *der,
                                                      size_t der_len);
 
+node_asn *       p11_asn1_cache_steal               (p11_asn1_cache *cache,
+                                                     const char *struct_name,
+                                                     const unsigned char *der,
+                                                     size_t der_len);
+
 void             p11_asn1_cache_flush               (p11_asn1_cache *cache);
 
+void             p11_asn1_cache_get_stats           (p11_asn1_cache *cache,
+                                                     p11_asn1_cache_stats *stats);
+
 void             p11_asn1_cache_free                (p11_asn1_cache *cache);
 
 #endif /* P11_ASN1_H_ */
@@ -86,6 +86,76 @@ p11_attrs_free (void *attrs)
 	free (ats);
 }
 
+/*
+ * The attribute types that are common in the objects we build, each
+ * have their own bit. Other types share the remaining bits.
+ */
+static uint64_t
+attr_bit (CK_ATTRIBUTE_TYPE type)
+{
+	int bit;
+
+	switch (type) {
+	case CKA_CLASS: bit = 0; break;
+	case CKA_TOKEN: bit = 1; break;
+	case CKA_PRIVATE: bit = 2; break;
+	case CKA_LABEL: bit = 3; break;
+	case CKA_APPLICATION: bit = 4; break;
+	case CKA_VALUE: bit = 5; break;
+	case CKA_OBJECT_ID: bit = 6; break;
+	case CKA_CERTIFICATE_TYPE: bit = 7; break;
+	case CKA_ISSUER: bit = 8; break;
+	case CKA_SERIAL_NUMBER: bit = 9; break;
+	case CKA_TRUSTED: bit = 10; break;
+	case CKA_CERTIFICATE_CATEGORY: bit = 11; break;
+	case CKA_JAVA_MIDP_SECURITY_DOMAIN: bit = 12; break;
+	case CKA_URL: bit = 13; break;
+	case CKA_HASH_OF_SUBJECT_PUBLIC_KEY: bit = 14; break;
+	case CKA_HASH_OF_ISSUER_PUBLIC_KEY: bit = 15; break;
+	case CKA_CHECK_VALUE: bit = 16; break;
+	case CKA_KEY_TYPE: bit = 17; break;
+	case CKA_SUBJECT: bit = 18; break;
+	case CKA_ID: bit = 19; break;
+	case CKA_START_DATE: bit = 20; break;
+	case CKA_END_DATE: bit = 21; break;
+	case CKA_MODIFIABLE: bit = 22; break;
+	case CKA_X_ASSERTION_TYPE: bit = 23; break;
+	case CKA_X_CERTIFICATE_VALUE: bit = 24; break;
+	case CKA_X_PURPOSE: bit = 25; break;
+	case CKA_X_PEER: bit = 26; break;
+	case CKA_X_DISTRUSTED: bit = 27; break;
+	case CKA_X_CRITICAL: bit = 28; break;
+	case CKA_CERT_SHA1_HASH: bit = 29; break;
+	case CKA_CERT_MD5_HASH: bit = 30; break;
+	default:
+		/* The NSS trust attributes are numbered one after the other */
+		if (type >= CKA_TRUST_DIGITAL_SIGNATURE && type <= CKA_TRUST_STEP_UP_APPROVED)
+			bit = 31 + (type - CKA_TRUST_DIGITAL_SIGNATURE);
+		else
+			bit = 47 + (type % 17);
+		break;
+	}
+
+	return (uint64_t)1 << bit;
+}
+
+/*
+ * A bit for each type of attribute present. When an attribute type's
+ * bit is not set, it is not among the attributes.
+ */
+uint64_t
+p11_attrs_bits (const CK_ATTRIBUTE *attrs,
+                CK_ULONG count)
+{
+	uint64_t bits = 0;
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++)
+		bits |= attr_bit (attrs[i].type);
+
+	return bits;
+}
+
 static CK_ATTRIBUTE *
 attrs_build (CK_ATTRIBUTE *attrs,
              CK_ULONG count_to_add,
@@ -97,6 +167,7 @@ attrs_build (CK_ATTRIBUTE *attrs,
 	CK_ATTRIBUTE *attr;
 	CK_ATTRIBUTE *add;
 	CK_ULONG current;
+	uint64_t bits;
 	CK_ULONG at;
 	CK_ULONG j;
 	CK_ULONG i;
@@ -108,6 +179,7 @@ attrs_build (CK_ATTRIBUTE *attrs,
 	attrs = realloc (attrs, (current + count_to_add + 1) * sizeof (CK_ATTRIBUTE));
 	return_val_if_fail (attrs != NULL, NULL);
 
+	bits = p11_attrs_bits (attrs, current);
 	at = current;
 	for (i = 0; i < count_to_add; i++) {
 		add = (generator) (state);
@@ -119,7 +191,7 @@ attrs_build (CK_ATTRIBUTE *attrs,
 		attr = NULL;
 
 		/* Do we have this attribute? */
-		for (j = 0; attr == NULL && j < current; j++) {
+		for (j = 0; (bits & attr_bit (add->type)) && j < current; j++) {
 			if (attrs[j].type == add->type) {
 				attr = attrs + j;
 				break;
@@ -413,6 +485,50 @@ p11_attrs_remove (CK_ATTRIBUTE *attrs,
 	return true;
 }
 
+/*
+ * Sorts the attributes by type, for p11_attrs_find_sorted() and
+ * p11_attrs_match_sorted(). Attributes are usually added at the end
+ * of an already sorted array, so an insertion sort does well here.
+ */
+void
+p11_attrs_sort (CK_ATTRIBUTE *attrs,
+                CK_ULONG count)
+{
+	CK_ATTRIBUTE attr;
+	CK_ULONG i, j;
+
+	for (i = 1; i < count; i++) {
+		if (attrs[i - 1].type <= attrs[i].type)
+			continue;
+		memcpy (&attr, attrs + i, sizeof (CK_ATTRIBUTE));
+		for (j = i; j > 0 && attrs[j - 1].type > attr.type; j--)
+			memcpy (attrs + j, attrs + j - 1, sizeof (CK_ATTRIBUTE));
+		memcpy (attrs + j, &attr, sizeof (CK_ATTRIBUTE));
+	}
+}
+
+CK_ATTRIBUTE *
+p11_attrs_find_sorted (CK_ATTRIBUTE *attrs,
+                       CK_ULONG count,
+                       CK_ATTRIBUTE_TYPE type)
+{
+	CK_ULONG low = 0;
+	CK_ULONG high = count;
+	CK_ULONG mid;
+
+	while (low < high) {
+		mid = low + (high - low) / 2;
+		if (attrs[mid].type < type)
+			low = mid + 1;
+		else if (attrs[mid].type > type)
+			high = mid;
+		else
+			return attrs + mid;
+	}
+
+	return NULL;
+}
+
 void
 p11_attrs_purge (CK_ATTRIBUTE *attrs)
 {
@@ -472,6 +588,28 @@ p11_attrs_matchn (const CK_ATTRIBUTE *attrs,
 
 }
 
+/*
+ * Both the attributes and the match must be sorted by type, so that
+ * they can be walked together.
+ */
+bool
+p11_attrs_match_sorted (const CK_ATTRIBUTE *attrs,
+                        const CK_ATTRIBUTE *match)
+{
+	if (attrs == NULL)
+		return p11_attrs_terminator (match);
+
+	for (; !p11_attrs_terminator (match); match++) {
+		while (attrs->type < match->type)
+			attrs++;
+		if (attrs->type != match->type)
+			return false;
+		if (!p11_attr_equal (attrs, match))
+			return false;
+	}
+
+	return true;
+}
 
 bool
 p11_attr_match_value (const CK_ATTRIBUTE *attr,
@@ -40,8 +40,14 @@
 #include "compat.h"
 #include "pkcs11.h"
 
+#include <stdint.h>
+
 #define CKA_INVALID ((CK_ULONG)-1)
 
+/* The room a value takes up so that the next one is aligned for a CK_ULONG */
+#define P11_ATTR_VALUE_ALIGN(len) \
+	((((len) ? (len) : 1) + sizeof (CK_ULONG) - 1) & ~(sizeof (CK_ULONG) - 1))
+
 CK_ATTRIBUTE *      p11_attrs_dup           (const CK_ATTRIBUTE *attrs);
 
 CK_ATTRIBUTE *      p11_attrs_build         (CK_ATTRIBUTE *attrs,
@@ -103,6 +109,16 @@ CK_ATTRIBUTE *      p11_attrs_find_valid    (CK_ATTRIBUTE *attrs,
 bool                p11_attrs_remove        (CK_ATTRIBUTE *attrs,
                                              CK_ATTRIBUTE_TYPE type);
 
+void                p11_attrs_sort          (CK_ATTRIBUTE *attrs,
+                                             CK_ULONG count);
+
+CK_ATTRIBUTE *      p11_attrs_find_sorted   (CK_ATTRIBUTE *attrs,
+                                             CK_ULONG count,
+                                             CK_ATTRIBUTE_TYPE type);
+
+uint64_t            p11_attrs_bits          (const CK_ATTRIBUTE *attrs,
+                                             CK_ULONG count);
+
 bool                p11_attrs_match         (const CK_ATTRIBUTE *attrs,
                                              const CK_ATTRIBUTE *match);
 
@@ -110,6 +126,9 @@ bool                p11_attrs_matchn        (const CK_ATTRIBUTE *attrs,
                                              const CK_ATTRIBUTE *match,
                                              CK_ULONG count);
 
+bool                p11_attrs_match_sorted  (const CK_ATTRIBUTE *attrs,
+                                             const CK_ATTRIBUTE *match);
+
 char *              p11_attrs_to_string     (const CK_ATTRIBUTE *attrs,
                                              int count);
 
@@ -121,6 +121,26 @@ typedef DWORD p11_thread_id_t;
 #define p11_mutex_uninit(m) \
 	(DeleteCriticalSection (m))
 
+/* Readers are serialized, slim reader/writer locks need Vista */
+typedef CRITICAL_SECTION p11_rwlock_t;
+
+#define p11_rwlock_init(l) \
+	(InitializeCriticalSection (l))
+#define p11_rwlock_rdlock(l) \
+	(EnterCriticalSection (l))
+#define p11_rwlock_wrlock(l) \
+	(EnterCriticalSection (l))
+#define p11_rwlock_unlock(l) \
+	(LeaveCriticalSection (l))
+#define p11_rwlock_uninit(l) \
+	(DeleteCriticalSection (l))
+
+/* Counters bumped under the read lock, which is exclusive here */
+#define p11_counter_inc(c) \
+	((*(c))++)
+#define p11_counter_get(c) \
+	(*(c))
+
 typedef void * (*p11_thread_routine) (void *arg);
 
 int p11_thread_create (p11_thread_t *thread, p11_thread_routine, void *arg);
@@ -176,6 +196,32 @@ void        p11_mutex_init          (p11_mutex_t *mutex);
 #define p11_mutex_uninit(m) \
 	(pthread_mutex_destroy(m))
 
+typedef pthread_rwlock_t p11_rwlock_t;
+
+#define p11_rwlock_init(l) \
+	(pthread_rwlock_init ((l), NULL))
+#define p11_rwlock_rdlock(l) \
+	(pthread_rwlock_rdlock (l))
+#define p11_rwlock_wrlock(l) \
+	(pthread_rwlock_wrlock (l))
+#define p11_rwlock_unlock(l) \
+	(pthread_rwlock_unlock (l))
+#define p11_rwlock_uninit(l) \
+	(pthread_rwlock_destroy (l))
+
+/* Counters bumped by readers holding the read lock at the same time */
+#if defined (__GNUC__)
+#define p11_counter_inc(c) \
+	(__atomic_add_fetch ((c), 1, __ATOMIC_RELAXED))
+#define p11_counter_get(c) \
+	(__atomic_load_n ((c), __ATOMIC_RELAXED))
+#else
+#define p11_counter_inc(c) \
+	((*(c))++)
+#define p11_counter_get(c) \
+	(*(c))
+#endif
+
 typedef pthread_t p11_thread_t;
 
 typedef pthread_t p11_thread_id_t;
@@ -0,0 +1,306 @@
+/*
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#include "config.h"
+
+#include "attrs.h"
+#include "buffer.h"
+#define P11_DEBUG_FLAG P11_DEBUG_TRUST
+#include "debug.h"
+#include "image.h"
+#include "pkcs11.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * An image holds the complete set of objects of a trust token, as built
+ * by the trust module: certificates along with the NSS trust objects,
+ * trust assertions and stapled extensions generated for them. It is
+ * written in the byte order and word size of the host:
+ *
+ *  - magic, version, byte order mark, sizeof (CK_ULONG), number of objects
+ *  - for each object the number of attributes, followed by the type,
+ *    length and value of each attribute
+ *
+ * Every field and every value starts on an 8 byte boundary, so that the
+ * image can be mapped into memory and used in place.
+ */
+
+#define IMAGE_MAGIC "p11-kit-image"
+#define IMAGE_MAGIC_LEN 16
+#define IMAGE_VERSION 1
+#define IMAGE_BYTE_ORDER 0x01020304U
+#define IMAGE_NULL_VALUE 0xFFFFFFFFU
+#define IMAGE_HEADER_LEN (IMAGE_MAGIC_LEN + 32)
+#define IMAGE_ALIGN 8
+
+typedef struct {
+	const unsigned char *data;
+	size_t length;
+	size_t offset;
+	bool failed;
+} image_reader;
+
+static const unsigned char *
+reader_bytes (image_reader *reader,
+              size_t length)
+{
+	const unsigned char *data;
+	size_t padded;
+
+	padded = (length + (IMAGE_ALIGN - 1)) & ~(size_t)(IMAGE_ALIGN - 1);
+	if (reader->failed || padded < length ||
+	    reader->length - reader->offset < padded) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	data = reader->data + reader->offset;
+	reader->offset += padded;
+	return data;
+}
+
+static uint32_t
+reader_uint32 (image_reader *reader)
+{
+	const unsigned char *data;
+	uint32_t value = 0;
+
+	data = reader_bytes (reader, sizeof (value));
+	if (data != NULL)
+		memcpy (&value, data, sizeof (value));
+	return value;
+}
+
+static uint64_t
+reader_uint64 (image_reader *reader)
+{
+	const unsigned char *data;
+	uint64_t value = 0;
+
+	data = reader_bytes (reader, sizeof (value));
+	if (data != NULL)
+		memcpy (&value, data, sizeof (value));
+	return value;
+}
+
+static void
+buffer_add_aligned (p11_buffer *buffer,
+                    const void *data,
+                    size_t length)
+{
+	static const unsigned char zeros[IMAGE_ALIGN] = { 0, };
+
+	p11_buffer_add (buffer, data, length);
+	if (length % IMAGE_ALIGN)
+		p11_buffer_add (buffer, zeros, IMAGE_ALIGN - (length % IMAGE_ALIGN));
+}
+
+static void
+buffer_add_uint32 (p11_buffer *buffer,
+                   uint32_t value)
+{
+	buffer_add_aligned (buffer, &value, sizeof (value));
+}
+
+static void
+buffer_add_uint64 (p11_buffer *buffer,
+                   uint64_t value)
+{
+	buffer_add_aligned (buffer, &value, sizeof (value));
+}
+
+bool
+p11_image_check (const unsigned char *data,
+                 size_t length)
+{
+	return_val_if_fail (data != NULL || length == 0, false);
+
+	return length >= IMAGE_HEADER_LEN &&
+	       memcmp (data, IMAGE_MAGIC, sizeof (IMAGE_MAGIC)) == 0;
+}
+
+static bool
+image_read (const unsigned char *data,
+            size_t length,
+            bool copy,
+            p11_array **objects)
+{
+	image_reader reader = { data, length, 0, false };
+	const unsigned char *value;
+	CK_ATTRIBUTE *attrs;
+	p11_array *result;
+	uint32_t num_objects;
+	uint32_t num_attrs;
+	uint32_t value_len;
+	uint32_t i, j;
+
+	return_val_if_fail (objects != NULL, false);
+
+	if (!p11_image_check (data, length))
+		return false;
+
+	reader_bytes (&reader, IMAGE_MAGIC_LEN);
+	if (reader_uint32 (&reader) != IMAGE_VERSION ||
+	    reader_uint32 (&reader) != IMAGE_BYTE_ORDER ||
+	    reader_uint32 (&reader) != sizeof (CK_ULONG)) {
+		p11_debug ("image has a different version, byte order or word size");
+		return false;
+	}
+
+	num_objects = reader_uint32 (&reader);
+	result = p11_array_new (copy ? p11_attrs_free : free);
+	return_val_if_fail (result != NULL, false);
+
+	for (i = 0; !reader.failed && i < num_objects; i++) {
+		num_attrs = reader_uint32 (&reader);
+
+		/* Each attribute takes at least 16 bytes */
+		if (num_attrs > (reader.length - reader.offset) / 16) {
+			reader.failed = true;
+			break;
+		}
+
+		attrs = calloc (num_attrs + 1, sizeof (CK_ATTRIBUTE));
+		if (attrs == NULL) {
+			p11_array_free (result);
+			return_val_if_reached (false);
+		}
+
+		for (j = 0; !reader.failed && j < num_attrs; j++) {
+			attrs[j].type = reader_uint64 (&reader);
+			value_len = reader_uint32 (&reader);
+			if (value_len == IMAGE_NULL_VALUE)
+				continue;
+
+			value = reader_bytes (&reader, value_len);
+			if (value == NULL)
+				break;
+
+			if (copy) {
+				attrs[j].pValue = malloc (value_len ? value_len : 1);
+				if (attrs[j].pValue == NULL) {
+					attrs[j].type = CKA_INVALID;
+					p11_attrs_free (attrs);
+					p11_array_free (result);
+					return_val_if_reached (false);
+				}
+				memcpy (attrs[j].pValue, value, value_len);
+			} else {
+				attrs[j].pValue = (void *)value;
+			}
+			attrs[j].ulValueLen = value_len;
+		}
+
+		attrs[j].type = CKA_INVALID;
+		if (!p11_array_push (result, attrs)) {
+			if (copy)
+				p11_attrs_free (attrs);
+			else
+				free (attrs);
+			p11_array_free (result);
+			return_val_if_reached (false);
+		}
+	}
+
+	if (reader.failed || reader.offset != reader.length) {
+		p11_debug ("image is truncated or invalid");
+		p11_array_free (result);
+		return false;
+	}
+
+	*objects = result;
+	return true;
+}
+
+bool
+p11_image_read (const unsigned char *data,
+                size_t length,
+                p11_array **objects)
+{
+	return image_read (data, length, true, objects);
+}
+
+bool
+p11_image_view (const unsigned char *data,
+                size_t length,
+                p11_array **objects)
+{
+	/* Values are aligned in the image, so they can be used in place */
+	if ((uintptr_t)data % IMAGE_ALIGN != 0) {
+		p11_debug ("image is not aligned in memory");
+		return false;
+	}
+
+	return image_read (data, length, false, objects);
+}
+
+void
+p11_image_write (p11_buffer *buffer,
+                 p11_array *objects)
+{
+	char magic[IMAGE_MAGIC_LEN] = { 0, };
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG count;
+	CK_ULONG i;
+	int j;
+
+	return_if_fail (buffer != NULL);
+	return_if_fail (objects != NULL);
+
+	memcpy (magic, IMAGE_MAGIC, sizeof (IMAGE_MAGIC));
+	buffer_add_aligned (buffer, magic, sizeof (magic));
+	buffer_add_uint32 (buffer, IMAGE_VERSION);
+	buffer_add_uint32 (buffer, IMAGE_BYTE_ORDER);
+	buffer_add_uint32 (buffer, sizeof (CK_ULONG));
+	buffer_add_uint32 (buffer, objects->num);
+
+	for (j = 0; j < objects->num; j++) {
+		attrs = objects->elem[j];
+		count = p11_attrs_count (attrs);
+		buffer_add_uint32 (buffer, count);
+
+		for (i = 0; i < count; i++) {
+			buffer_add_uint64 (buffer, attrs[i].type);
+			if (attrs[i].pValue == NULL) {
+				buffer_add_uint32 (buffer, IMAGE_NULL_VALUE);
+			} else {
+				buffer_add_uint32 (buffer, attrs[i].ulValueLen);
+				buffer_add_aligned (buffer, attrs[i].pValue, attrs[i].ulValueLen);
+			}
+		}
+	}
+}
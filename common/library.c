@@ -59,6 +59,8 @@ static p11_local * _p11_library_get_thread_local (void);
 
 p11_mutex_t p11_library_mutex;
 
+p11_rwlock_t p11_library_rwlock;
+
 #ifdef OS_UNIX
 pthread_once_t p11_library_once;
 #endif
@@ -109,6 +111,7 @@ p11_library_init_impl (void)
 	p11_debug_init ();
 	p11_debug ("initializing library");
 	p11_mutex_init (&p11_library_mutex);
+	p11_rwlock_init (&p11_library_rwlock);
 	pthread_key_create (&thread_local, free);
 	p11_message_storage = thread_local_message;
 }
@@ -130,6 +133,7 @@ p11_library_uninit (void)
 
 	p11_message_storage = dont_store_message;
 	pthread_key_delete (thread_local);
+	p11_rwlock_uninit (&p11_library_rwlock);
 	p11_mutex_uninit (&p11_library_mutex);
 }
 
@@ -164,6 +168,7 @@ p11_library_init (void)
 	p11_debug_init ();
 	p11_debug ("initializing library");
 	p11_mutex_init (&p11_library_mutex);
+	p11_rwlock_init (&p11_library_rwlock);
 	thread_local = TlsAlloc ();
 	if (thread_local == TLS_OUT_OF_INDEXES)
 		p11_debug ("couldn't setup tls");
@@ -195,6 +200,7 @@ p11_library_uninit (void)
 		LocalFree (data);
 		TlsFree (thread_local);
 	}
+	p11_rwlock_uninit (&p11_library_rwlock);
 	p11_mutex_uninit (&p11_library_mutex);
 }
 
@@ -48,6 +48,14 @@ extern p11_mutex_t p11_library_mutex;
 
 #define       p11_unlock()                 p11_mutex_unlock (&p11_library_mutex);
 
+extern p11_rwlock_t p11_library_rwlock;
+
+#define       p11_lock_read()              p11_rwlock_rdlock (&p11_library_rwlock);
+
+#define       p11_lock_write()             p11_rwlock_wrlock (&p11_library_rwlock);
+
+#define       p11_unlock_rw()              p11_rwlock_unlock (&p11_library_rwlock);
+
 #ifdef OS_WIN32
 
 /* No implementation, because done by DllMain */
@@ -58,74 +58,15 @@ enum {
 	CERTIFICATE
 };
 
-static const char *
-pem_find_begin (const char *data,
-                size_t n_data,
-                char **type)
-{
-	const char *pref, *suff;
-
-	/* Look for a prefix */
-	pref = strnstr ((char *)data, ARMOR_PREF_BEGIN, n_data);
-	if (!pref)
-		return NULL;
-
-	n_data -= (pref - data) + ARMOR_PREF_BEGIN_L;
-	data = pref + ARMOR_PREF_BEGIN_L;
-
-	/* Look for the end of that begin */
-	suff = strnstr ((char *)data, ARMOR_SUFF, n_data);
-	if (!suff)
-		return NULL;
-
-	/* Make sure on the same line */
-	if (memchr (pref, '\n', suff - pref))
-		return NULL;
-
-	if (type) {
-		pref += ARMOR_PREF_BEGIN_L;
-		assert (suff > pref);
-		*type = malloc (suff - pref + 1);
-		return_val_if_fail (*type != NULL, NULL);
-		memcpy (*type, pref, suff - pref);
-		(*type)[suff - pref] = 0;
-	}
-
-	/* The byte after this ---BEGIN--- */
-	return suff + ARMOR_SUFF_L;
-}
-
-static const char *
-pem_find_end (const char *data,
-              size_t n_data,
-              const char *type)
-{
-	const char *pref;
-	size_t n_type;
-
-	/* Look for a prefix */
-	pref = strnstr (data, ARMOR_PREF_END, n_data);
-	if (!pref)
-		return NULL;
-
-	n_data -= (pref - data) + ARMOR_PREF_END_L;
-	data = pref + ARMOR_PREF_END_L;
-
-	/* Next comes the type string */
-	n_type = strlen (type);
-	if (n_type > n_data || strncmp ((char *)data, type, n_type) != 0)
-		return NULL;
-
-	n_data -= n_type;
-	data += n_type;
-
-	/* Next comes the suffix */
-	if (ARMOR_SUFF_L > n_data || strncmp ((char *)data, ARMOR_SUFF, ARMOR_SUFF_L) != 0)
-		return NULL;
-
-	/* The end of the data */
-	return pref;
-}
+struct _p11_pem_stream {
+	p11_pem_sink sink;
+	void *user_data;
+	p11_buffer line;
+	p11_buffer block;
+	char *type;
+	unsigned int nfound;
+	bool done;
+};
 
 static unsigned char *
 pem_parse_block (const char *data,
@@ -191,57 +132,193 @@ pem_parse_block (const char *data,
 	return decoded;
 }
 
-unsigned int
-p11_pem_parse (const char *data,
-               size_t n_data,
-               p11_pem_sink sink,
-               void *user_data)
+p11_pem_stream *
+p11_pem_stream_new (p11_pem_sink sink,
+                    void *user_data)
 {
-	const char *beg, *end;
-	unsigned int nfound = 0;
-	unsigned char *decoded = NULL;
-	size_t n_decoded = 0;
-	char *type;
+	p11_pem_stream *stream;
 
-	assert (data != NULL);
+	stream = calloc (1, sizeof (p11_pem_stream));
+	return_val_if_fail (stream != NULL, NULL);
 
-	while (n_data > 0) {
+	stream->sink = sink;
+	stream->user_data = user_data;
 
-		/* This returns the first character after the PEM BEGIN header */
-		beg = pem_find_begin (data, n_data, &type);
-		if (beg == NULL)
-			break;
+	if (!p11_buffer_init_null (&stream->line, 128) ||
+	    !p11_buffer_init_null (&stream->block, 4096))
+		return_val_if_reached (NULL);
 
-		assert (type != NULL);
+	return stream;
+}
 
-		/* This returns the character position before the PEM END header */
-		end = pem_find_end (beg, n_data - (beg - data), type);
-		if (end == NULL) {
-			free (type);
-			break;
+static void
+pem_stream_block (p11_pem_stream *stream)
+{
+	unsigned char *decoded;
+	size_t n_decoded = 0;
+
+	return_if_fail (p11_buffer_ok (&stream->block));
+
+	if (stream->block.len > 0) {
+		decoded = pem_parse_block (stream->block.data, stream->block.len, &n_decoded);
+		if (decoded) {
+			if (stream->sink != NULL)
+				(stream->sink) (stream->type, decoded, n_decoded, stream->user_data);
+			++stream->nfound;
+			free (decoded);
 		}
+	}
+
+	free (stream->type);
+	stream->type = NULL;
+	p11_buffer_reset (&stream->block, 0);
+}
 
-		if (beg != end) {
-			decoded = pem_parse_block (beg, end - beg, &n_decoded);
-			if (decoded) {
-				if (sink != NULL)
-					(sink) (type, decoded, n_decoded, user_data);
-				++nfound;
-				free (decoded);
+/*
+ * Scan one line of input, including its trailing newline if it has
+ * one. The armor lines of a block must each start and end within a
+ * line, so looking at one line at a time is enough to find them, and
+ * only the contents of the current block need to be kept around.
+ */
+static void
+pem_stream_line (p11_pem_stream *stream,
+                 const char *data,
+                 size_t n_data)
+{
+	const char *pref, *suff;
+	size_t n_type;
+
+	while (n_data > 0 && !stream->done) {
+
+		/* Outside of a block look for the BEGIN armor */
+		if (stream->type == NULL) {
+			pref = strnstr (data, ARMOR_PREF_BEGIN, n_data);
+			if (!pref)
+				return;
+
+			n_data -= (pref - data) + ARMOR_PREF_BEGIN_L;
+			data = pref + ARMOR_PREF_BEGIN_L;
+
+			/* The end of that begin must be on the same line */
+			suff = strnstr (data, ARMOR_SUFF, n_data);
+			if (!suff) {
+				stream->done = true;
+				return;
+			}
+
+			stream->type = strndup (data, suff - data);
+			return_if_fail (stream->type != NULL);
+
+			/* The bytes after this ---BEGIN--- */
+			n_data -= (suff - data) + ARMOR_SUFF_L;
+			data = suff + ARMOR_SUFF_L;
+
+		/* Inside of a block look for the END armor */
+		} else {
+			pref = strnstr (data, ARMOR_PREF_END, n_data);
+			if (!pref) {
+				p11_buffer_add (&stream->block, data, n_data);
+				return;
+			}
+
+			p11_buffer_add (&stream->block, data, pref - data);
+			n_data -= (pref - data) + ARMOR_PREF_END_L;
+			data = pref + ARMOR_PREF_END_L;
+
+			/* Next comes the type string, and then the suffix */
+			n_type = strlen (stream->type);
+			if (n_type + ARMOR_SUFF_L > n_data ||
+			    strncmp (data, stream->type, n_type) != 0 ||
+			    strncmp (data + n_type, ARMOR_SUFF, ARMOR_SUFF_L) != 0) {
+				stream->done = true;
+				return;
 			}
+
+			pem_stream_block (stream);
+
+			/* Try for another block */
+			n_data -= n_type + ARMOR_SUFF_L;
+			data += n_type + ARMOR_SUFF_L;
 		}
+	}
+}
+
+void
+p11_pem_stream_feed (p11_pem_stream *stream,
+                     const char *data,
+                     size_t n_data)
+{
+	const char *line;
+	size_t length;
+
+	return_if_fail (stream != NULL);
+	return_if_fail (data != NULL || n_data == 0);
 
-		free (type);
+	while (n_data > 0 && !stream->done) {
+		line = memchr (data, '\n', n_data);
 
-		/* Try for another block */
-		end += ARMOR_SUFF_L;
-		n_data -= (const char *)end - (const char *)data;
-		data = end;
+		/* An incomplete line, hold on to it until more comes */
+		if (line == NULL) {
+			p11_buffer_add (&stream->line, data, n_data);
+			return_if_fail (p11_buffer_ok (&stream->line));
+			return;
+		}
+
+		length = (line - data) + 1;
+
+		/* Scan complete lines in place, unless they were split */
+		if (stream->line.len > 0) {
+			p11_buffer_add (&stream->line, data, length);
+			return_if_fail (p11_buffer_ok (&stream->line));
+			pem_stream_line (stream, stream->line.data, stream->line.len);
+			p11_buffer_reset (&stream->line, 0);
+		} else {
+			pem_stream_line (stream, data, length);
+		}
+
+		n_data -= length;
+		data += length;
 	}
+}
+
+unsigned int
+p11_pem_stream_finish (p11_pem_stream *stream)
+{
+	unsigned int nfound;
+
+	return_val_if_fail (stream != NULL, 0);
+
+	/* The last line need not end with a newline */
+	if (stream->line.len > 0)
+		pem_stream_line (stream, stream->line.data, stream->line.len);
+
+	/* A block without an END is ignored */
+	nfound = stream->nfound;
+	p11_buffer_uninit (&stream->line);
+	p11_buffer_uninit (&stream->block);
+	free (stream->type);
+	free (stream);
 
 	return nfound;
 }
 
+unsigned int
+p11_pem_parse (const char *data,
+               size_t n_data,
+               p11_pem_sink sink,
+               void *user_data)
+{
+	p11_pem_stream *stream;
+
+	assert (data != NULL);
+
+	stream = p11_pem_stream_new (sink, user_data);
+	return_val_if_fail (stream != NULL, 0);
+
+	p11_pem_stream_feed (stream, data, n_data);
+	return p11_pem_stream_finish (stream);
+}
+
 char *
 p11_pem_write (const unsigned char *contents,
                size_t length,
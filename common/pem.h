@@ -47,6 +47,17 @@ unsigned int   p11_pem_parse     (const char *input,
                                   p11_pem_sink sink,
                                   void *user_data);
 
+typedef struct _p11_pem_stream p11_pem_stream;
+
+p11_pem_stream * p11_pem_stream_new    (p11_pem_sink sink,
+                                        void *user_data);
+
+void             p11_pem_stream_feed   (p11_pem_stream *stream,
+                                        const char *input,
+                                        size_t length);
+
+unsigned int     p11_pem_stream_finish (p11_pem_stream *stream);
+
 char *         p11_pem_write     (const unsigned char *contents,
                                   size_t length,
                                   const char *type,
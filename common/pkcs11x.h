@@ -587,6 +587,47 @@ struct _CK_X_FUNCTION_LIST {
 	CK_X_WaitForSlotEvent C_WaitForSlotEvent;
 };
 
+/* -------------------------------------------------------------------
+ * VENDOR FUNCTIONS
+ *
+ * A module that implements these exports a C_X_GetVendorFunctionList()
+ * entry point next to C_GetFunctionList(). The functions are passed the
+ * CK_FUNCTION_LIST that the session was opened with.
+ *
+ * C_X_FindObjectsAttributes() continues a C_FindObjectsInit() search like
+ * C_FindObjects() does, and also retrieves the values of a template for
+ * each object it returns. The template is passed as max_count rows of
+ * template_count attributes, with the types filled in. The row of each
+ * returned object is filled in with pValue pointing to the value in the
+ * buffer, aligned for a CK_ULONG, or NULL with a ulValueLen of -1 when the
+ * object has no such attribute. Like C_GetAttributeValue(), the objects are
+ * returned with CKR_ATTRIBUTE_TYPE_INVALID when any of them lacks one of
+ * the attributes. The number of bytes of buffer that were used is returned
+ * in buffer_len. Objects that don't fit are returned by
+ * the next call, and if the first one doesn't fit CKR_BUFFER_TOO_SMALL is
+ * returned with the size it needs in buffer_len. A count of zero means
+ * that there are no more objects.
+ */
+
+typedef struct _CK_X_VENDOR_FUNCTION_LIST CK_X_VENDOR_FUNCTION_LIST;
+
+typedef CK_RV (* CK_X_GetVendorFunctionList) (CK_X_VENDOR_FUNCTION_LIST **);
+
+typedef CK_RV (* CK_X_FindObjectsAttributes) (CK_FUNCTION_LIST_PTR,
+                                              CK_SESSION_HANDLE,
+                                              CK_OBJECT_HANDLE_PTR,
+                                              CK_ULONG,
+                                              CK_ULONG_PTR,
+                                              CK_ATTRIBUTE_PTR,
+                                              CK_ULONG,
+                                              CK_BYTE_PTR,
+                                              CK_ULONG_PTR);
+
+struct _CK_X_VENDOR_FUNCTION_LIST {
+	CK_VERSION version;
+	CK_X_FindObjectsAttributes C_X_FindObjectsAttributes;
+};
+
 #if defined(__cplusplus)
 }
 #endif
@@ -0,0 +1,297 @@
+/*
+ * Copyright (c) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#include "config.h"
+#include "compat.h"
+
+#include "asn1.h"
+#include "debug.h"
+#include "oid.h"
+#include "pem.h"
+#include "x509.h"
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Compares reading the commonly used certificate fields with libtasn1,
+ * against the DER walker in p11_x509_read_fields(). Both read the same
+ * fields that the trust module builder uses from each certificate.
+ */
+
+typedef struct {
+	const unsigned char *field[6];
+	size_t field_len[6];
+	unsigned char *ext;
+	size_t ext_len;
+	char *label;
+} cert_fields;
+
+typedef struct {
+	unsigned char *der;
+	size_t length;
+} cert_der;
+
+static const char *asn1_fields[6] = {
+	"tbsCertificate.serialNumber",
+	"tbsCertificate.issuer",
+	"tbsCertificate.subject",
+	"tbsCertificate.validity.notBefore",
+	"tbsCertificate.validity.notAfter",
+	"tbsCertificate.subjectPublicKeyInfo",
+};
+
+static double
+now (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static void
+on_pem_block (const char *type,
+              const unsigned char *contents,
+              size_t length,
+              void *user_data)
+{
+	p11_array *certs = user_data;
+	cert_der *cert;
+
+	if (strcmp (type, "CERTIFICATE") != 0)
+		return;
+
+	cert = malloc (sizeof (cert_der));
+	return_if_fail (cert != NULL);
+	cert->der = memdup (contents, length);
+	return_if_fail (cert->der != NULL);
+	cert->length = length;
+
+	if (!p11_array_push (certs, cert))
+		return_if_reached ();
+}
+
+static void
+cert_der_free (void *data)
+{
+	cert_der *cert = data;
+	free (cert->der);
+	free (cert);
+}
+
+static bool
+read_with_asn1 (p11_dict *defs,
+                const unsigned char *der,
+                size_t der_len,
+                cert_fields *out)
+{
+	node_asn *cert;
+	int start, end;
+	int i;
+
+	cert = p11_asn1_decode (defs, "PKIX1.Certificate", der, der_len, NULL);
+	if (cert == NULL)
+		return false;
+
+	for (i = 0; i < 6; i++) {
+		if (asn1_der_decoding_startEnd (cert, der, der_len, asn1_fields[i],
+		                                &start, &end) != ASN1_SUCCESS)
+			return false;
+		out->field[i] = der + start;
+		out->field_len[i] = (end - start) + 1;
+	}
+
+	out->ext = p11_x509_find_extension (cert, P11_OID_BASIC_CONSTRAINTS,
+	                                    der, der_len, &out->ext_len);
+	out->label = p11_x509_lookup_dn_name (cert, "tbsCertificate.subject",
+	                                      der, der_len, P11_OID_CN);
+
+	asn1_delete_structure (&cert);
+	return true;
+}
+
+static bool
+read_with_walker (const unsigned char *der,
+                  size_t der_len,
+                  cert_fields *out)
+{
+	p11_x509_fields fields;
+
+	if (!p11_x509_read_fields (der, der_len, &fields))
+		return false;
+
+	out->field[0] = fields.serial;
+	out->field_len[0] = fields.serial_len;
+	out->field[1] = fields.issuer;
+	out->field_len[1] = fields.issuer_len;
+	out->field[2] = fields.subject;
+	out->field_len[2] = fields.subject_len;
+	out->field[3] = fields.not_before;
+	out->field_len[3] = fields.not_before_len;
+	out->field[4] = fields.not_after;
+	out->field_len[4] = fields.not_after_len;
+	out->field[5] = fields.public_key;
+	out->field_len[5] = fields.public_key_len;
+
+	out->ext = p11_x509_fields_extension (&fields, P11_OID_BASIC_CONSTRAINTS, &out->ext_len);
+	out->label = p11_x509_find_dn_name (fields.subject, fields.subject_len, P11_OID_CN);
+	return true;
+}
+
+static bool
+fields_equal (cert_fields *one,
+              cert_fields *two)
+{
+	int i;
+
+	for (i = 0; i < 6; i++) {
+		if (one->field[i] != two->field[i] || one->field_len[i] != two->field_len[i])
+			return false;
+	}
+
+	if (!one->ext != !two->ext)
+		return false;
+	if (one->ext && (one->ext_len != two->ext_len ||
+	                 memcmp (one->ext, two->ext, one->ext_len) != 0))
+		return false;
+
+	if (!one->label != !two->label)
+		return false;
+	return !one->label || strcmp (one->label, two->label) == 0;
+}
+
+static void
+fields_clear (cert_fields *fields)
+{
+	free (fields->ext);
+	free (fields->label);
+	memset (fields, 0, sizeof (cert_fields));
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	cert_fields with_asn1;
+	cert_fields with_walker;
+	p11_array *certs;
+	cert_der *cert;
+	p11_dict *defs;
+	p11_mmap *map;
+	double asn1_secs;
+	double walker_secs;
+	double start;
+	int mismatches;
+	int fallbacks;
+	int count;
+	void *data;
+	size_t size;
+	int i, j;
+
+	if (argc < 2 || argc > 3) {
+		fprintf (stderr, "usage: frob-x509 bundle.pem [count]\n");
+		return 2;
+	}
+
+	count = argc == 3 ? atoi (argv[2]) : 100;
+	if (count < 1) {
+		fprintf (stderr, "frob-x509: invalid count\n");
+		return 2;
+	}
+
+	map = p11_mmap_open (argv[1], &data, &size);
+	if (map == NULL) {
+		fprintf (stderr, "frob-x509: couldn't open file: %s\n", argv[1]);
+		return 1;
+	}
+
+	certs = p11_array_new (cert_der_free);
+	p11_pem_parse (data, size, on_pem_block, certs);
+	p11_mmap_close (map);
+
+	if (certs->num == 0) {
+		fprintf (stderr, "frob-x509: no certificates in file: %s\n", argv[1]);
+		return 1;
+	}
+
+	defs = p11_asn1_defs_load ();
+	return_val_if_fail (defs != NULL, 1);
+
+	/* First check that both find the same thing */
+	mismatches = fallbacks = 0;
+	for (i = 0; i < certs->num; i++) {
+		cert = certs->elem[i];
+		memset (&with_asn1, 0, sizeof (with_asn1));
+		memset (&with_walker, 0, sizeof (with_walker));
+		if (!read_with_walker (cert->der, cert->length, &with_walker))
+			fallbacks++;
+		else if (!read_with_asn1 (defs, cert->der, cert->length, &with_asn1) ||
+		         !fields_equal (&with_asn1, &with_walker))
+			mismatches++;
+		fields_clear (&with_asn1);
+		fields_clear (&with_walker);
+	}
+
+	start = now ();
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < certs->num; i++) {
+			cert = certs->elem[i];
+			read_with_asn1 (defs, cert->der, cert->length, &with_asn1);
+			fields_clear (&with_asn1);
+		}
+	}
+	asn1_secs = now () - start;
+
+	start = now ();
+	for (j = 0; j < count; j++) {
+		for (i = 0; i < certs->num; i++) {
+			cert = certs->elem[i];
+			read_with_walker (cert->der, cert->length, &with_walker);
+			fields_clear (&with_walker);
+		}
+	}
+	walker_secs = now () - start;
+
+	printf ("certificates: %d, fallbacks: %d, mismatches: %d\n", certs->num, fallbacks, mismatches);
+	printf ("libtasn1: %8.2f us per certificate\n", asn1_secs * 1000000.0 / (certs->num * count));
+	printf ("walker:   %8.2f us per certificate\n", walker_secs * 1000000.0 / (certs->num * count));
+
+	p11_array_free (certs);
+	p11_asn1_defs_unref (defs);
+
+	return mismatches == 0 ? 0 : 1;
+}
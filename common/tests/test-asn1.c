@@ -36,6 +36,7 @@
 #include "test.h"
 
 #include "asn1.h"
+#include "compat.h"
 #include "debug.h"
 #include "oid.h"
 #include "x509.h"
@@ -58,7 +59,7 @@ setup (void *unused)
 static void
 teardown (void *unused)
 {
-	p11_dict_free (test.asn1_defs);
+	p11_asn1_defs_unref (test.asn1_defs);
 	memset (&test, 0, sizeof (test));
 }
 
@@ -130,15 +131,183 @@ test_asn1_cache (void)
 	p11_asn1_cache_free (cache);
 }
 
+static void
+test_asn1_cache_steal (void)
+{
+	p11_asn1_cache *cache;
+	node_asn *asn;
+	node_asn *check;
+
+	cache = p11_asn1_cache_new ();
+	assert_ptr_not_null (cache);
+
+	asn = p11_asn1_decode (p11_asn1_cache_defs (cache), "PKIX1.ExtKeyUsageSyntax",
+	                       test_eku_server_and_client,
+	                       sizeof (test_eku_server_and_client), NULL);
+	assert_ptr_not_null (asn);
+
+	p11_asn1_cache_take (cache, asn, "PKIX1.ExtKeyUsageSyntax",
+	                     test_eku_server_and_client,
+	                     sizeof (test_eku_server_and_client));
+
+	/* Stealing removes it from the cache, without freeing it */
+	check = p11_asn1_cache_steal (cache, "PKIX1.ExtKeyUsageSyntax",
+	                              test_eku_server_and_client,
+	                              sizeof (test_eku_server_and_client));
+	assert_ptr_eq (asn, check);
+
+	check = p11_asn1_cache_get (cache, "PKIX1.ExtKeyUsageSyntax",
+	                            test_eku_server_and_client,
+	                            sizeof (test_eku_server_and_client));
+	assert_ptr_eq (NULL, check);
+
+	check = p11_asn1_cache_steal (cache, "PKIX1.ExtKeyUsageSyntax",
+	                              test_eku_server_and_client,
+	                              sizeof (test_eku_server_and_client));
+	assert_ptr_eq (NULL, check);
+
+	asn1_delete_structure (&asn);
+	p11_asn1_cache_free (cache);
+}
+
+static const unsigned char test_eku_server[] = {
+	0x30, 0x0a, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01,
+};
+
+static const unsigned char test_eku_client[] = {
+	0x30, 0x0a, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x02,
+};
+
+static node_asn *
+take_eku (p11_asn1_cache *cache,
+          const unsigned char *der,
+          size_t der_len)
+{
+	node_asn *asn;
+
+	asn = p11_asn1_decode (p11_asn1_cache_defs (cache), "PKIX1.ExtKeyUsageSyntax",
+	                       der, der_len, NULL);
+	assert_ptr_not_null (asn);
+
+	p11_asn1_cache_take (cache, asn, "PKIX1.ExtKeyUsageSyntax", der, der_len);
+	return asn;
+}
+
+static void
+test_asn1_cache_lru (void)
+{
+	p11_asn1_cache_stats stats;
+	p11_asn1_cache *cache;
+	unsigned char *copy;
+	node_asn *server;
+
+	cache = p11_asn1_cache_new ();
+	assert_ptr_not_null (cache);
+	p11_asn1_cache_set_max (cache, 2);
+
+	server = take_eku (cache, test_eku_server, sizeof (test_eku_server));
+	take_eku (cache, test_eku_server_and_client, sizeof (test_eku_server_and_client));
+
+	/* Items are found by the contents of their DER, not its address */
+	copy = memdup (test_eku_server, sizeof (test_eku_server));
+	assert_ptr_eq (server, p11_asn1_cache_get (cache, "PKIX1.ExtKeyUsageSyntax",
+	                                           copy, sizeof (test_eku_server)));
+	free (copy);
+
+	/* The least recently used item is thrown out to make room */
+	take_eku (cache, test_eku_client, sizeof (test_eku_client));
+	assert_ptr_eq (server, p11_asn1_cache_get (cache, "PKIX1.ExtKeyUsageSyntax",
+	                                           test_eku_server, sizeof (test_eku_server)));
+	assert_ptr_eq (NULL, p11_asn1_cache_get (cache, "PKIX1.ExtKeyUsageSyntax",
+	                                         test_eku_server_and_client,
+	                                         sizeof (test_eku_server_and_client)));
+
+	/* A smaller limit throws out items right away */
+	p11_asn1_cache_set_max (cache, 1);
+	assert_ptr_eq (NULL, p11_asn1_cache_get (cache, "PKIX1.ExtKeyUsageSyntax",
+	                                         test_eku_client, sizeof (test_eku_client)));
+
+	p11_asn1_cache_get_stats (cache, &stats);
+	assert_num_eq (2, stats.hits);
+	assert_num_eq (2, stats.misses);
+	assert_num_eq (2, stats.evictions);
+
+	p11_asn1_cache_free (cache);
+}
+
+static void
+test_defs_shared (void)
+{
+	p11_dict *defs;
+	node_asn *asn;
+
+	/* Everyone gets the same definitions */
+	defs = p11_asn1_defs_load ();
+	assert_ptr_eq (test.asn1_defs, defs);
+
+	asn = p11_asn1_create (defs, "BASIC.ObjectIdentifier");
+	assert_ptr_not_null (asn);
+	asn1_delete_structure (&asn);
+
+	p11_asn1_defs_unref (defs);
+
+	/* And they're still usable while a reference is held */
+	asn = p11_asn1_create (test.asn1_defs, "PKIX1.Certificate");
+	assert_ptr_not_null (asn);
+	asn1_delete_structure (&asn);
+}
+
+static void *
+defs_thread (void *data)
+{
+	int *failures = data;
+	p11_dict *defs;
+	node_asn *asn;
+	int i;
+
+	for (i = 0; i < 100; i++) {
+		defs = p11_asn1_defs_load ();
+		asn = p11_asn1_decode (defs, "PKIX1.ExtKeyUsageSyntax",
+		                       test_eku_server_and_client,
+		                       sizeof (test_eku_server_and_client), NULL);
+		if (asn == NULL)
+			(*failures)++;
+		asn1_delete_structure (&asn);
+		p11_asn1_defs_unref (defs);
+	}
+
+	return NULL;
+}
+
+static void
+test_defs_threads (void)
+{
+	p11_thread_t threads[4];
+	int failures[4] = { 0, };
+	int i;
+
+	/* Without a reference held, the threads load and free the definitions */
+	for (i = 0; i < 4; i++)
+		assert_num_eq (0, p11_thread_create (threads + i, defs_thread, failures + i));
+	for (i = 0; i < 4; i++) {
+		p11_thread_join (threads[i]);
+		assert_num_eq (0, failures[i]);
+	}
+}
+
 int
 main (int argc,
       char *argv[])
 {
 	p11_fixture (setup, teardown);
 	p11_test (test_tlv_length, "/asn1/tlv_length");
+	p11_test (test_defs_shared, "/asn1/defs_shared");
 
 	p11_fixture (NULL, NULL);
 	p11_test (test_asn1_cache, "/asn1/asn1_cache");
+	p11_test (test_asn1_cache_steal, "/asn1/asn1_cache_steal");
+	p11_test (test_asn1_cache_lru, "/asn1/asn1_cache_lru");
+	p11_test (test_defs_threads, "/asn1/defs_threads");
 
 	return p11_test_run (argc, argv);
 }
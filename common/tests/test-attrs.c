@@ -41,6 +41,7 @@
 
 #include "attrs.h"
 #include "debug.h"
+#include "pkcs11x.h"
 
 static void
 test_terminator (void)
@@ -625,6 +626,138 @@ test_matchn (void)
 	assert (!p11_attrs_matchn (attrs, extra, 3));
 }
 
+static void
+test_sort (void)
+{
+	CK_BBOOL vtrue = CK_TRUE;
+	CK_ATTRIBUTE *attr;
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_VALUE, "the value", 9 },
+		{ CKA_LABEL, "label", 5 },
+		{ CKA_X_DISTRUSTED, &vtrue, sizeof (vtrue) },
+		{ CKA_TOKEN, &vtrue, sizeof (vtrue) },
+		{ CKA_INVALID },
+	};
+
+	p11_attrs_sort (attrs, 4);
+	assert_num_eq (CKA_TOKEN, attrs[0].type);
+	assert_num_eq (CKA_LABEL, attrs[1].type);
+	assert_num_eq (CKA_VALUE, attrs[2].type);
+	assert_num_eq (CKA_X_DISTRUSTED, attrs[3].type);
+	assert_num_eq (5, attrs[1].ulValueLen);
+	assert (p11_attrs_terminator (attrs + 4));
+
+	attr = p11_attrs_find_sorted (attrs, 4, CKA_TOKEN);
+	assert_ptr_eq (attrs + 0, attr);
+
+	attr = p11_attrs_find_sorted (attrs, 4, CKA_VALUE);
+	assert_ptr_eq (attrs + 2, attr);
+
+	attr = p11_attrs_find_sorted (attrs, 4, CKA_X_DISTRUSTED);
+	assert_ptr_eq (attrs + 3, attr);
+
+	attr = p11_attrs_find_sorted (attrs, 4, CKA_ID);
+	assert_ptr_eq (NULL, attr);
+
+	attr = p11_attrs_find_sorted (attrs, 3, CKA_X_DISTRUSTED);
+	assert_ptr_eq (NULL, attr);
+
+	attr = p11_attrs_find_sorted (attrs, 0, CKA_TOKEN);
+	assert_ptr_eq (NULL, attr);
+}
+
+static void
+test_match_sorted (void)
+{
+	CK_BBOOL vtrue = CK_TRUE;
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_TOKEN, &vtrue, sizeof (vtrue) },
+		{ CKA_LABEL, "label", 5 },
+		{ CKA_VALUE, "the value", 9 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE subset[] = {
+		{ CKA_TOKEN, &vtrue, sizeof (vtrue) },
+		{ CKA_VALUE, "the value", 9 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE different[] = {
+		{ CKA_TOKEN, &vtrue, sizeof (vtrue) },
+		{ CKA_LABEL, "other", 5 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE extra[] = {
+		{ CKA_LABEL, "label", 5 },
+		{ CKA_ID, "id", 2 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE past[] = {
+		{ CKA_VALUE, "the value", 9 },
+		{ CKA_X_DISTRUSTED, &vtrue, sizeof (vtrue) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE empty[] = {
+		{ CKA_INVALID },
+	};
+
+	assert (p11_attrs_match_sorted (attrs, subset));
+	assert (p11_attrs_match_sorted (attrs, attrs));
+	assert (p11_attrs_match_sorted (attrs, empty));
+	assert (!p11_attrs_match_sorted (attrs, different));
+	assert (!p11_attrs_match_sorted (attrs, extra));
+	assert (!p11_attrs_match_sorted (attrs, past));
+	assert (!p11_attrs_match_sorted (NULL, subset));
+	assert (p11_attrs_match_sorted (NULL, empty));
+}
+
+static void
+test_bits (void)
+{
+	CK_BBOOL vtrue = CK_TRUE;
+	uint64_t bits;
+	int i;
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, NULL, 0 },
+		{ CKA_LABEL, "label", 5 },
+		{ CKA_VALUE, "the value", 9 },
+		{ CKA_TRUST_SERVER_AUTH, &vtrue, sizeof (vtrue) },
+		{ CKA_VENDOR_DEFINED | 0x1234, NULL, 0 },
+	};
+
+	CK_ATTRIBUTE_TYPE common[] = {
+		CKA_CLASS, CKA_TOKEN, CKA_PRIVATE, CKA_LABEL, CKA_VALUE,
+		CKA_OBJECT_ID, CKA_CERTIFICATE_TYPE, CKA_ISSUER, CKA_SERIAL_NUMBER,
+		CKA_TRUSTED, CKA_CERTIFICATE_CATEGORY, CKA_SUBJECT, CKA_ID,
+		CKA_MODIFIABLE, CKA_X_ASSERTION_TYPE, CKA_X_CERTIFICATE_VALUE,
+		CKA_X_PURPOSE, CKA_X_PEER, CKA_X_DISTRUSTED, CKA_X_CRITICAL,
+		CKA_CERT_SHA1_HASH, CKA_CERT_MD5_HASH, CKA_TRUST_SERVER_AUTH,
+		CKA_TRUST_CLIENT_AUTH, CKA_TRUST_STEP_UP_APPROVED,
+	};
+
+	assert (p11_attrs_bits (attrs, 0) == 0);
+
+	/* Every attribute is in the bits of the ones it's part of */
+	bits = p11_attrs_bits (attrs, 5);
+	for (i = 0; i < 5; i++)
+		assert ((bits & p11_attrs_bits (attrs + i, 1)) == p11_attrs_bits (attrs + i, 1));
+
+	/* The common attributes each have their own bit */
+	bits = 0;
+	for (i = 0; i < sizeof (common) / sizeof (common[0]); i++) {
+		attrs[0].type = common[i];
+		assert ((bits & p11_attrs_bits (attrs, 1)) == 0);
+		bits |= p11_attrs_bits (attrs, 1);
+	}
+}
+
 static void
 test_find_bool (void)
 {
@@ -743,6 +876,9 @@ main (int argc,
 	p11_test (test_free_null, "/attrs/free-null");
 	p11_test (test_match, "/attrs/match");
 	p11_test (test_matchn, "/attrs/matchn");
+	p11_test (test_sort, "/attrs/sort");
+	p11_test (test_match_sorted, "/attrs/match-sorted");
+	p11_test (test_bits, "/attrs/bits");
 	p11_test (test_find, "/attrs/find");
 	p11_test (test_findn, "/attrs/findn");
 	p11_test (test_find_bool, "/attrs/find-bool");
@@ -229,6 +229,56 @@ test_pem_failure (void)
 	}
 }
 
+static void
+test_pem_stream (void)
+{
+	p11_pem_stream *stream;
+	const char *input;
+	size_t length;
+	size_t chunk;
+	size_t off;
+	Closure cl;
+	int ret;
+	int i;
+	int j;
+
+	/* Feed the input in chunks of various sizes, including a byte at a time */
+	for (chunk = 1; chunk < 8; chunk++) {
+		for (i = 0; success_fixtures[i].input != NULL; i++) {
+			cl.input_index = i;
+			cl.output_index = 0;
+			cl.parsed = 0;
+
+			stream = p11_pem_stream_new (on_parse_pem_success, &cl);
+			assert_ptr_not_null (stream);
+
+			input = success_fixtures[i].input;
+			length = strlen (input);
+			for (off = 0; off < length; off += chunk)
+				p11_pem_stream_feed (stream, input + off, off + chunk > length ? length - off : chunk);
+			ret = p11_pem_stream_finish (stream);
+
+			assert (success_fixtures[i].output[cl.output_index].type == NULL);
+
+			for (j = 0; success_fixtures[i].output[j].type != NULL; j++);
+			assert_num_eq (j, ret);
+			assert_num_eq (ret, cl.parsed);
+		}
+
+		for (i = 0; failure_fixtures[i] != NULL; i++) {
+			stream = p11_pem_stream_new (on_parse_pem_failure, NULL);
+			assert_ptr_not_null (stream);
+
+			input = failure_fixtures[i];
+			length = strlen (input);
+			for (off = 0; off < length; off += chunk)
+				p11_pem_stream_feed (stream, input + off, off + chunk > length ? length - off : chunk);
+			ret = p11_pem_stream_finish (stream);
+			assert_num_eq (0, ret);
+		}
+	}
+}
+
 typedef struct {
 	const char *input;
 	size_t length;
@@ -333,6 +383,7 @@ main (int argc,
 {
 	p11_test (test_pem_success, "/pem/success");
 	p11_test (test_pem_failure, "/pem/failure");
+	p11_test (test_pem_stream, "/pem/stream");
 	p11_test (test_pem_write, "/pem/write");
 	return p11_test_run (argc, argv);
 }
@@ -60,7 +60,7 @@ setup (void *unused)
 static void
 teardown (void *unused)
 {
-	p11_dict_free (test.asn1_defs);
+	p11_asn1_defs_unref (test.asn1_defs);
 	memset (&test, 0, sizeof (test));
 }
 
@@ -321,6 +321,108 @@ test_parse_extension_not_found (void)
 	asn1_delete_structure (&cert);
 }
 
+static void
+assert_field_eq (node_asn *cert,
+                 const char *field,
+                 const unsigned char *value,
+                 size_t value_len)
+{
+	int start, end;
+	int ret;
+
+	ret = asn1_der_decoding_startEnd (cert, test_cacert3_ca_der, sizeof (test_cacert3_ca_der),
+	                                  field, &start, &end);
+	assert_num_eq (ASN1_SUCCESS, ret);
+	assert_num_eq ((end - start) + 1, value_len);
+	assert_ptr_eq (test_cacert3_ca_der + start, value);
+}
+
+static void
+test_read_fields (void)
+{
+	p11_x509_fields fields;
+	unsigned char *ext;
+	unsigned char *expected;
+	size_t length;
+	size_t expected_len;
+	node_asn *cert;
+	char *name;
+
+	cert = p11_asn1_decode (test.asn1_defs, "PKIX1.Certificate",
+	                        test_cacert3_ca_der, sizeof (test_cacert3_ca_der), NULL);
+	assert_ptr_not_null (cert);
+
+	if (!p11_x509_read_fields (test_cacert3_ca_der, sizeof (test_cacert3_ca_der), &fields))
+		assert_fail ("couldn't read fields", "cacert3");
+
+	/* The same fields as found by libtasn1 */
+	assert_num_eq (2, fields.version);
+	assert_field_eq (cert, "tbsCertificate.serialNumber", fields.serial, fields.serial_len);
+	assert_field_eq (cert, "tbsCertificate.issuer", fields.issuer, fields.issuer_len);
+	assert_field_eq (cert, "tbsCertificate.subject", fields.subject, fields.subject_len);
+	assert_field_eq (cert, "tbsCertificate.validity.notBefore", fields.not_before, fields.not_before_len);
+	assert_field_eq (cert, "tbsCertificate.validity.notAfter", fields.not_after, fields.not_after_len);
+	assert_field_eq (cert, "tbsCertificate.subjectPublicKeyInfo", fields.public_key, fields.public_key_len);
+
+	expected = p11_x509_find_extension (cert, P11_OID_BASIC_CONSTRAINTS,
+	                                    test_cacert3_ca_der, sizeof (test_cacert3_ca_der),
+	                                    &expected_len);
+	assert_ptr_not_null (expected);
+	ext = p11_x509_fields_extension (&fields, P11_OID_BASIC_CONSTRAINTS, &length);
+	assert_ptr_not_null (ext);
+	assert_num_eq (expected_len, length);
+	assert (memcmp (expected, ext, length) == 0);
+	free (expected);
+	free (ext);
+
+	ext = p11_x509_fields_extension (&fields, P11_OID_OPENSSL_REJECT, &length);
+	assert_ptr_eq (NULL, ext);
+
+	name = p11_x509_find_dn_name (fields.subject, fields.subject_len, P11_OID_CN);
+	assert_str_eq ("CAcert Class 3 Root", name);
+	free (name);
+
+	name = p11_x509_find_dn_name (fields.subject, fields.subject_len, P11_OID_SERVER_AUTH);
+	assert_ptr_eq (NULL, name);
+
+	asn1_delete_structure (&cert);
+
+	/* Truncated or trailing data is left to libtasn1 */
+	assert (!p11_x509_read_fields (test_cacert3_ca_der, sizeof (test_cacert3_ca_der) - 1, &fields));
+	expected = malloc (sizeof (test_cacert3_ca_der) + 1);
+	memcpy (expected, test_cacert3_ca_der, sizeof (test_cacert3_ca_der));
+	expected[sizeof (test_cacert3_ca_der)] = 0;
+	assert (!p11_x509_read_fields (expected, sizeof (test_cacert3_ca_der) + 1, &fields));
+	free (expected);
+}
+
+static void
+test_parse_basic_constraints (void)
+{
+	struct {
+		unsigned char input[16];
+		size_t input_len;
+		bool is_ca;
+	} fixtures[] = {
+		{ { 0x30, 0x00 }, 2, false },
+		{ { 0x30, 0x03, 0x01, 0x01, 0xff }, 5, true },
+		{ { 0x30, 0x03, 0x01, 0x01, 0x00 }, 5, false },
+		{ { 0x30, 0x06, 0x01, 0x01, 0xff, 0x02, 0x01, 0x00 }, 8, true },
+		{ { 0x30, 0x03, 0x02, 0x01, 0x03 }, 5, false },
+	};
+
+	bool is_ca;
+	int i;
+
+	for (i = 0; i < ELEMS (fixtures); i++) {
+		is_ca = !fixtures[i].is_ca;
+		if (!p11_x509_parse_basic_constraints (test.asn1_defs, fixtures[i].input,
+		                                       fixtures[i].input_len, &is_ca))
+			assert_fail ("failed to parse", "basic constraints");
+		assert_num_eq (fixtures[i].is_ca, is_ca);
+	}
+}
+
 static void
 test_directory_string (void)
 {
@@ -408,6 +510,8 @@ main (int argc,
 	p11_test (test_parse_key_usage, "/x509/parse-key-usage");
 	p11_test (test_parse_extension, "/x509/parse-extension");
 	p11_test (test_parse_extension_not_found, "/x509/parse-extension-not-found");
+	p11_test (test_parse_basic_constraints, "/x509/parse-basic-constraints");
+	p11_test (test_read_fields, "/x509/read-fields");
 
 	p11_fixture (NULL, NULL);
 	p11_test (test_directory_string, "/x509/directory-string");
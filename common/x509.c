@@ -45,6 +45,346 @@
 #include <stdlib.h>
 #include <string.h>
 
+/*
+ * A DER element read by the walker below. Only the forms that appear in
+ * certificates are accepted: single byte tags, and definite lengths of up
+ * to four bytes. Anything else is left for libtasn1 to decode.
+ */
+typedef struct {
+	unsigned char tag;
+	const unsigned char *tlv;
+	size_t tlv_len;
+	const unsigned char *value;
+	size_t len;
+} der_element;
+
+static bool
+der_read (const unsigned char **at,
+          const unsigned char *end,
+          der_element *elem)
+{
+	const unsigned char *p = *at;
+	size_t len;
+	int n;
+
+	if (end - p < 2)
+		return false;
+
+	elem->tlv = p;
+	elem->tag = *(p++);
+	if ((elem->tag & 0x1f) == 0x1f)
+		return false;
+
+	if (*p < 0x80) {
+		len = *(p++);
+	} else {
+		n = *(p++) & 0x7f;
+		if (n == 0 || n > 4 || end - p < n)
+			return false;
+		for (len = 0; n > 0; n--)
+			len = (len << 8) | *(p++);
+	}
+
+	if (len > (size_t)(end - p))
+		return false;
+
+	elem->value = p;
+	elem->len = len;
+	elem->tlv_len = (p + len) - elem->tlv;
+	*at = p + len;
+	return true;
+}
+
+static bool
+der_expect (const unsigned char **at,
+            const unsigned char *end,
+            unsigned char tag,
+            der_element *elem)
+{
+	return der_read (at, end, elem) && elem->tag == tag;
+}
+
+/* A Name is a SEQUENCE OF SET OF SEQUENCE { type OID, value ANY } */
+static bool
+der_check_name (der_element *name)
+{
+	const unsigned char *at, *end;
+	const unsigned char *rat, *rend;
+	const unsigned char *vat, *vend;
+	der_element rdn, atv, type, value;
+
+	at = name->value;
+	end = at + name->len;
+	while (at < end) {
+		if (!der_expect (&at, end, 0x31, &rdn))
+			return false;
+		rat = rdn.value;
+		rend = rat + rdn.len;
+		while (rat < rend) {
+			if (!der_expect (&rat, rend, 0x30, &atv))
+				return false;
+			vat = atv.value;
+			vend = vat + atv.len;
+			if (!der_expect (&vat, vend, 0x06, &type) ||
+			    !der_read (&vat, vend, &value) || vat != vend)
+				return false;
+		}
+	}
+
+	return true;
+}
+
+/* Each Extension is a SEQUENCE { extnID OID, critical BOOLEAN OPTIONAL, extnValue OCTET STRING } */
+static bool
+der_read_extension (const unsigned char **at,
+                    const unsigned char *end,
+                    der_element *oid,
+                    der_element *value)
+{
+	const unsigned char *eat, *eend;
+	der_element ext;
+
+	if (!der_expect (at, end, 0x30, &ext))
+		return false;
+
+	eat = ext.value;
+	eend = eat + ext.len;
+	if (!der_expect (&eat, eend, 0x06, oid) ||
+	    !der_read (&eat, eend, value))
+		return false;
+
+	/* The critical flag */
+	if (value->tag == 0x01 && !der_read (&eat, eend, value))
+		return false;
+
+	return value->tag == 0x04 && value->len > 0 && eat == eend;
+}
+
+/*
+ * Find the fields that are commonly needed from a certificate, without
+ * building an ASN.1 node tree with libtasn1. The certificate structure is
+ * checked along the way, as are the names and extensions, so that looking
+ * in them later cannot fail. Returns false for anything unusual, in which
+ * case the certificate should be decoded with libtasn1 instead.
+ */
+bool
+p11_x509_read_fields (const unsigned char *der,
+                      size_t der_len,
+                      p11_x509_fields *fields)
+{
+	const unsigned char *at, *end;
+	const unsigned char *tat, *tend;
+	der_element cert, tbs, elem;
+	der_element oid, value;
+
+	return_val_if_fail (der != NULL, false);
+	return_val_if_fail (fields != NULL, false);
+
+	memset (fields, 0, sizeof (p11_x509_fields));
+
+	/* Certificate ::= SEQUENCE { tbsCertificate, signatureAlgorithm, signature } */
+	at = der;
+	end = der + der_len;
+	if (!der_expect (&at, end, 0x30, &cert) || at != end)
+		return false;
+
+	at = cert.value;
+	end = at + cert.len;
+	if (!der_expect (&at, end, 0x30, &tbs) ||
+	    !der_expect (&at, end, 0x30, &elem) ||
+	    !der_expect (&at, end, 0x03, &elem) ||
+	    at != end)
+		return false;
+
+	tat = tbs.value;
+	tend = tat + tbs.len;
+
+	/* version [0] EXPLICIT INTEGER DEFAULT v1 */
+	if (!der_read (&tat, tend, &elem))
+		return false;
+	if (elem.tag == 0xa0) {
+		at = elem.value;
+		if (!der_expect (&at, elem.value + elem.len, 0x02, &value) ||
+		    at != elem.value + elem.len || value.len != 1)
+			return false;
+		fields->version = value.value[0];
+		if (!der_read (&tat, tend, &elem))
+			return false;
+	}
+
+	/* serialNumber INTEGER */
+	if (elem.tag != 0x02)
+		return false;
+	fields->serial = elem.tlv;
+	fields->serial_len = elem.tlv_len;
+
+	/* signature AlgorithmIdentifier, and the issuer Name */
+	if (!der_expect (&tat, tend, 0x30, &elem) ||
+	    !der_expect (&tat, tend, 0x30, &elem) ||
+	    !der_check_name (&elem))
+		return false;
+	fields->issuer = elem.tlv;
+	fields->issuer_len = elem.tlv_len;
+
+	/* validity SEQUENCE { notBefore Time, notAfter Time } */
+	if (!der_expect (&tat, tend, 0x30, &elem))
+		return false;
+	at = elem.value;
+	end = at + elem.len;
+	if (!der_read (&at, end, &value) ||
+	    (value.tag != 0x17 && value.tag != 0x18))
+		return false;
+	fields->not_before = value.tlv;
+	fields->not_before_len = value.tlv_len;
+	if (!der_read (&at, end, &value) ||
+	    (value.tag != 0x17 && value.tag != 0x18) || at != end)
+		return false;
+	fields->not_after = value.tlv;
+	fields->not_after_len = value.tlv_len;
+
+	/* subject Name */
+	if (!der_expect (&tat, tend, 0x30, &elem) ||
+	    !der_check_name (&elem))
+		return false;
+	fields->subject = elem.tlv;
+	fields->subject_len = elem.tlv_len;
+
+	/* subjectPublicKeyInfo */
+	if (!der_expect (&tat, tend, 0x30, &elem))
+		return false;
+	fields->public_key = elem.tlv;
+	fields->public_key_len = elem.tlv_len;
+
+	/* issuerUniqueID [1], subjectUniqueID [2] and extensions [3], all optional */
+	while (tat < tend) {
+		if (!der_read (&tat, tend, &elem))
+			return false;
+		if (elem.tag == 0x81 || elem.tag == 0xa1 || elem.tag == 0x82 || elem.tag == 0xa2)
+			continue;
+		if (elem.tag != 0xa3 || tat != tend)
+			return false;
+
+		at = elem.value;
+		end = at + elem.len;
+		if (!der_expect (&at, end, 0x30, &elem) || at != end)
+			return false;
+
+		at = elem.value;
+		end = at + elem.len;
+		while (at < end) {
+			if (!der_read_extension (&at, end, &oid, &value))
+				return false;
+		}
+
+		fields->extensions = elem.value;
+		fields->extensions_len = elem.len;
+	}
+
+	return true;
+}
+
+/*
+ * The contents of a DER encoded INTEGER, such as a serial number. Returns
+ * false if the data isn't a single INTEGER.
+ */
+bool
+p11_x509_integer_value (const unsigned char *der,
+                        size_t der_len,
+                        const unsigned char **value,
+                        size_t *value_len)
+{
+	const unsigned char *at = der;
+	der_element elem;
+
+	return_val_if_fail (value != NULL, false);
+	return_val_if_fail (value_len != NULL, false);
+
+	if (der == NULL || !der_expect (&at, der + der_len, 0x02, &elem) ||
+	    at != der + der_len)
+		return false;
+
+	*value = elem.value;
+	*value_len = elem.len;
+	return true;
+}
+
+unsigned char *
+p11_x509_fields_extension (p11_x509_fields *fields,
+                           const unsigned char *oid,
+                           size_t *ext_len)
+{
+	const unsigned char *at, *end;
+	der_element extn_id, value;
+	unsigned char *ext;
+
+	return_val_if_fail (fields != NULL, NULL);
+	return_val_if_fail (oid != NULL, NULL);
+	return_val_if_fail (ext_len != NULL, NULL);
+
+	at = fields->extensions;
+	end = at + fields->extensions_len;
+	while (at != NULL && at < end) {
+		if (!der_read_extension (&at, end, &extn_id, &value))
+			return_val_if_reached (NULL);
+
+		/* Make sure it's a straightforward oid with certain assumptions */
+		if (!p11_oid_simple (extn_id.tlv, extn_id.tlv_len) ||
+		    !p11_oid_equal (extn_id.tlv, oid))
+			continue;
+
+		ext = memdup (value.value, value.len);
+		return_val_if_fail (ext != NULL, NULL);
+		*ext_len = value.len;
+		return ext;
+	}
+
+	return NULL;
+}
+
+char *
+p11_x509_find_dn_name (const unsigned char *der,
+                       size_t der_len,
+                       const unsigned char *oid)
+{
+	const unsigned char *at, *end;
+	const unsigned char *rat, *rend;
+	const unsigned char *vat;
+	der_element name, rdn, atv, type, value;
+
+	return_val_if_fail (der != NULL, NULL);
+	return_val_if_fail (oid != NULL, NULL);
+
+	at = der;
+	if (!der_expect (&at, der + der_len, 0x30, &name))
+		return NULL;
+
+	at = name.value;
+	end = at + name.len;
+	while (at < end) {
+		if (!der_expect (&at, end, 0x31, &rdn))
+			return NULL;
+		rat = rdn.value;
+		rend = rat + rdn.len;
+		while (rat < rend) {
+			if (!der_expect (&rat, rend, 0x30, &atv))
+				return NULL;
+			vat = atv.value;
+			if (!der_expect (&vat, atv.value + atv.len, 0x06, &type) ||
+			    !der_read (&vat, atv.value + atv.len, &value))
+				return NULL;
+
+			/* Make sure it's a straightforward oid with certain assumptions */
+			if (!p11_oid_simple (type.tlv, type.tlv_len) ||
+			    !p11_oid_equal (type.tlv, oid))
+				continue;
+
+			return p11_x509_parse_directory_string (value.tlv, value.tlv_len, NULL, NULL);
+		}
+	}
+
+	return NULL;
+}
+
 unsigned char *
 p11_x509_find_extension (node_asn *cert,
                          const unsigned char *oid,
@@ -125,6 +465,41 @@ p11_x509_calc_keyid (node_asn *cert,
 	return true;
 }
 
+/* BasicConstraints ::= SEQUENCE { cA BOOLEAN DEFAULT FALSE, pathLenConstraint INTEGER OPTIONAL } */
+static bool
+der_basic_constraints (const unsigned char *der,
+                       size_t der_len,
+                       bool *is_ca)
+{
+	const unsigned char *at, *end;
+	der_element seq, elem;
+
+	at = der;
+	end = der + der_len;
+	if (!der_expect (&at, end, 0x30, &seq) || at != end)
+		return false;
+
+	*is_ca = false;
+	at = seq.value;
+	end = at + seq.len;
+	if (at == end)
+		return true;
+
+	if (!der_read (&at, end, &elem))
+		return false;
+	if (elem.tag == 0x01) {
+		if (elem.len != 1 || (elem.value[0] != 0x00 && elem.value[0] != 0xff))
+			return false;
+		*is_ca = (elem.value[0] == 0xff);
+		if (at == end)
+			return true;
+		if (!der_read (&at, end, &elem))
+			return false;
+	}
+
+	return elem.tag == 0x02 && at == end;
+}
+
 bool
 p11_x509_parse_basic_constraints (p11_dict *asn1_defs,
                                   const unsigned char *ext_der,
@@ -138,6 +513,9 @@ p11_x509_parse_basic_constraints (p11_dict *asn1_defs,
 
 	return_val_if_fail (is_ca != NULL, false);
 
+	if (der_basic_constraints (ext_der, ext_len, is_ca))
+		return true;
+
 	ext = p11_asn1_decode (asn1_defs, "PKIX1.BasicConstraints", ext_der, ext_len, NULL);
 	if (ext == NULL)
 		return false;
@@ -40,6 +40,41 @@
 #ifndef P11_X509_H_
 #define P11_X509_H_
 
+typedef struct {
+	int version;
+	const unsigned char *serial;
+	size_t serial_len;
+	const unsigned char *issuer;
+	size_t issuer_len;
+	const unsigned char *not_before;
+	size_t not_before_len;
+	const unsigned char *not_after;
+	size_t not_after_len;
+	const unsigned char *subject;
+	size_t subject_len;
+	const unsigned char *public_key;
+	size_t public_key_len;
+	const unsigned char *extensions;
+	size_t extensions_len;
+} p11_x509_fields;
+
+bool             p11_x509_read_fields               (const unsigned char *der,
+                                                     size_t der_len,
+                                                     p11_x509_fields *fields);
+
+bool             p11_x509_integer_value             (const unsigned char *der,
+                                                     size_t der_len,
+                                                     const unsigned char **value,
+                                                     size_t *value_len);
+
+unsigned char *  p11_x509_fields_extension          (p11_x509_fields *fields,
+                                                     const unsigned char *oid,
+                                                     size_t *ext_len);
+
+char *           p11_x509_find_dn_name              (const unsigned char *der,
+                                                     size_t der_len,
+                                                     const unsigned char *oid);
+
 unsigned char *  p11_x509_find_extension            (node_asn *cert,
                                                      const unsigned char *oid,
                                                      const unsigned char *der,
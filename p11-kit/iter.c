@@ -38,6 +38,7 @@
 #include "attrs.h"
 #include "debug.h"
 #include "iter.h"
+#include "modules.h"
 #include "pin.h"
 #include "private.h"
 
@@ -54,6 +55,10 @@ typedef struct _Callback {
 
 #define MAX_OBJECTS 64
 
+/* The space for attribute values retrieved along with the objects */
+#define MIN_BUFFER 16384
+#define MAX_BUFFER (1024 * 1024)
+
 /**
  * P11KitIter:
  *
@@ -81,6 +86,16 @@ struct p11_kit_iter {
 	CK_ULONG num_objects;
 	CK_ULONG saw_objects;
 
+	/* Values of the first template loaded, for each of the objects */
+	CK_ATTRIBUTE *preloaded;
+	CK_ULONG num_preloaded;
+	CK_BYTE *buffer;
+	CK_ULONG buffer_len;
+
+	/* The vendor functions of the current module */
+	CK_X_VENDOR_FUNCTION_LIST *vendor;
+	CK_FUNCTION_LIST_PTR vendor_module;
+
 	/* The current iteration */
 	CK_FUNCTION_LIST_PTR module;
 	CK_SLOT_ID slot;
@@ -93,6 +108,8 @@ struct p11_kit_iter {
 	int iterating : 1;
 	int match_nothing : 1;
 	int keep_session : 1;
+	int preloading : 1;
+	int probed : 1;
 };
 
 /**
@@ -274,6 +291,7 @@ finish_slot (P11KitIter *iter)
 	iter->session = 0;
 	iter->searched = 0;
 	iter->searching = 0;
+	iter->preloading = 0;
 	iter->slot = 0;
 }
 
@@ -495,6 +513,87 @@ move_next_session (P11KitIter *iter)
 	return move_next_session (iter);
 }
 
+/*
+ * Once the template that the caller loads is known, modules that support
+ * it return the values of its attributes along with the objects.
+ */
+static CK_RV
+find_objects_preloading (P11KitIter *iter)
+{
+	CK_BYTE *buffer;
+	CK_ULONG len;
+	CK_RV rv;
+
+	if (iter->buffer == NULL) {
+		iter->buffer = malloc (MIN_BUFFER);
+		return_val_if_fail (iter->buffer != NULL, CKR_HOST_MEMORY);
+		iter->buffer_len = MIN_BUFFER;
+
+	/* The last batch of objects was cut short by the space for values */
+	} else if (iter->preloading && iter->num_objects > 0 &&
+	           iter->num_objects < MAX_OBJECTS && iter->buffer_len < MAX_BUFFER) {
+		buffer = realloc (iter->buffer, iter->buffer_len * 2);
+		return_val_if_fail (buffer != NULL, CKR_HOST_MEMORY);
+		iter->buffer = buffer;
+		iter->buffer_len *= 2;
+	}
+
+	for (;;) {
+		len = iter->buffer_len;
+		rv = (iter->vendor->C_X_FindObjectsAttributes) (iter->vendor_module, iter->session,
+		                                                iter->objects, MAX_OBJECTS, &iter->num_objects,
+		                                                iter->preloaded, iter->num_preloaded,
+		                                                iter->buffer, &len);
+		if (rv != CKR_BUFFER_TOO_SMALL)
+			return rv;
+
+		buffer = realloc (iter->buffer, len);
+		return_val_if_fail (buffer != NULL, CKR_HOST_MEMORY);
+		iter->buffer = buffer;
+		iter->buffer_len = len;
+	}
+}
+
+static CK_RV
+find_objects (P11KitIter *iter,
+              bool *done)
+{
+	CK_ULONG max;
+	CK_RV rv;
+
+	iter->saw_objects = 0;
+
+	if (iter->vendor && iter->preloaded) {
+		rv = find_objects_preloading (iter);
+		if (rv == CKR_ATTRIBUTE_TYPE_INVALID)
+			rv = CKR_OK;
+		iter->preloading = (rv == CKR_OK);
+		if (rv == CKR_OK) {
+			*done = (iter->num_objects == 0);
+			return rv;
+		}
+
+		iter->num_objects = 0;
+		if (rv != CKR_FUNCTION_NOT_SUPPORTED)
+			return rv;
+		iter->vendor = NULL;
+	}
+
+	/* Find out which template is loaded before finding the others */
+	max = MAX_OBJECTS;
+	if (iter->vendor && !iter->preloaded && !iter->probed) {
+		iter->probed = 1;
+		max = 1;
+	}
+
+	iter->preloading = 0;
+	iter->num_objects = 0;
+	rv = (iter->module->C_FindObjects) (iter->session, iter->objects,
+	                                    max, &iter->num_objects);
+	*done = (iter->num_objects != max);
+	return rv;
+}
+
 /**
  * p11_kit_iter_next:
  * @iter: the iterator
@@ -517,6 +616,7 @@ p11_kit_iter_next (P11KitIter *iter)
 {
 	CK_ULONG count;
 	CK_BBOOL matches;
+	bool done;
 	CK_RV rv;
 
 	return_val_if_fail (iter->iterating, CKR_OPERATION_NOT_INITIALIZED);
@@ -555,6 +655,7 @@ p11_kit_iter_next (P11KitIter *iter)
 		rv = (iter->module->C_FindObjectsInit) (iter->session, iter->match_attrs, count);
 		if (rv != CKR_OK)
 			return finish_iterating (iter, rv);
+		iter->vendor = p11_module_get_vendor_functions (iter->module, &iter->vendor_module);
 		iter->searching = 1;
 		iter->searched = 0;
 	}
@@ -563,11 +664,8 @@ p11_kit_iter_next (P11KitIter *iter)
 	if (iter->searching) {
 		assert (iter->module != NULL);
 		assert (iter->session != 0);
-		iter->num_objects = 0;
-		iter->saw_objects = 0;
 
-		rv = (iter->module->C_FindObjects) (iter->session, iter->objects,
-		                                    MAX_OBJECTS, &iter->num_objects);
+		rv = find_objects (iter, &done);
 		if (rv != CKR_OK)
 			return finish_iterating (iter, rv);
 
@@ -576,7 +674,7 @@ p11_kit_iter_next (P11KitIter *iter)
 		 * objects outstanding, which will be returned on next
 		 * iterations.
 		 */
-		if (iter->num_objects != MAX_OBJECTS) {
+		if (done) {
 			iter->searching = 0;
 			iter->searched = 1;
 			(iter->module->C_FindObjectsFinal) (iter->session);
@@ -662,6 +760,72 @@ p11_kit_iter_get_object (P11KitIter *iter)
 	return iter->object;
 }
 
+static void
+prepare_preloaded (P11KitIter *iter,
+                   CK_ATTRIBUTE *template,
+                   CK_ULONG count)
+{
+	CK_ULONG i;
+
+	iter->preloaded = calloc (MAX_OBJECTS * count, sizeof (CK_ATTRIBUTE));
+	return_if_fail (iter->preloaded != NULL);
+
+	for (i = 0; i < MAX_OBJECTS * count; i++)
+		iter->preloaded[i].type = template[i % count].type;
+	iter->num_preloaded = count;
+}
+
+static bool
+is_preloaded (P11KitIter *iter,
+              CK_ATTRIBUTE *template,
+              CK_ULONG count)
+{
+	CK_ULONG i;
+
+	if (count != iter->num_preloaded)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		if (template[i].type != iter->preloaded[i].type)
+			return false;
+	}
+
+	return true;
+}
+
+static CK_RV
+load_preloaded (P11KitIter *iter,
+                CK_ATTRIBUTE *template,
+                CK_ULONG count)
+{
+	CK_ATTRIBUTE *values;
+	void *value;
+	CK_ULONG i;
+
+	assert (iter->saw_objects > 0);
+	values = iter->preloaded + ((iter->saw_objects - 1) * count);
+
+	for (i = 0; i < count; i++) {
+		if (values[i].ulValueLen == (CK_ULONG)-1 ||
+		    values[i].ulValueLen == 0) {
+			free (template[i].pValue);
+			template[i].pValue = NULL;
+
+		} else if (template[i].pValue == NULL ||
+		           template[i].ulValueLen != values[i].ulValueLen) {
+			value = realloc (template[i].pValue, values[i].ulValueLen);
+			return_val_if_fail (value != NULL, CKR_HOST_MEMORY);
+			template[i].pValue = value;
+		}
+
+		if (template[i].pValue)
+			memcpy (template[i].pValue, values[i].pValue, values[i].ulValueLen);
+		template[i].ulValueLen = values[i].ulValueLen;
+	}
+
+	return CKR_OK;
+}
+
 /**
  * p11_kit_iter_load_attributes:
  * @iter: the iterator
@@ -689,6 +853,11 @@ p11_kit_iter_get_object (P11KitIter *iter)
  *
  * This can only be called after p11_kit_iter_next() succeeds.
  *
+ * Modules that support it return the attributes of the first template
+ * passed to this function along with the objects that are iterated
+ * after that, so that loading the same attributes again does not call
+ * into the module.
+ *
  * Returns: CKR_OK or a failure code
  */
 CK_RV
@@ -709,6 +878,11 @@ p11_kit_iter_load_attributes (P11KitIter *iter,
 	if (count == 0)
 		return CKR_OK;
 
+	if (iter->preloaded == NULL)
+		prepare_preloaded (iter, template, count);
+	else if (iter->preloading && is_preloaded (iter, template, count))
+		return load_preloaded (iter, template, count);
+
 	original = memdup (template, count * sizeof (CK_ATTRIBUTE));
 	return_val_if_fail (original != NULL, CKR_HOST_MEMORY);
 
@@ -816,6 +990,8 @@ p11_kit_iter_free (P11KitIter *iter)
 	p11_array_free (iter->modules);
 	p11_attrs_free (iter->match_attrs);
 	free (iter->slots);
+	free (iter->preloaded);
+	free (iter->buffer);
 
 	for (cb = iter->callbacks; cb != NULL; cb = next) {
 		next = cb->next;
@@ -155,6 +155,9 @@ typedef struct _Module {
 	void *loaded_module;
 	p11_kit_destroyer loaded_destroy;
 
+	/* Vendor functions exported by the loaded module, if any */
+	CK_X_VENDOR_FUNCTION_LIST *vendor;
+
 	/* Initialization, mutex must be held */
 	p11_mutex_t initialize_mutex;
 	bool initialize_called;
@@ -283,6 +286,7 @@ dlopen_and_get_function_list (Module *mod,
                               const char *path,
                               CK_FUNCTION_LIST **funcs)
 {
+	CK_X_GetVendorFunctionList gvfl;
 	CK_C_GetFunctionList gfl;
 	dl_module_t dl;
 	char *error;
@@ -325,6 +329,11 @@ dlopen_and_get_function_list (Module *mod,
 		return CKR_FUNCTION_FAILED;
 	}
 
+	/* A module linked to p11-kit would find the proxy's vendor functions */
+	gvfl = p11_dl_symbol (dl, "C_X_GetVendorFunctionList");
+	if (gvfl && gvfl != C_X_GetVendorFunctionList && gvfl (&mod->vendor) != CKR_OK)
+		mod->vendor = NULL;
+
 	p11_virtual_init (&mod->virt, &p11_virtual_base, *funcs, NULL);
 	p11_debug ("opened module: %s", path);
 	return CKR_OK;
@@ -1777,6 +1786,37 @@ prepare_module_inlock_reentrant (Module *mod,
 	return CKR_OK;
 }
 
+/*
+ * The vendor functions skip the virtual stack of a managed module, so
+ * they're not used when it logs the calls.
+ */
+CK_X_VENDOR_FUNCTION_LIST *
+p11_module_get_vendor_functions (CK_FUNCTION_LIST *module,
+                                 CK_FUNCTION_LIST **lower)
+{
+	CK_X_VENDOR_FUNCTION_LIST *vendor = NULL;
+	Module *mod;
+
+	return_val_if_fail (module != NULL, NULL);
+	return_val_if_fail (lower != NULL, NULL);
+
+	p11_lock ();
+
+		if (gl.modules) {
+			mod = module_for_functions_inlock (module);
+			if (mod && mod->vendor &&
+			    !(p11_virtual_is_wrapper (module) &&
+			      (p11_log_force || lookup_managed_option (mod, true, "log-calls", false)))) {
+				vendor = mod->vendor;
+				*lower = mod->virt.lower_module;
+			}
+		}
+
+	p11_unlock ();
+
+	return vendor;
+}
+
 CK_RV
 p11_modules_load_inlock_reentrant (int flags,
                                    CK_FUNCTION_LIST ***results)
@@ -36,6 +36,7 @@
 #define __P11_MODULES_H__
 
 #include "pkcs11.h"
+#include "pkcs11x.h"
 
 CK_RV      p11_modules_load_inlock_reentrant         (int flags,
                                                       CK_FUNCTION_LIST_PTR **results);
@@ -48,4 +49,8 @@ CK_RV      p11_module_load_inlock_reentrant          (CK_FUNCTION_LIST_PTR modul
 
 CK_RV      p11_module_release_inlock_reentrant       (CK_FUNCTION_LIST_PTR module);
 
+CK_X_VENDOR_FUNCTION_LIST *
+           p11_module_get_vendor_functions           (CK_FUNCTION_LIST_PTR module,
+                                                      CK_FUNCTION_LIST_PTR *lower);
+
 #endif /* __P11_MODULES_H__ */
@@ -2359,6 +2359,75 @@ static CK_X_FUNCTION_LIST proxy_functions = {
 	proxy_C_WaitForSlotEvent,
 };
 
+/* -----------------------------------------------------------------------------
+ * VENDOR FUNCTIONS
+ */
+
+static CK_RV
+proxy_C_X_FindObjectsAttributes (CK_FUNCTION_LIST_PTR module,
+                                 CK_SESSION_HANDLE handle,
+                                 CK_OBJECT_HANDLE_PTR objects,
+                                 CK_ULONG max_count,
+                                 CK_ULONG_PTR count,
+                                 CK_ATTRIBUTE_PTR template,
+                                 CK_ULONG template_count,
+                                 CK_BYTE_PTR buffer,
+                                 CK_ULONG_PTR buffer_len)
+{
+	CK_X_VENDOR_FUNCTION_LIST *vendor;
+	CK_FUNCTION_LIST *lower;
+	State *state;
+	Mapping map;
+	CK_RV rv;
+
+	p11_lock ();
+
+		for (state = all_instances; state != NULL; state = state->next) {
+			if (state->wrapped == module)
+				break;
+		}
+
+	p11_unlock ();
+
+	if (state == NULL) {
+		if (module != &module_functions)
+			return CKR_ARGUMENTS_BAD;
+		state = &global;
+	}
+
+	if (state->px == NULL)
+		return CKR_CRYPTOKI_NOT_INITIALIZED;
+
+	rv = map_session_to_real (state->px, &handle, &map, NULL);
+	if (rv != CKR_OK)
+		return rv;
+
+	vendor = p11_module_get_vendor_functions (map.funcs, &lower);
+	if (vendor == NULL)
+		return CKR_FUNCTION_NOT_SUPPORTED;
+
+	return (vendor->C_X_FindObjectsAttributes) (lower, handle, objects, max_count, count,
+	                                            template, template_count, buffer, buffer_len);
+}
+
+static CK_X_VENDOR_FUNCTION_LIST proxy_vendor_functions = {
+	{ 1, 0 },
+	proxy_C_X_FindObjectsAttributes,
+};
+
+#ifdef OS_WIN32
+__declspec(dllexport)
+#endif
+CK_RV
+C_X_GetVendorFunctionList (CK_X_VENDOR_FUNCTION_LIST **list)
+{
+	return_val_if_fail (list != NULL, CKR_ARGUMENTS_BAD);
+
+	p11_library_init_once ();
+	*list = &proxy_vendor_functions;
+	return CKR_OK;
+}
+
 #ifdef OS_WIN32
 __declspec(dllexport)
 #endif
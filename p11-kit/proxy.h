@@ -35,11 +35,16 @@
 #ifndef __P11_PROXY_H__
 #define __P11_PROXY_H__
 
+#include "pkcs11.h"
+#include "pkcs11x.h"
+
 void       p11_proxy_after_fork                      (void);
 
 bool       p11_proxy_module_check                    (CK_FUNCTION_LIST_PTR module);
 
 void       p11_proxy_module_cleanup                  (void);
 
+CK_RV      C_X_GetVendorFunctionList                 (CK_X_VENDOR_FUNCTION_LIST **list);
+
 
 #endif /* __P11_PROXY_H__ */
@@ -0,0 +1,218 @@
+/*
+ * Copyright (c) 2013, Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#include "config.h"
+
+#include "attrs.h"
+#include "buffer.h"
+#include "compat.h"
+#include "constants.h"
+#include "debug.h"
+#include "dict.h"
+#include "extract.h"
+#include "image.h"
+#include "message.h"
+#include "pkcs11.h"
+#include "pkcs11x.h"
+#include "save.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * The attributes which identify an object of a given class. When more
+ * than one token has an object with the same identity, only the one from
+ * the first token goes into the image. Modules and tokens are iterated
+ * in order of priority, so this is the object a caller looking through
+ * the tokens one at a time would find first.
+ */
+static const struct {
+	CK_OBJECT_CLASS klass;
+	CK_ATTRIBUTE_TYPE types[7];
+} identities[] = {
+	{ CKO_CERTIFICATE, { CKA_CERTIFICATE_TYPE, CKA_VALUE, CKA_ISSUER, CKA_SERIAL_NUMBER, CKA_INVALID } },
+	{ CKO_NSS_TRUST, { CKA_CERT_SHA1_HASH, CKA_ISSUER, CKA_SERIAL_NUMBER, CKA_INVALID } },
+	{ CKO_X_TRUST_ASSERTION, { CKA_X_ASSERTION_TYPE, CKA_X_PURPOSE, CKA_X_CERTIFICATE_VALUE,
+	                           CKA_ISSUER, CKA_SERIAL_NUMBER, CKA_X_PEER, CKA_INVALID } },
+	{ CKO_X_CERTIFICATE_EXTENSION, { CKA_ID, CKA_OBJECT_ID, CKA_INVALID } },
+	{ CKA_INVALID },
+};
+
+static CK_ATTRIBUTE *
+object_identity (CK_ATTRIBUTE *attrs,
+                 CK_OBJECT_CLASS klass)
+{
+	CK_ATTRIBUTE *identity;
+	CK_ATTRIBUTE *attr;
+	p11_buffer buffer;
+	size_t length;
+	int i, j;
+
+	for (i = 0; identities[i].klass != CKA_INVALID; i++) {
+		if (identities[i].klass == klass)
+			break;
+	}
+
+	if (identities[i].klass == CKA_INVALID)
+		return NULL;
+
+	p11_buffer_init (&buffer, 128);
+
+	for (j = 0; identities[i].types[j] != CKA_INVALID; j++) {
+		attr = p11_attrs_find (attrs, identities[i].types[j]);
+		if (attr == NULL || attr->pValue == NULL)
+			continue;
+		p11_buffer_add (&buffer, &attr->type, sizeof (attr->type));
+		p11_buffer_add (&buffer, &attr->ulValueLen, sizeof (attr->ulValueLen));
+		p11_buffer_add (&buffer, attr->pValue, attr->ulValueLen);
+	}
+
+	return_val_if_fail (p11_buffer_ok (&buffer), NULL);
+
+	identity = calloc (2, sizeof (CK_ATTRIBUTE));
+	return_val_if_fail (identity != NULL, NULL);
+
+	identity[0].type = klass;
+	identity[0].pValue = p11_buffer_steal (&buffer, &length);
+	identity[0].ulValueLen = length;
+	identity[1].type = CKA_INVALID;
+	return identity;
+}
+
+static CK_ATTRIBUTE *
+load_object (P11KitIter *iter)
+{
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG count;
+	CK_ULONG i, n;
+	CK_RV rv;
+
+	/* Ask for every attribute type we know about */
+	for (count = 0; p11_constant_types[count].value != CKA_INVALID; count++);
+
+	attrs = calloc (count + 1, sizeof (CK_ATTRIBUTE));
+	return_val_if_fail (attrs != NULL, NULL);
+
+	for (i = 0; i < count; i++)
+		attrs[i].type = p11_constant_types[i].value;
+
+	rv = p11_kit_iter_load_attributes (iter, attrs, count);
+	if (rv != CKR_OK) {
+		p11_message ("couldn't load attributes of object: %s", p11_kit_strerror (rv));
+		for (i = 0; i < count; i++)
+			free (attrs[i].pValue);
+		free (attrs);
+		return NULL;
+	}
+
+	/* Keep only the attributes the object has */
+	for (i = 0, n = 0; i < count; i++) {
+		if (attrs[i].ulValueLen != (CK_ULONG)-1)
+			attrs[n++] = attrs[i];
+	}
+
+	attrs[n].type = CKA_INVALID;
+	return attrs;
+}
+
+bool
+p11_extract_p11_kit_image (P11KitIter *iter,
+                           p11_extract_info *ex)
+{
+	CK_OBJECT_CLASS klass;
+	CK_ATTRIBUTE *identity;
+	CK_ATTRIBUTE *attrs;
+	p11_save_file *file;
+	p11_array *objects;
+	p11_buffer buffer;
+	p11_dict *seen;
+	bool ret = true;
+	CK_RV rv;
+
+	objects = p11_array_new (p11_attrs_free);
+	return_val_if_fail (objects != NULL, false);
+
+	seen = p11_dict_new (p11_attr_hash, p11_attr_equal, p11_attrs_free, NULL);
+	return_val_if_fail (seen != NULL, false);
+
+	while ((rv = p11_kit_iter_next (iter)) == CKR_OK) {
+		attrs = load_object (iter);
+		if (attrs == NULL) {
+			ret = false;
+			break;
+		}
+
+		if (!p11_attrs_find_ulong (attrs, CKA_CLASS, &klass))
+			klass = CKA_INVALID;
+
+		/* Each token loading the image adds its own builtin root list */
+		if (klass == CKO_NSS_BUILTIN_ROOT_LIST) {
+			p11_attrs_free (attrs);
+			continue;
+		}
+
+		identity = object_identity (attrs, klass);
+		if (identity != NULL) {
+			if (p11_dict_get (seen, identity)) {
+				p11_attrs_free (identity);
+				p11_attrs_free (attrs);
+				continue;
+			}
+			if (!p11_dict_set (seen, identity, identity))
+				return_val_if_reached (false);
+		}
+
+		if (!p11_array_push (objects, attrs))
+			return_val_if_reached (false);
+	}
+
+	if (rv != CKR_OK && rv != CKR_CANCEL) {
+		p11_message ("failed to find objects: %s", p11_kit_strerror (rv));
+		ret = false;
+	}
+
+	if (ret) {
+		p11_buffer_init (&buffer, 1024 * 10);
+		p11_image_write (&buffer, objects);
+		return_val_if_fail (p11_buffer_ok (&buffer), false);
+
+		file = p11_save_open_file (ex->destination, ex->flags);
+		ret = p11_save_write_and_finish (file, buffer.data, buffer.len);
+		p11_buffer_uninit (&buffer);
+	}
+
+	p11_dict_free (seen);
+	p11_array_free (objects);
+	return ret;
+}
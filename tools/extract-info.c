@@ -375,7 +375,7 @@ p11_extract_info_cleanup (p11_extract_info *ex)
 	p11_dict_free (ex->already_seen);
 	ex->already_seen = NULL;
 
-	p11_dict_free (ex->asn1_defs);
+	p11_asn1_defs_unref (ex->asn1_defs);
 	ex->asn1_defs = NULL;
 }
 
@@ -185,6 +185,7 @@ format_argument (const char *optarg,
 		{ "java-cacerts", p11_extract_jks_cacerts },
 		{ "openssl-bundle", p11_extract_openssl_bundle },
 		{ "openssl-directory", p11_extract_openssl_directory },
+		{ "p11-kit-image", p11_extract_p11_kit_image },
 		{ NULL },
 	};
 
@@ -260,6 +261,7 @@ validate_filter_and_format (p11_extract_info *ex,
 	static p11_extract_func supports_trust_policy[] = {
 		p11_extract_openssl_bundle,
 		p11_extract_openssl_directory,
+		p11_extract_p11_kit_image,
 		NULL
 	};
 
@@ -349,7 +351,8 @@ p11_tool_extract (int argc,
 		  "  pem-directory     directory of PEM files\n"
 		  "  openssl-bundle    OpenSSL specific PEM bundle\n"
 		  "  openssl-directory directory of OpenSSL specific files\n"
-		  "  java-cacerts      java keystore cacerts file",
+		  "  java-cacerts      java keystore cacerts file\n"
+		  "  p11-kit-image     image of the trust policy for p11-kit",
 		  "type"
 		},
 		{ opt_purpose,
@@ -422,6 +425,17 @@ p11_tool_extract (int argc,
 		return 2;
 	}
 
+	/* An image always holds all the objects in the trust policy */
+	if (format == p11_extract_p11_kit_image) {
+		if (uri != NULL || (match != NULL && (~ex.flags & (P11_EXTRACT_ANCHORS |
+		                                                   P11_EXTRACT_BLACKLIST)))) {
+			p11_message ("the p11-kit-image format only supports the 'trust-policy' filter");
+			return 2;
+		}
+		if (match == NULL)
+			filter_argument ("trust-policy", &uri, &match, &ex.flags);
+	}
+
 	/* If nothing that was useful to enumerate was specified, then bail */
 	if (uri == NULL && match == NULL) {
 		p11_message ("no filter specified, defaulting to 'ca-anchors'");
@@ -442,8 +456,11 @@ p11_tool_extract (int argc,
 
 	iter = p11_kit_iter_new (uri);
 
-	p11_kit_iter_add_callback (iter, p11_extract_info_load_filter, &ex, NULL);
-	p11_kit_iter_add_filter (iter, match, p11_attrs_count (match));
+	/* Images hold the objects built for certificates, not just certificates */
+	if (format != p11_extract_p11_kit_image) {
+		p11_kit_iter_add_callback (iter, p11_extract_info_load_filter, &ex, NULL);
+		p11_kit_iter_add_filter (iter, match, p11_attrs_count (match));
+	}
 
 	p11_kit_iter_begin (iter, modules);
 
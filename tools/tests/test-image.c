@@ -0,0 +1,352 @@
+/*
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#define P11_KIT_DISABLE_DEPRECATED
+
+#include "config.h"
+#include "test.h"
+#include "test-tools.h"
+
+#include "attrs.h"
+#include "compat.h"
+#include "debug.h"
+#include "extract.h"
+#include "image.h"
+#include "message.h"
+#include "mock.h"
+#include "path.h"
+#include "pkcs11.h"
+#include "pkcs11x.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+struct {
+	CK_FUNCTION_LIST module;
+	P11KitIter *iter;
+	p11_extract_info ex;
+	char *directory;
+} test;
+
+static void
+setup (void *unused)
+{
+	CK_RV rv;
+
+	mock_module_reset ();
+	memcpy (&test.module, &mock_module, sizeof (CK_FUNCTION_LIST));
+	rv = test.module.C_Initialize (NULL);
+	assert_num_eq (CKR_OK, rv);
+
+	test.iter = p11_kit_iter_new (NULL);
+
+	p11_extract_info_init (&test.ex);
+
+	test.directory = p11_path_expand ("$TEMP/test-extract.XXXXXX");
+	if (!mkdtemp (test.directory))
+		assert_not_reached ();
+
+	if (asprintf (&test.ex.destination, "%s/%s", test.directory, "extract.image") < 0)
+		assert_not_reached ();
+}
+
+static void
+teardown (void *unused)
+{
+	CK_RV rv;
+
+	unlink (test.ex.destination);
+	free (test.ex.destination);
+	test.ex.destination = NULL;
+
+	if (rmdir (test.directory) < 0)
+		assert_not_reached ();
+	free (test.directory);
+
+	p11_extract_info_cleanup (&test.ex);
+	p11_kit_iter_free (test.iter);
+
+	rv = test.module.C_Finalize (NULL);
+	assert_num_eq (CKR_OK, rv);
+}
+
+static p11_array *
+read_image (void)
+{
+	p11_array *objects;
+	p11_mmap *map;
+	void *data;
+	size_t size;
+
+	map = p11_mmap_open (test.ex.destination, &data, &size);
+	assert_ptr_not_null (map);
+
+	assert (p11_image_check (data, size));
+	if (!p11_image_read (data, size, &objects))
+		assert_not_reached ();
+
+	p11_mmap_close (map);
+	return objects;
+}
+
+static CK_ATTRIBUTE *
+find_object (p11_array *objects,
+             CK_ATTRIBUTE *match)
+{
+	int i;
+
+	for (i = 0; i < objects->num; i++) {
+		if (p11_attrs_match (objects->elem[i], match))
+			return objects->elem[i];
+	}
+
+	return NULL;
+}
+
+static int
+count_objects (p11_array *objects,
+               CK_ATTRIBUTE *match)
+{
+	int count = 0;
+	int i;
+
+	for (i = 0; i < objects->num; i++) {
+		if (p11_attrs_match (objects->elem[i], match))
+			count++;
+	}
+
+	return count;
+}
+
+static CK_OBJECT_CLASS certificate_class = CKO_CERTIFICATE;
+static CK_OBJECT_CLASS trust_class = CKO_NSS_TRUST;
+static CK_OBJECT_CLASS builtin_class = CKO_NSS_BUILTIN_ROOT_LIST;
+static CK_CERTIFICATE_TYPE x509_type = CKC_X_509;
+static CK_BBOOL truev = CK_TRUE;
+
+static CK_ATTRIBUTE cacert3_authority_attrs[] = {
+	{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+	{ CKA_CLASS, &certificate_class, sizeof (certificate_class) },
+	{ CKA_CERTIFICATE_TYPE, &x509_type, sizeof (x509_type) },
+	{ CKA_LABEL, "Cacert3 Here", 12 },
+	{ CKA_SUBJECT, (void *)test_cacert3_ca_subject, sizeof (test_cacert3_ca_subject) },
+	{ CKA_TRUSTED, &truev, sizeof (truev) },
+	{ CKA_ID, "ID1", 3 },
+	{ CKA_INVALID },
+};
+
+static CK_ATTRIBUTE cacert3_trust_attrs[] = {
+	{ CKA_CLASS, &trust_class, sizeof (trust_class) },
+	{ CKA_CERT_SHA1_HASH, "\xad\x7c\x3f\x64\xfc\x44\x39\xfe\xf4\xe9\x0b\xe8\xf4\x7c\x6c\xfa\x8a\xad\xfd\xce", 20 },
+	{ CKA_LABEL, "Cacert3 Here", 12 },
+	{ CKA_INVALID },
+};
+
+static CK_ATTRIBUTE builtin_attrs[] = {
+	{ CKA_CLASS, &builtin_class, sizeof (builtin_class) },
+	{ CKA_LABEL, "Trust Anchor Roots", 18 },
+	{ CKA_INVALID },
+};
+
+static void
+test_image (void)
+{
+	p11_array *objects;
+	CK_ATTRIBUTE *cert;
+	bool ret;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate_class, sizeof (certificate_class) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_authority_attrs);
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_trust_attrs);
+
+	p11_kit_iter_begin_with (test.iter, &test.module, 0, 0);
+
+	ret = p11_extract_p11_kit_image (test.iter, &test.ex);
+	assert_num_eq (true, ret);
+
+	objects = read_image ();
+
+	/* All the attributes of the objects make it into the image */
+	cert = find_object (objects, match);
+	assert_ptr_not_null (cert);
+	assert (p11_attrs_match (cert, cacert3_authority_attrs));
+	assert_num_eq (1, count_objects (objects, cacert3_trust_attrs));
+
+	p11_array_free (objects);
+}
+
+static void
+test_image_duplicates (void)
+{
+	p11_array *objects;
+	bool ret;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate_class, sizeof (certificate_class) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_authority_attrs);
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_trust_attrs);
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_authority_attrs);
+	mock_module_add_object (MOCK_SLOT_ONE_ID, cacert3_trust_attrs);
+
+	p11_kit_iter_begin_with (test.iter, &test.module, 0, 0);
+
+	ret = p11_extract_p11_kit_image (test.iter, &test.ex);
+	assert_num_eq (true, ret);
+
+	objects = read_image ();
+	assert_num_eq (1, count_objects (objects, match));
+	assert_num_eq (1, count_objects (objects, cacert3_trust_attrs));
+	p11_array_free (objects);
+}
+
+static void
+test_image_skip_builtin (void)
+{
+	p11_array *objects;
+	bool ret;
+
+	mock_module_add_object (MOCK_SLOT_ONE_ID, builtin_attrs);
+
+	p11_kit_iter_begin_with (test.iter, &test.module, 0, 0);
+
+	ret = p11_extract_p11_kit_image (test.iter, &test.ex);
+	assert_num_eq (true, ret);
+
+	objects = read_image ();
+	assert (objects->num > 0);
+	assert_num_eq (0, count_objects (objects, builtin_attrs));
+	p11_array_free (objects);
+}
+
+static void
+test_image_invalid (void)
+{
+	p11_array *objects;
+	p11_buffer buffer;
+
+	CK_ATTRIBUTE *attrs = p11_attrs_dup (cacert3_authority_attrs);
+
+	objects = p11_array_new (p11_attrs_free);
+	p11_array_push (objects, attrs);
+
+	p11_buffer_init (&buffer, 0);
+	p11_image_write (&buffer, objects);
+	p11_array_free (objects);
+
+	assert (p11_image_check (buffer.data, buffer.len));
+	assert (p11_image_read (buffer.data, buffer.len, &objects));
+	assert_num_eq (1, objects->num);
+	assert (p11_attrs_match (objects->elem[0], cacert3_authority_attrs));
+	p11_array_free (objects);
+
+	/* Truncated */
+	assert (!p11_image_read (buffer.data, buffer.len - 8, &objects));
+
+	/* Different version */
+	((unsigned char *)buffer.data)[16] ^= 0xff;
+	assert (p11_image_check (buffer.data, buffer.len));
+	assert (!p11_image_read (buffer.data, buffer.len, &objects));
+
+	/* Not an image */
+	assert (!p11_image_check ((unsigned char *)"-----BEGIN CERTIFICATE-----", 27));
+
+	p11_buffer_uninit (&buffer);
+}
+
+static void
+test_image_truncated (void)
+{
+	p11_array *objects;
+	p11_buffer buffer;
+	unsigned char *data;
+	size_t i;
+
+	objects = p11_array_new (p11_attrs_free);
+	p11_array_push (objects, p11_attrs_dup (cacert3_authority_attrs));
+	p11_array_push (objects, p11_attrs_dup (cacert3_trust_attrs));
+
+	p11_buffer_init (&buffer, 0);
+	p11_image_write (&buffer, objects);
+	p11_array_free (objects);
+
+	/* Cut off anywhere, including after the objects that were read */
+	for (i = 0; i < buffer.len; i++) {
+		assert (!p11_image_read (buffer.data, i, &objects));
+		assert (!p11_image_view (buffer.data, i, &objects));
+	}
+
+	/* Corrupt any byte, which may still give a valid image */
+	data = buffer.data;
+	for (i = 0; i < buffer.len; i++) {
+		data[i] ^= 0xff;
+		if (p11_image_read (buffer.data, buffer.len, &objects))
+			p11_array_free (objects);
+		if (p11_image_view (buffer.data, buffer.len, &objects))
+			p11_array_free (objects);
+		data[i] ^= 0xff;
+	}
+
+	assert (p11_image_read (buffer.data, buffer.len, &objects));
+	assert_num_eq (2, objects->num);
+	p11_array_free (objects);
+
+	p11_buffer_uninit (&buffer);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	mock_module_init ();
+
+	p11_fixture (setup, teardown);
+	p11_test (test_image, "/image/test_image");
+	p11_test (test_image_duplicates, "/image/test_image_duplicates");
+	p11_test (test_image_skip_builtin, "/image/test_image_skip_builtin");
+	p11_test (test_image_invalid, "/image/test_image_invalid");
+	p11_test (test_image_truncated, "/image/test_image_truncated");
+	return p11_test_run (argc, argv);
+}
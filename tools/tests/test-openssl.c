@@ -533,7 +533,7 @@ test_canon_name_der (void)
 		p11_buffer_uninit (&buf);
 	}
 
-	p11_dict_free (asn1_defs);
+	p11_asn1_defs_unref (asn1_defs);
 }
 
 static void
@@ -40,6 +40,7 @@
 #include "asn1.h"
 #include "attrs.h"
 #include "builder.h"
+#include "compat.h"
 #include "constants.h"
 #include "debug.h"
 #include "hash.h"
@@ -57,6 +58,9 @@ struct _p11_builder {
 	p11_asn1_cache *asn1_cache;
 	p11_dict *asn1_defs;
 	int flags;
+
+	/* Certificates whose compat objects are rebuilt at the next flush */
+	p11_dict *dirty;
 };
 
 enum {
@@ -110,6 +114,7 @@ lookup_extension (p11_builder *builder,
 	CK_OBJECT_CLASS klass = CKO_X_CERTIFICATE_EXTENSION;
 	CK_OBJECT_HANDLE obj;
 	CK_ATTRIBUTE *attrs;
+	p11_x509_fields fields;
 	unsigned char *ext;
 	void *value;
 	size_t length;
@@ -142,6 +147,9 @@ lookup_extension (p11_builder *builder,
 	/* Couldn't find a parsed extension, so look in the current certificate */
 	value = p11_attrs_find_value (cert, CKA_VALUE, &length);
 	if (value != NULL) {
+		if (p11_x509_read_fields (value, length, &fields))
+			return p11_x509_fields_extension (&fields, oid, ext_len);
+
 		node = decode_or_get_asn1 (builder, "PKIX1.Certificate", value, length);
 		return_val_if_fail (node != NULL, false);
 		return p11_x509_find_extension (node, oid, value, length, ext_len);
@@ -181,6 +189,11 @@ p11_builder_new (int flags)
 	return_val_if_fail (builder->asn1_cache, NULL);
 	builder->asn1_defs = p11_asn1_cache_defs (builder->asn1_cache);
 
+	builder->dirty = p11_dict_new (p11_dict_ulongptr_hash,
+	                               p11_dict_ulongptr_equal,
+	                               free, NULL);
+	return_val_if_fail (builder->dirty != NULL, NULL);
+
 	builder->flags = flags;
 	return builder;
 }
@@ -191,7 +204,8 @@ p11_builder_new (int flags)
 	{ CKA_MODIFIABLE, CREATE | WANT }, \
 	{ CKA_PRIVATE, CREATE }, \
 	{ CKA_LABEL, CREATE | MODIFY | WANT }, \
-	{ CKA_X_GENERATED, CREATE }
+	{ CKA_X_GENERATED, CREATE }, \
+	{ CKA_X_ORIGIN, CREATE }
 
 static CK_ATTRIBUTE *
 common_populate (p11_builder *builder,
@@ -284,29 +298,13 @@ century_for_two_digit_year (int year)
 }
 
 static bool
-calc_date (node_asn *node,
-           const char *field,
-           CK_DATE *date)
+calc_date_value (bool utc_time,
+                 const char *buf,
+                 int len,
+                 CK_DATE *date)
 {
-	node_asn *choice;
-	char buf[64];
 	int century;
-	char *sub;
 	int year;
-	int len;
-	int ret;
-
-	if (!node)
-		return false;
-
-	choice = asn1_find_node (node, field);
-	return_val_if_fail (choice != NULL, false);
-
-	len = sizeof (buf) - 1;
-	ret = asn1_read_value (node, field, buf, &len);
-	return_val_if_fail (ret == ASN1_SUCCESS, false);
-
-	sub = strconcat (field, ".", buf, NULL);
 
 	/*
 	 * So here we take a shortcut and just copy the date from the
@@ -316,19 +314,13 @@ calc_date (node_asn *node,
 	 * and time zones aren't that critical.
 	 */
 
-	if (strcmp (buf, "generalTime") == 0) {
-		len = sizeof (buf) - 1;
-		ret = asn1_read_value (node, sub, buf, &len);
-		return_val_if_fail (ret == ASN1_SUCCESS, false);
+	if (!utc_time) {
 		return_val_if_fail (len >= 8, false);
 
 		/* Same as first 8 characters of date */
 		memcpy (date, buf, 8);
 
-	} else if (strcmp (buf, "utcTime") == 0) {
-		len = sizeof (buf) - 1;
-		ret = asn1_read_value (node, sub, buf, &len);
-		return_val_if_fail (ret == ASN1_SUCCESS, false);
+	} else {
 		return_val_if_fail (len >= 6, false);
 
 		year = atoin (buf, 2);
@@ -339,13 +331,60 @@ calc_date (node_asn *node,
 
 		snprintf ((char *)date->year, 3, "%02d", century);
 		memcpy (((char *)date) + 2, buf, 6);
+	}
 
-	} else {
+	return true;
+}
+
+static bool
+calc_date (node_asn *node,
+           const char *field,
+           CK_DATE *date)
+{
+	node_asn *choice;
+	char buf[64];
+	char *sub;
+	bool utc_time;
+	int len;
+	int ret;
+
+	if (!node)
+		return false;
+
+	choice = asn1_find_node (node, field);
+	return_val_if_fail (choice != NULL, false);
+
+	len = sizeof (buf) - 1;
+	ret = asn1_read_value (node, field, buf, &len);
+	return_val_if_fail (ret == ASN1_SUCCESS, false);
+
+	if (strcmp (buf, "generalTime") == 0)
+		utc_time = false;
+	else if (strcmp (buf, "utcTime") == 0)
+		utc_time = true;
+	else
 		return_val_if_reached (false);
-	}
 
+	sub = strconcat (field, ".", buf, NULL);
+
+	len = sizeof (buf) - 1;
+	ret = asn1_read_value (node, sub, buf, &len);
 	free (sub);
-	return true;
+	return_val_if_fail (ret == ASN1_SUCCESS, false);
+
+	return calc_date_value (utc_time, buf, len, date);
+}
+
+static bool
+calc_date_der (const unsigned char *der,
+               size_t der_len,
+               CK_DATE *date)
+{
+	/* A UTCTime or GeneralizedTime is short, with a single length byte */
+	if (der == NULL || der_len < 2 || der[1] >= 0x80 || der[1] + 2 != der_len)
+		return false;
+
+	return calc_date_value (der[0] == 0x17, (const char *)der + 2, der[1], date);
 }
 
 static bool
@@ -377,6 +416,7 @@ is_v1_x509_authority (p11_builder *builder,
 	CK_ATTRIBUTE subject;
 	CK_ATTRIBUTE issuer;
 	CK_ATTRIBUTE *value;
+	p11_x509_fields fields;
 	char buffer[16];
 	node_asn *node;
 	int len;
@@ -386,6 +426,13 @@ is_v1_x509_authority (p11_builder *builder,
 	if (value == NULL)
 		return false;
 
+	/* Must be v1, and self-signed, ie: same subject and issuer */
+	if (p11_x509_read_fields (value->pValue, value->ulValueLen, &fields)) {
+		return fields.version == 0 &&
+		       fields.subject_len == fields.issuer_len &&
+		       memcmp (fields.subject, fields.issuer, fields.issuer_len) == 0;
+	}
+
 	node = decode_or_get_asn1 (builder, "PKIX1.Certificate",
 	                           value->pValue, value->ulValueLen);
 	return_val_if_fail (node != NULL, false);
@@ -469,6 +516,7 @@ calc_certificate_category (p11_builder *builder,
 
 static CK_ATTRIBUTE *
 certificate_value_attrs (CK_ATTRIBUTE *attrs,
+                         p11_x509_fields *fields,
                          node_asn *node,
                          const unsigned char *der,
                          size_t der_len)
@@ -503,22 +551,45 @@ certificate_value_attrs (CK_ATTRIBUTE *attrs,
 	else
 		calc_check_value (der, der_len, checkv);
 
-	if (!calc_date (node, "tbsCertificate.validity.notBefore", &startv))
-		start_date.ulValueLen = 0;
-	if (!calc_date (node, "tbsCertificate.validity.notAfter", &endv))
-		end_date.ulValueLen = 0;
+	if (fields) {
+		if (!calc_date_der (fields->not_before, fields->not_before_len, &startv))
+			start_date.ulValueLen = 0;
+		if (!calc_date_der (fields->not_after, fields->not_after_len, &endv))
+			end_date.ulValueLen = 0;
+
+		issuer.pValue = (void *)fields->issuer;
+		issuer.ulValueLen = fields->issuer_len;
+		subject.pValue = (void *)fields->subject;
+		subject.ulValueLen = fields->subject_len;
+		serial_number.pValue = (void *)fields->serial;
+		serial_number.ulValueLen = fields->serial_len;
 
-	calc_element (node, der, der_len, "tbsCertificate.issuer.rdnSequence", &issuer);
-	if (!calc_element (node, der, der_len, "tbsCertificate.subject.rdnSequence", &subject))
-		subject.type = CKA_INVALID;
-	calc_element (node, der, der_len, "tbsCertificate.serialNumber", &serial_number);
+		p11_hash_sha1 (checksum, fields->public_key, fields->public_key_len, NULL);
 
-	if (!node || !p11_x509_calc_keyid (node, der, der_len, checksum)) {
-		hash_of_subject_public_key.ulValueLen = 0;
-		id.type = CKA_INVALID;
+		labelv = p11_x509_find_dn_name (fields->subject, fields->subject_len, P11_OID_CN);
+		if (!labelv)
+			labelv = p11_x509_find_dn_name (fields->subject, fields->subject_len, P11_OID_OU);
+		if (!labelv)
+			labelv = p11_x509_find_dn_name (fields->subject, fields->subject_len, P11_OID_O);
+
+	} else {
+		if (!calc_date (node, "tbsCertificate.validity.notBefore", &startv))
+			start_date.ulValueLen = 0;
+		if (!calc_date (node, "tbsCertificate.validity.notAfter", &endv))
+			end_date.ulValueLen = 0;
+
+		calc_element (node, der, der_len, "tbsCertificate.issuer.rdnSequence", &issuer);
+		if (!calc_element (node, der, der_len, "tbsCertificate.subject.rdnSequence", &subject))
+			subject.type = CKA_INVALID;
+		calc_element (node, der, der_len, "tbsCertificate.serialNumber", &serial_number);
+
+		if (!node || !p11_x509_calc_keyid (node, der, der_len, checksum)) {
+			hash_of_subject_public_key.ulValueLen = 0;
+			id.type = CKA_INVALID;
+		}
 	}
 
-	if (node) {
+	if (!fields && node) {
 		labelv = p11_x509_lookup_dn_name (node, "tbsCertificate.subject",
 		                                  der, der_len, P11_OID_CN);
 		if (!labelv)
@@ -554,6 +625,8 @@ certificate_populate (p11_builder *builder,
 {
 	CK_ULONG categoryv = 0UL;
 	CK_ATTRIBUTE *attrs = NULL;
+	p11_x509_fields fields;
+	bool have_fields = false;
 	node_asn *node = NULL;
 	unsigned char *der = NULL;
 	size_t der_len = 0;
@@ -564,11 +637,14 @@ certificate_populate (p11_builder *builder,
 	attrs = common_populate (builder, index, cert);
 	return_val_if_fail (attrs != NULL, NULL);
 
+	/* Most certificates can be read without decoding them with libtasn1 */
 	der = p11_attrs_find_value (cert, CKA_VALUE, &der_len);
-	if (der != NULL)
+	if (der != NULL && p11_x509_read_fields (der, der_len, &fields))
+		have_fields = true;
+	else if (der != NULL)
 		node = decode_or_get_asn1 (builder, "PKIX1.Certificate", der, der_len);
 
-	attrs = certificate_value_attrs (attrs, node, der, der_len);
+	attrs = certificate_value_attrs (attrs, have_fields ? &fields : NULL, node, der, der_len);
 	return_val_if_fail (attrs != NULL, NULL);
 
 	if (!calc_certificate_category (builder, index, cert, &categoryv))
@@ -940,6 +1016,7 @@ p11_builder_free (p11_builder *builder)
 	return_if_fail (builder != NULL);
 
 	p11_asn1_cache_free (builder->asn1_cache);
+	p11_dict_free (builder->dirty);
 	free (builder);
 }
 
@@ -1495,6 +1572,22 @@ replace_trust_and_assertions (p11_builder *builder,
 	p11_array_free (rejects);
 }
 
+static void
+mark_dirty (p11_builder *builder,
+            CK_OBJECT_HANDLE handle)
+{
+	CK_OBJECT_HANDLE *key;
+
+	if (p11_dict_get (builder->dirty, &handle))
+		return;
+
+	key = memdup (&handle, sizeof (handle));
+	return_if_fail (key != NULL);
+
+	if (!p11_dict_set (builder->dirty, key, key))
+		return_if_reached ();
+}
+
 static void
 replace_compat_for_cert (p11_builder *builder,
                          p11_index *index,
@@ -1524,14 +1617,13 @@ replace_compat_for_cert (p11_builder *builder,
 			match[0].ulValueLen = value->ulValueLen;
 			handle = p11_index_find (index, match, -1);
 		}
-		if (handle != 0)
-			attrs = p11_index_lookup (index, handle);
 	}
 
+	/* The removed attributes are gone by the next flush */
 	if (handle == 0)
 		remove_trust_and_assertions (builder, index, attrs);
 	else
-		replace_trust_and_assertions (builder, index, attrs);
+		mark_dirty (builder, handle);
 }
 
 static void
@@ -1550,10 +1642,8 @@ replace_compat_for_ext (p11_builder *builder,
 		return;
 
 	handles = lookup_related (index, CKO_CERTIFICATE, id);
-	for (i = 0; handles && handles[i] != 0; i++) {
-		attrs = p11_index_lookup (index, handles[i]);
-		replace_trust_and_assertions (builder, index, attrs);
-	}
+	for (i = 0; handles && handles[i] != 0; i++)
+		mark_dirty (builder, handles[i]);
 	free (handles);
 }
 
@@ -1606,6 +1696,7 @@ p11_builder_changed (void *bilder,
 	static CK_OBJECT_CLASS extension = CKO_X_CERTIFICATE_EXTENSION;
 	static CK_CERTIFICATE_TYPE x509 = CKC_X_509;
 
+	/* Sorted by type, like the attributes that the index passes us */
 	static CK_ATTRIBUTE match_cert[] = {
 		{ CKA_CLASS, &certificate, sizeof (certificate) },
 		{ CKA_CERTIFICATE_TYPE, &x509, sizeof (x509) },
@@ -1646,18 +1737,83 @@ p11_builder_changed (void *bilder,
 	p11_index_batch (index);
 
 	/* A certificate */
-	if (p11_attrs_match (attrs, match_cert)) {
+	if (p11_attrs_match_sorted (attrs, match_cert)) {
 		replace_compat_for_cert (builder, index, handle, attrs);
 
 	/* An ExtendedKeyUsage extension */
-	} else if (p11_attrs_match (attrs, match_eku) ||
-	           p11_attrs_match (attrs, match_ku)) {
+	} else if (p11_attrs_match_sorted (attrs, match_eku) ||
+	           p11_attrs_match_sorted (attrs, match_ku)) {
 		replace_compat_for_ext (builder, index, handle, attrs);
 
 	/* A BasicConstraints extension */
-	} else if (p11_attrs_match (attrs, match_bc)) {
+	} else if (p11_attrs_match_sorted (attrs, match_bc)) {
 		update_related_category (builder, index, handle, attrs);
 	}
 
 	p11_index_finish (index);
 }
+
+static void
+rebuild_dirty (p11_builder *builder,
+               p11_index *index)
+{
+	CK_OBJECT_HANDLE *handle;
+	CK_ATTRIBUTE *attrs;
+	p11_dictiter iter;
+	p11_dict *dirty;
+
+	if (p11_dict_size (builder->dirty) == 0)
+		return;
+
+	/* Certificates touched several times in a batch are rebuilt once */
+	dirty = builder->dirty;
+	builder->dirty = p11_dict_new (p11_dict_ulongptr_hash,
+	                               p11_dict_ulongptr_equal,
+	                               free, NULL);
+	return_if_fail (builder->dirty != NULL);
+
+	p11_index_batch (index);
+
+	p11_dict_iterate (dirty, &iter);
+	while (p11_dict_next (&iter, (void **)&handle, NULL)) {
+		attrs = p11_index_lookup (index, *handle);
+		if (attrs != NULL)
+			replace_trust_and_assertions (builder, index, attrs);
+	}
+
+	p11_index_finish (index);
+	p11_dict_free (dirty);
+}
+
+void
+p11_builder_flush (void *bilder,
+                   p11_index *index)
+{
+	p11_builder *builder = bilder;
+
+	return_if_fail (builder != NULL);
+	return_if_fail (index != NULL);
+
+	/* A lazy builder leaves this until p11_builder_generate() */
+	if (builder->flags & P11_BUILDER_FLAG_LAZY)
+		return;
+
+	rebuild_dirty (builder, index);
+}
+
+bool
+p11_builder_pending (p11_builder *builder)
+{
+	return_val_if_fail (builder != NULL, false);
+	return p11_dict_size (builder->dirty) > 0;
+}
+
+void
+p11_builder_generate (p11_builder *builder,
+                      p11_index *index)
+{
+	return_if_fail (builder != NULL);
+	return_if_fail (index != NULL);
+
+	rebuild_dirty (builder, index);
+}
@@ -43,6 +43,7 @@
 enum {
 	P11_BUILDER_FLAG_NONE = 0,
 	P11_BUILDER_FLAG_TOKEN = 1 << 1,
+	P11_BUILDER_FLAG_LAZY = 1 << 2,
 };
 
 typedef struct _p11_builder p11_builder;
@@ -61,6 +62,14 @@ void                  p11_builder_changed     (void *builder,
                                                CK_OBJECT_HANDLE handle,
                                                CK_ATTRIBUTE *attrs);
 
+void                  p11_builder_flush       (void *builder,
+                                               p11_index *index);
+
+bool                  p11_builder_pending     (p11_builder *builder);
+
+void                  p11_builder_generate    (p11_builder *builder,
+                                               p11_index *index);
+
 p11_asn1_cache *      p11_builder_get_cache   (p11_builder *builder);
 
 #endif /* P11_BUILDER_H_ */
@@ -0,0 +1,631 @@
+/*
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#include "config.h"
+
+#include "attrs.h"
+#include "buffer.h"
+#include "cache.h"
+#include "compat.h"
+#define P11_DEBUG_FLAG P11_DEBUG_TRUST
+#include "debug.h"
+#include "dict.h"
+#include "hash.h"
+#include "pkcs11.h"
+
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * The cache holds the objects parsed from each file of a token, so that
+ * unchanged files need not be parsed again. A file is identified by its
+ * path, inode, size and modification time, and the flags it was parsed
+ * with.
+ *
+ * The cache file is written in the byte order and word size of the host,
+ * and is ignored when they don't match:
+ *
+ *  - magic, byte order mark, sizeof (CK_ULONG), path of the token
+ *  - for each file: path, inode, size, mtime, flags, parse result,
+ *    and the length of the objects that follow
+ *  - the number of objects, and for each object the number of attributes,
+ *    followed by the type, length and value of each attribute
+ */
+
+#define CACHE_MAGIC "p11-kit-trust-cache-v1"
+#define CACHE_BYTE_ORDER 0x01020304U
+#define CACHE_NULL_VALUE 0xFFFFFFFFU
+
+typedef struct {
+	uint64_t inode;
+	uint64_t size;
+	int64_t mtime;
+	uint32_t flags;
+	int32_t result;
+	const unsigned char *data;
+	size_t length;
+	void *alloc;
+	bool used;
+} cache_entry;
+
+struct _p11_cache {
+	char *filename;
+	char *source;
+	p11_mmap *map;
+	p11_dict *entries;
+	bool dirty;
+};
+
+typedef struct {
+	const unsigned char *data;
+	size_t length;
+	size_t offset;
+	bool failed;
+} cache_reader;
+
+static void
+free_entry (void *data)
+{
+	cache_entry *entry = data;
+	free (entry->alloc);
+	free (entry);
+}
+
+static const unsigned char *
+reader_bytes (cache_reader *reader,
+              size_t length)
+{
+	const unsigned char *data;
+
+	if (reader->failed || reader->length - reader->offset < length) {
+		reader->failed = true;
+		return NULL;
+	}
+
+	data = reader->data + reader->offset;
+	reader->offset += length;
+	return data;
+}
+
+static uint32_t
+reader_uint32 (cache_reader *reader)
+{
+	const unsigned char *data;
+	uint32_t value = 0;
+
+	data = reader_bytes (reader, sizeof (value));
+	if (data != NULL)
+		memcpy (&value, data, sizeof (value));
+	return value;
+}
+
+static uint64_t
+reader_uint64 (cache_reader *reader)
+{
+	const unsigned char *data;
+	uint64_t value = 0;
+
+	data = reader_bytes (reader, sizeof (value));
+	if (data != NULL)
+		memcpy (&value, data, sizeof (value));
+	return value;
+}
+
+static const unsigned char *
+reader_string (cache_reader *reader,
+               size_t *length)
+{
+	*length = reader_uint32 (reader);
+	return reader_bytes (reader, *length);
+}
+
+static void
+buffer_add_uint32 (p11_buffer *buffer,
+                   uint32_t value)
+{
+	p11_buffer_add (buffer, &value, sizeof (value));
+}
+
+static void
+buffer_add_uint64 (p11_buffer *buffer,
+                   uint64_t value)
+{
+	p11_buffer_add (buffer, &value, sizeof (value));
+}
+
+static void
+buffer_add_string (p11_buffer *buffer,
+                   const char *string)
+{
+	size_t length = strlen (string);
+	buffer_add_uint32 (buffer, length);
+	p11_buffer_add (buffer, string, length);
+}
+
+static bool
+read_objects (const unsigned char *data,
+              size_t length,
+              p11_array **parsed)
+{
+	cache_reader reader = { data, length, 0, false };
+	const unsigned char *value;
+	CK_ATTRIBUTE *attrs;
+	p11_array *objects;
+	uint32_t num_objects;
+	uint32_t num_attrs;
+	uint32_t value_len;
+	uint32_t i, j;
+
+	num_objects = reader_uint32 (&reader);
+	objects = p11_array_new (p11_attrs_free);
+	return_val_if_fail (objects != NULL, false);
+
+	for (i = 0; !reader.failed && i < num_objects; i++) {
+		num_attrs = reader_uint32 (&reader);
+
+		/* Each attribute takes at least 12 bytes */
+		if (num_attrs > (reader.length - reader.offset) / 12) {
+			reader.failed = true;
+			break;
+		}
+
+		attrs = calloc (num_attrs + 1, sizeof (CK_ATTRIBUTE));
+		if (attrs == NULL) {
+			p11_array_free (objects);
+			return_val_if_reached (false);
+		}
+
+		for (j = 0; !reader.failed && j < num_attrs; j++) {
+			attrs[j].type = reader_uint64 (&reader);
+			value_len = reader_uint32 (&reader);
+			if (value_len == CACHE_NULL_VALUE)
+				continue;
+
+			value = reader_bytes (&reader, value_len);
+			if (value == NULL)
+				break;
+
+			attrs[j].pValue = malloc (value_len ? value_len : 1);
+			if (attrs[j].pValue == NULL) {
+				attrs[j].type = CKA_INVALID;
+				p11_attrs_free (attrs);
+				p11_array_free (objects);
+				return_val_if_reached (false);
+			}
+			memcpy (attrs[j].pValue, value, value_len);
+			attrs[j].ulValueLen = value_len;
+		}
+
+		attrs[j].type = CKA_INVALID;
+		if (!p11_array_push (objects, attrs)) {
+			p11_attrs_free (attrs);
+			p11_array_free (objects);
+			return_val_if_reached (false);
+		}
+	}
+
+	if (reader.failed || reader.offset != reader.length) {
+		p11_array_free (objects);
+		return false;
+	}
+
+	*parsed = objects;
+	return true;
+}
+
+static void
+write_objects (p11_buffer *buffer,
+               p11_array *parsed)
+{
+	CK_ATTRIBUTE *attrs;
+	CK_ULONG count;
+	CK_ULONG i;
+	int j;
+
+	if (parsed == NULL) {
+		buffer_add_uint32 (buffer, 0);
+		return;
+	}
+
+	buffer_add_uint32 (buffer, parsed->num);
+
+	for (j = 0; j < parsed->num; j++) {
+		attrs = parsed->elem[j];
+		count = p11_attrs_count (attrs);
+		buffer_add_uint32 (buffer, count);
+
+		for (i = 0; i < count; i++) {
+			buffer_add_uint64 (buffer, attrs[i].type);
+			if (attrs[i].pValue == NULL) {
+				buffer_add_uint32 (buffer, CACHE_NULL_VALUE);
+			} else {
+				buffer_add_uint32 (buffer, attrs[i].ulValueLen);
+				p11_buffer_add (buffer, attrs[i].pValue, attrs[i].ulValueLen);
+			}
+		}
+	}
+}
+
+static bool
+check_cache_file (const char *filename)
+{
+	struct stat sb;
+
+	if (stat (filename, &sb) < 0) {
+		if (errno != ENOENT)
+			p11_debug ("couldn't access cache: %s: %s", filename, strerror (errno));
+		return false;
+	}
+
+#ifdef OS_UNIX
+	/*
+	 * Objects from the cache are trusted as much as the files they were
+	 * parsed from, so don't use a cache that others could have written.
+	 */
+	if ((sb.st_uid != 0 && sb.st_uid != getuid ()) ||
+	    (sb.st_mode & (S_IWGRP | S_IWOTH))) {
+		p11_debug ("not using cache writable by others: %s", filename);
+		return false;
+	}
+#endif
+
+	return true;
+}
+
+static void
+load_cache (p11_cache *cache)
+{
+	cache_reader reader = { NULL, 0, 0, false };
+	const unsigned char *magic;
+	const unsigned char *source;
+	const unsigned char *path;
+	cache_entry *entry;
+	size_t length;
+	char *key;
+	void *data;
+	size_t size;
+
+	if (!check_cache_file (cache->filename))
+		return;
+
+	cache->map = p11_mmap_open (cache->filename, &data, &size);
+	if (cache->map == NULL) {
+		p11_debug ("couldn't map cache: %s: %s", cache->filename, strerror (errno));
+		return;
+	}
+
+	reader.data = data;
+	reader.length = size;
+
+	magic = reader_bytes (&reader, sizeof (CACHE_MAGIC));
+	if (magic == NULL || memcmp (magic, CACHE_MAGIC, sizeof (CACHE_MAGIC)) != 0 ||
+	    reader_uint32 (&reader) != CACHE_BYTE_ORDER ||
+	    reader_uint32 (&reader) != sizeof (CK_ULONG)) {
+		p11_debug ("ignoring unrecognized cache: %s", cache->filename);
+		return;
+	}
+
+	source = reader_string (&reader, &length);
+	if (source == NULL || length != strlen (cache->source) ||
+	    memcmp (source, cache->source, length) != 0) {
+		p11_debug ("ignoring cache for another path: %s", cache->filename);
+		return;
+	}
+
+	while (!reader.failed && reader.offset < reader.length) {
+		entry = calloc (1, sizeof (cache_entry));
+		return_if_fail (entry != NULL);
+
+		path = reader_string (&reader, &length);
+		entry->inode = reader_uint64 (&reader);
+		entry->size = reader_uint64 (&reader);
+		entry->mtime = reader_uint64 (&reader);
+		entry->flags = reader_uint32 (&reader);
+		entry->result = reader_uint32 (&reader);
+		entry->length = reader_uint64 (&reader);
+		entry->data = reader_bytes (&reader, entry->length);
+
+		if (reader.failed) {
+			free (entry);
+			break;
+		}
+
+		key = strndup ((const char *)path, length);
+		return_if_fail (key != NULL);
+
+		if (!p11_dict_set (cache->entries, key, entry))
+			return_if_reached ();
+	}
+
+	if (reader.failed) {
+		p11_debug ("ignoring truncated cache: %s", cache->filename);
+		p11_dict_clear (cache->entries);
+	}
+}
+
+p11_cache *
+p11_cache_new (const char *directory,
+               const char *source)
+{
+	unsigned char hash[P11_HASH_SHA1_LEN];
+	p11_cache *cache;
+
+	return_val_if_fail (directory != NULL, NULL);
+	return_val_if_fail (source != NULL, NULL);
+
+	cache = calloc (1, sizeof (p11_cache));
+	return_val_if_fail (cache != NULL, NULL);
+
+	/* The cache file is named after the path of the token */
+	p11_hash_sha1 (hash, source, strlen (source), NULL);
+	if (asprintf (&cache->filename, "%s/trust-%02x%02x%02x%02x%02x%02x%02x%02x.cache",
+	              directory, hash[0], hash[1], hash[2], hash[3],
+	              hash[4], hash[5], hash[6], hash[7]) < 0)
+		return_val_if_reached (NULL);
+
+	cache->source = strdup (source);
+	return_val_if_fail (cache->source != NULL, NULL);
+
+	cache->entries = p11_dict_new (p11_dict_str_hash, p11_dict_str_equal,
+	                               free, free_entry);
+	return_val_if_fail (cache->entries != NULL, NULL);
+
+	load_cache (cache);
+	return cache;
+}
+
+bool
+p11_cache_lookup (p11_cache *cache,
+                  const char *filename,
+                  struct stat *sb,
+                  int flags,
+                  int *result,
+                  p11_array **parsed)
+{
+	cache_entry *entry;
+
+	return_val_if_fail (cache != NULL, false);
+	return_val_if_fail (filename != NULL, false);
+	return_val_if_fail (sb != NULL, false);
+	return_val_if_fail (result != NULL, false);
+	return_val_if_fail (parsed != NULL, false);
+
+	entry = p11_dict_get (cache->entries, filename);
+	if (entry == NULL)
+		return false;
+
+	if (entry->inode != (uint64_t)sb->st_ino ||
+	    entry->size != (uint64_t)sb->st_size ||
+	    entry->mtime != (int64_t)sb->st_mtime ||
+	    entry->flags != (uint32_t)flags) {
+		p11_debug ("cache is stale for: %s", filename);
+		return false;
+	}
+
+	if (!read_objects (entry->data, entry->length, parsed)) {
+		p11_debug ("invalid objects in cache for: %s", filename);
+		return false;
+	}
+
+	p11_debug ("cached: %s", filename);
+	*result = entry->result;
+	entry->used = true;
+	return true;
+}
+
+void
+p11_cache_store (p11_cache *cache,
+                 const char *filename,
+                 struct stat *sb,
+                 int flags,
+                 int result,
+                 p11_array *parsed)
+{
+	p11_buffer buffer;
+	cache_entry *entry;
+	char *key;
+
+	return_if_fail (cache != NULL);
+	return_if_fail (filename != NULL);
+	return_if_fail (sb != NULL);
+
+	/*
+	 * A file modified within the last second could be modified again
+	 * without its mtime changing, so don't cache it yet.
+	 */
+	if (sb->st_mtime >= time (NULL) - 1) {
+		p11_debug ("not caching recently modified: %s", filename);
+		return;
+	}
+
+	if (!p11_buffer_init (&buffer, 1024))
+		return_if_reached ();
+
+	write_objects (&buffer, parsed);
+	return_if_fail (p11_buffer_ok (&buffer));
+
+	entry = calloc (1, sizeof (cache_entry));
+	return_if_fail (entry != NULL);
+
+	entry->inode = sb->st_ino;
+	entry->size = sb->st_size;
+	entry->mtime = sb->st_mtime;
+	entry->flags = flags;
+	entry->result = result;
+	entry->alloc = p11_buffer_steal (&buffer, &entry->length);
+	entry->data = entry->alloc;
+	entry->used = true;
+	p11_buffer_uninit (&buffer);
+
+	key = strdup (filename);
+	return_if_fail (key != NULL);
+
+	if (!p11_dict_set (cache->entries, key, entry))
+		return_if_reached ();
+
+	cache->dirty = true;
+}
+
+static bool
+write_cache_file (const char *filename,
+                  const void *data,
+                  size_t length)
+{
+	const unsigned char *buf = data;
+	ssize_t res;
+	char *temp;
+	bool ret;
+	int fd;
+
+	if (asprintf (&temp, "%s.XXXXXX", filename) < 0)
+		return_val_if_reached (false);
+
+	fd = mkstemp (temp);
+	if (fd < 0) {
+		p11_debug ("couldn't create cache: %s: %s", temp, strerror (errno));
+		free (temp);
+		return false;
+	}
+
+	while (length > 0) {
+		res = write (fd, buf, length);
+		if (res < 0) {
+			if (errno == EAGAIN || errno == EINTR)
+				continue;
+			break;
+		}
+		buf += res;
+		length -= res;
+	}
+
+	ret = (length == 0);
+	if (close (fd) < 0)
+		ret = false;
+
+#ifdef OS_UNIX
+	/* Readable by everyone, but only writable by us */
+	if (ret && chmod (temp, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH) < 0)
+		ret = false;
+#else
+	if (ret)
+		unlink (filename);
+#endif
+
+	/* Atomically rename the temp file over the cache */
+	if (ret && rename (temp, filename) < 0)
+		ret = false;
+
+	if (!ret) {
+		p11_debug ("couldn't write cache: %s: %s", filename, strerror (errno));
+		unlink (temp);
+	}
+
+	free (temp);
+	return ret;
+}
+
+bool
+p11_cache_write (p11_cache *cache)
+{
+	p11_buffer buffer;
+	cache_entry *entry;
+	p11_dictiter iter;
+	char *path;
+	bool ret;
+
+	return_val_if_fail (cache != NULL, false);
+
+	/* Entries for files that have gone away are dropped */
+	p11_dict_iterate (cache->entries, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&entry)) {
+		if (!entry->used)
+			cache->dirty = true;
+	}
+
+	if (!cache->dirty)
+		return true;
+
+	if (!p11_buffer_init (&buffer, 4096))
+		return_val_if_reached (false);
+
+	p11_buffer_add (&buffer, CACHE_MAGIC, sizeof (CACHE_MAGIC));
+	buffer_add_uint32 (&buffer, CACHE_BYTE_ORDER);
+	buffer_add_uint32 (&buffer, sizeof (CK_ULONG));
+	buffer_add_string (&buffer, cache->source);
+
+	p11_dict_iterate (cache->entries, &iter);
+	while (p11_dict_next (&iter, (void **)&path, (void **)&entry)) {
+		if (!entry->used)
+			continue;
+		buffer_add_string (&buffer, path);
+		buffer_add_uint64 (&buffer, entry->inode);
+		buffer_add_uint64 (&buffer, entry->size);
+		buffer_add_uint64 (&buffer, entry->mtime);
+		buffer_add_uint32 (&buffer, entry->flags);
+		buffer_add_uint32 (&buffer, entry->result);
+		buffer_add_uint64 (&buffer, entry->length);
+		p11_buffer_add (&buffer, entry->data, entry->length);
+	}
+
+	return_val_if_fail (p11_buffer_ok (&buffer), false);
+
+	ret = write_cache_file (cache->filename, buffer.data, buffer.len);
+	if (ret)
+		cache->dirty = false;
+
+	p11_buffer_uninit (&buffer);
+	return ret;
+}
+
+void
+p11_cache_free (p11_cache *cache)
+{
+	if (!cache)
+		return;
+
+	p11_dict_free (cache->entries);
+	if (cache->map)
+		p11_mmap_close (cache->map);
+	free (cache->source);
+	free (cache->filename);
+	free (cache);
+}
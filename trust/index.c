@@ -41,35 +41,92 @@
 #include "dict.h"
 #include "index.h"
 #include "module.h"
+#include "x509.h"
 
 #include <assert.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 /*
- * The number of buckets we use for indexing, should end up as roughly
- * equal to the expected number of unique attribute values * 0.75,
- * prime if possible. Currently we don't expand the index, so this is
- * just a good guess for general usage.
+ * The number of buckets a new index starts out with. The bucket table
+ * grows as entries are added, and shrinks back as they are removed,
+ * but never below this size.
  */
-#define NUM_BUCKETS 7919
+#define MIN_BUCKETS 31
+
+/*
+ * The number of old buckets that are moved over to the new table for
+ * each modification of the index, while it is being rehashed.
+ */
+#define REHASH_STEPS 16
 
 /*
  * The number of indexes to use when trying to find a matching object.
  */
 #define MAX_SELECT 3
 
+/*
+ * The maximum number of attribute types that can be indexed.
+ */
+#define MAX_INDEXED 16
+
+/*
+ * The bits in the filter of an indexed attribute type for each value,
+ * and the number of those bits set by each value. When the filters are
+ * built that's at most 1.7% false positives, and it grows as more values
+ * are added until the filters are built again.
+ */
+#define FILTER_BITS 10
+#define FILTER_PROBES 3
+#define FILTER_MIN_BITS 64
+
 typedef struct {
 	CK_OBJECT_HANDLE *elem;
 	int num;
 } index_bucket;
 
+typedef struct {
+	uint32_t *bits;
+	unsigned int mask;
+} index_filter;
+
 struct _p11_index {
 	/* The list of objects by handle */
 	p11_dict *objects;
 
 	/* Used for indexing */
 	index_bucket *buckets;
+	unsigned int num_buckets;
+	unsigned int num_entries;
+
+	/* The previous buckets, while incrementally rehashing */
+	index_bucket *rehash;
+	unsigned int num_rehash;
+	unsigned int rehash_at;
+
+	/* The attribute types that are indexed */
+	CK_ATTRIBUTE_TYPE indexed[MAX_INDEXED];
+	int num_indexed;
+
+	/* Bloom filters of the values of each indexed attribute type */
+	index_filter filters[MAX_INDEXED];
+	bool filtered;
+	unsigned int filter_objects;
+	unsigned int filter_changes;
+	p11_index_filter_stats filter_stats;
+
+	/* All the object handles, in order */
+	index_bucket all;
+
+	/* Handles of removed objects still in all, until it's compacted */
+	unsigned int all_removed;
+
+	/* The handle of the last object added */
+	CK_OBJECT_HANDLE last_handle;
+
+	/* Incremented when buckets are replaced, or moved while rehashing */
+	unsigned int generation;
 
 	/* Data passed to callbacks */
 	void *data;
@@ -80,6 +137,9 @@ struct _p11_index {
 	/* Called after objects change */
 	p11_index_notify_cb notify;
 
+	/* Called once all the changes so far have been notified */
+	p11_index_flush_cb flush;
+
 	/* Used for queueing changes, when in a batch */
 	p11_dict *changes;
 	bool notifying;
@@ -88,13 +148,45 @@ struct _p11_index {
 typedef struct {
 	CK_OBJECT_HANDLE handle;
 	CK_ATTRIBUTE *attrs;
+
+	/* The attributes are sorted by type, see p11_attrs_bits() for bits */
+	CK_ULONG count;
+	uint64_t bits;
+
+	/* The attribute values belong to the caller of p11_index_load() */
+	bool borrowed;
+
+	/* The attributes and their values are one allocation, see index_pack() */
+	bool packed;
 } index_object;
 
+/* The attribute types indexed unless p11_index_set_indexed() is used */
+static const CK_ATTRIBUTE_TYPE default_indexed[] = {
+	CKA_CLASS,
+	CKA_VALUE,
+	CKA_OBJECT_ID,
+	CKA_ID,
+};
+
+static void
+free_attrs (index_object *obj)
+{
+	/* Borrowed values aren't ours, and packed ones go with the array */
+	if (obj->borrowed || obj->packed)
+		free (obj->attrs);
+	else
+		p11_attrs_free (obj->attrs);
+
+	obj->attrs = NULL;
+	obj->borrowed = false;
+	obj->packed = false;
+}
+
 static void
 free_object (void *data)
 {
 	index_object *obj = data;
-	p11_attrs_free (obj->attrs);
+	free_attrs (obj);
 	free (obj);
 }
 
@@ -117,24 +209,54 @@ p11_index_new (p11_index_build_cb build,
 	                               NULL, free_object);
 	return_val_if_fail (index->objects != NULL, NULL);
 
-	index->buckets = calloc (NUM_BUCKETS, sizeof (index_bucket));
+	index->num_buckets = MIN_BUCKETS;
+	index->buckets = calloc (index->num_buckets, sizeof (index_bucket));
 	return_val_if_fail (index->buckets != NULL, NULL);
 
+	index->num_indexed = sizeof (default_indexed) / sizeof (default_indexed[0]);
+	memcpy (index->indexed, default_indexed, sizeof (default_indexed));
+
 	return index;
 }
 
-void
-p11_index_free (p11_index *index)
+static void
+free_buckets (index_bucket *buckets,
+              unsigned int num)
+{
+	unsigned int i;
+
+	if (buckets == NULL)
+		return;
+	for (i = 0; i < num; i++)
+		free (buckets[i].elem);
+	free (buckets);
+}
+
+static void
+filter_clear (p11_index *index)
 {
 	int i;
 
+	for (i = 0; i < MAX_INDEXED; i++) {
+		free (index->filters[i].bits);
+		index->filters[i].bits = NULL;
+		index->filters[i].mask = 0;
+	}
+
+	index->filtered = false;
+}
+
+void
+p11_index_free (p11_index *index)
+{
 	return_if_fail (index != NULL);
 
 	p11_dict_free (index->objects);
 	p11_dict_free (index->changes);
-	for (i = 0; i < NUM_BUCKETS; i++)
-		free (index->buckets[i].elem);
-	free (index->buckets);
+	free_buckets (index->buckets, index->num_buckets);
+	free_buckets (index->rehash, index->num_rehash);
+	free (index->all.elem);
+	filter_clear (index);
 	free (index);
 }
 
@@ -145,19 +267,40 @@ p11_index_size (p11_index *index)
 	return p11_dict_size (index->objects);
 }
 
+static int
+indexed_slot (p11_index *index,
+              CK_ATTRIBUTE_TYPE type)
+{
+	int i;
+
+	for (i = 0; i < index->num_indexed; i++) {
+		if (index->indexed[i] == type)
+			return i;
+	}
+
+	return -1;
+}
+
 static bool
 is_indexable (p11_index *index,
               CK_ATTRIBUTE_TYPE type)
 {
-	switch (type) {
-	case CKA_CLASS:
-	case CKA_VALUE:
-	case CKA_OBJECT_ID:
-	case CKA_ID:
-		return true;
+	return indexed_slot (index, type) >= 0;
+}
+
+static bool
+all_indexed (p11_index *index,
+             CK_ATTRIBUTE *match,
+             CK_ULONG count)
+{
+	CK_ULONG n;
+
+	for (n = 0; n < count; n++) {
+		if (!is_indexable (index, match[n].type))
+			return false;
 	}
 
-	return false;
+	return true;
 }
 
 static unsigned int
@@ -190,7 +333,20 @@ binary_search (CK_OBJECT_HANDLE *elem,
 }
 
 
-static void
+static bool
+bucket_contains (index_bucket *bucket,
+                 CK_OBJECT_HANDLE handle)
+{
+	int at;
+
+	if (bucket == NULL || !bucket->num)
+		return false;
+
+	at = binary_search (bucket->elem, 0, bucket->num, handle);
+	return at < bucket->num && bucket->elem[at] == handle;
+}
+
+static bool
 bucket_insert (index_bucket *bucket,
                CK_OBJECT_HANDLE handle)
 {
@@ -200,21 +356,47 @@ bucket_insert (index_bucket *bucket,
 	if (bucket->elem) {
 		at = binary_search (bucket->elem, 0, bucket->num, handle);
 		if (at < bucket->num && bucket->elem[at] == handle)
-			return;
+			return false;
 	}
 
 	alloc = alloc_size (bucket->num);
 	if (bucket->num + 1 > alloc) {
 		alloc = alloc ? alloc * 2 : 1;
-		return_if_fail (alloc != 0);
+		return_val_if_fail (alloc != 0, false);
 		bucket->elem = realloc (bucket->elem, alloc * sizeof (CK_OBJECT_HANDLE));
-		return_if_fail (bucket->elem != NULL);
+		return_val_if_fail (bucket->elem != NULL, false);
 	}
 
 	memmove (bucket->elem + at + 1, bucket->elem + at,
 	         (bucket->num - at) * sizeof (CK_OBJECT_HANDLE));
 	bucket->elem[at] = handle;
 	bucket->num++;
+	return true;
+}
+
+static bool
+bucket_remove (index_bucket *bucket,
+               CK_OBJECT_HANDLE handle)
+{
+	int at;
+
+	if (!bucket->num)
+		return false;
+
+	at = binary_search (bucket->elem, 0, bucket->num, handle);
+	if (at >= bucket->num || bucket->elem[at] != handle)
+		return false;
+
+	bucket->num--;
+	memmove (bucket->elem + at, bucket->elem + at + 1,
+	         (bucket->num - at) * sizeof (CK_OBJECT_HANDLE));
+
+	if (bucket->num == 0) {
+		free (bucket->elem);
+		bucket->elem = NULL;
+	}
+
+	return true;
 }
 
 static bool
@@ -235,21 +417,423 @@ bucket_push (index_bucket *bucket,
 	return true;
 }
 
+static void
+all_compact (p11_index *index)
+{
+	int in, out;
+
+	if (index->all_removed == 0)
+		return;
+
+	for (in = 0, out = 0; in < index->all.num; in++) {
+		if (p11_dict_get (index->objects, index->all.elem + in))
+			index->all.elem[out++] = index->all.elem[in];
+	}
+
+	index->all.num = out;
+	index->all_removed = 0;
+}
+
+/*
+ * Removing from the middle of all the handles would move the ones after
+ * it each time, so that's left for later. The handles that stay behind
+ * are skipped, since their objects are gone.
+ */
+static void
+all_remove (p11_index *index,
+            CK_OBJECT_HANDLE handle)
+{
+	if (index->all.num > 0 && index->all.elem[index->all.num - 1] == handle) {
+		index->all.num--;
+		return;
+	}
+
+	index->all_removed++;
+	if (index->all_removed > (unsigned int)index->all.num / 2)
+		all_compact (index);
+}
+
+static bool
+serial_contents (CK_ATTRIBUTE *attr,
+                 CK_ATTRIBUTE *contents)
+{
+	size_t length;
+
+	if (attr->type != CKA_SERIAL_NUMBER || attr->pValue == NULL ||
+	    attr->ulValueLen == (CK_ULONG)-1 ||
+	    !p11_x509_integer_value (attr->pValue, attr->ulValueLen,
+	                             (const unsigned char **)&contents->pValue, &length))
+		return false;
+
+	contents->type = attr->type;
+	contents->ulValueLen = length;
+	return true;
+}
+
+/*
+ * Serial numbers are DER encoded INTEGERs, but NSS also looks them up by
+ * their contents. Stored serial numbers are hashed by their contents, so
+ * that both kinds of lookups select the same buckets.
+ */
+static unsigned int
+index_attr_hash (CK_ATTRIBUTE *attr)
+{
+	CK_ATTRIBUTE contents;
+
+	if (serial_contents (attr, &contents))
+		return p11_attr_hash (&contents);
+
+	return p11_attr_hash (attr);
+}
+
+/*
+ * A serial number being looked up may be DER encoded, or be contents that
+ * happen to look like DER. Both are hashed, and both buckets selected.
+ * Returns the number of hashes.
+ */
+static int
+index_match_hashes (CK_ATTRIBUTE *match,
+                    unsigned int *hashes)
+{
+	CK_ATTRIBUTE contents;
+
+	hashes[0] = p11_attr_hash (match);
+	if (!serial_contents (match, &contents))
+		return 1;
+
+	hashes[1] = hashes[0];
+	hashes[0] = p11_attr_hash (&contents);
+	return 2;
+}
+
+/*
+ * The filter positions of a value are derived from its hash, stepping
+ * by the hash with its halves swapped.
+ */
+static unsigned int
+filter_probe (unsigned int hash,
+              int i)
+{
+	return hash + i * (((hash >> 16) | (hash << 16)) | 1);
+}
+
+static void
+filter_add (index_filter *filter,
+            unsigned int hash)
+{
+	unsigned int bit;
+	int i;
+
+	for (i = 0; i < FILTER_PROBES; i++) {
+		bit = filter_probe (hash, i) & filter->mask;
+		filter->bits[bit / 32] |= (uint32_t)1 << (bit % 32);
+	}
+}
+
+static bool
+filter_maybe (index_filter *filter,
+              unsigned int hash)
+{
+	unsigned int bit;
+	int i;
+
+	for (i = 0; i < FILTER_PROBES; i++) {
+		bit = filter_probe (hash, i) & filter->mask;
+		if (!(filter->bits[bit / 32] & ((uint32_t)1 << (bit % 32))))
+			return false;
+	}
+
+	return true;
+}
+
 static void
 index_hash (p11_index *index,
             index_object *obj)
+{
+	unsigned int hash;
+	CK_ULONG i;
+	int slot;
+
+	/* Sorted so that objects can be matched quickly */
+	obj->count = p11_attrs_count (obj->attrs);
+	p11_attrs_sort (obj->attrs, obj->count);
+	obj->bits = p11_attrs_bits (obj->attrs, obj->count);
+
+	for (i = 0; i < obj->count; i++) {
+		slot = indexed_slot (index, obj->attrs[i].type);
+		if (slot >= 0) {
+			hash = index_attr_hash (obj->attrs + i);
+			if (bucket_insert (index->buckets + (hash % index->num_buckets), obj->handle))
+				index->num_entries++;
+			if (index->filtered)
+				filter_add (index->filters + slot, hash);
+		}
+	}
+
+	index->filter_changes++;
+}
+
+static void
+index_unhash (p11_index *index,
+              index_object *obj)
 {
 	unsigned int hash;
 	int i;
 
+	if (obj->attrs == NULL)
+		return;
+
+	/* Values stay in the filters until they're built again */
+	index->filter_changes++;
+
 	for (i = 0; !p11_attrs_terminator (obj->attrs + i); i++) {
 		if (is_indexable (index, obj->attrs[i].type)) {
-			hash = p11_attr_hash (obj->attrs + i);
-			bucket_insert (index->buckets + (hash % NUM_BUCKETS), obj->handle);
+			hash = index_attr_hash (obj->attrs + i);
+			if (bucket_remove (index->buckets + (hash % index->num_buckets), obj->handle))
+				index->num_entries--;
+			if (index->rehash &&
+			    bucket_remove (index->rehash + (hash % index->num_rehash), obj->handle))
+				index->num_entries--;
 		}
 	}
 }
 
+static void
+rehash_bucket (p11_index *index,
+               unsigned int at)
+{
+	index_bucket *bucket;
+	index_object *obj;
+	unsigned int hash;
+	int i, j;
+
+	bucket = index->rehash + at;
+	index->num_entries -= bucket->num;
+
+	for (i = 0; i < bucket->num; i++) {
+		obj = p11_dict_get (index->objects, bucket->elem + i);
+		if (obj == NULL)
+			continue;
+
+		/* Only move the attributes that hashed to this old bucket */
+		for (j = 0; !p11_attrs_terminator (obj->attrs + j); j++) {
+			if (!is_indexable (index, obj->attrs[j].type))
+				continue;
+			hash = index_attr_hash (obj->attrs + j);
+			if (hash % index->num_rehash != at)
+				continue;
+			if (bucket_insert (index->buckets + (hash % index->num_buckets), obj->handle))
+				index->num_entries++;
+		}
+	}
+
+	free (bucket->elem);
+	bucket->elem = NULL;
+	bucket->num = 0;
+
+	/* Iterators may have selected only this bucket */
+	index->generation++;
+}
+
+static void
+index_rehash (p11_index *index,
+              unsigned int num_buckets)
+{
+	index_bucket *buckets;
+
+	assert (index->rehash == NULL);
+
+	/* Ignore failures, maybe we can resize later */
+	buckets = calloc (num_buckets, sizeof (index_bucket));
+	if (buckets == NULL)
+		return;
+
+	p11_debug ("rehashing index from %u to %u buckets with %u entries",
+	           index->num_buckets, num_buckets, index->num_entries);
+
+	index->rehash = index->buckets;
+	index->num_rehash = index->num_buckets;
+	index->rehash_at = 0;
+	index->buckets = buckets;
+	index->num_buckets = num_buckets;
+	index->generation++;
+}
+
+static void
+filter_rebuild (p11_index *index)
+{
+	unsigned int counts[MAX_INDEXED] = { 0, };
+	index_object *obj;
+	p11_dictiter iter;
+	unsigned int num;
+	int slot;
+	int i;
+
+	filter_clear (index);
+
+	p11_dict_iterate (index->objects, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&obj)) {
+		for (i = 0; !p11_attrs_terminator (obj->attrs + i); i++) {
+			slot = indexed_slot (index, obj->attrs[i].type);
+			if (slot >= 0)
+				counts[slot]++;
+		}
+	}
+
+	for (slot = 0; slot < index->num_indexed; slot++) {
+		num = alloc_size (counts[slot] * FILTER_BITS);
+		if (num < FILTER_MIN_BITS)
+			num = FILTER_MIN_BITS;
+
+		/* Ignore failures, lookups just aren't filtered */
+		index->filters[slot].bits = calloc (num / 32, sizeof (uint32_t));
+		if (index->filters[slot].bits == NULL) {
+			filter_clear (index);
+			return;
+		}
+		index->filters[slot].mask = num - 1;
+	}
+
+	p11_dict_iterate (index->objects, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&obj)) {
+		for (i = 0; !p11_attrs_terminator (obj->attrs + i); i++) {
+			slot = indexed_slot (index, obj->attrs[i].type);
+			if (slot >= 0)
+				filter_add (index->filters + slot, index_attr_hash (obj->attrs + i));
+		}
+	}
+
+	index->filtered = true;
+	index->filter_objects = p11_dict_size (index->objects);
+	index->filter_changes = 0;
+}
+
+/*
+ * Removed values stay in the filters, and added values make them less
+ * selective. Once as many objects have changed as there were when they
+ * were built, the filters are built again. This happens when a batch is
+ * finished, or after a change outside of a batch.
+ */
+static void
+filter_refresh (p11_index *index)
+{
+	if (!index->filtered || index->filter_changes > index->filter_objects)
+		filter_rebuild (index);
+}
+
+static void
+filter_count (p11_index *index,
+              int filtered,
+              bool matched)
+{
+	if (filtered == 0)
+		return;
+
+	/* Lookups run concurrently under the read lock */
+	p11_counter_inc (&index->filter_stats.lookups);
+	if (filtered < 0)
+		p11_counter_inc (&index->filter_stats.rejected);
+	else if (!matched)
+		p11_counter_inc (&index->filter_stats.false_positives);
+}
+
+void
+p11_index_get_filter_stats (p11_index *index,
+                            p11_index_filter_stats *stats)
+{
+	return_if_fail (index != NULL);
+	return_if_fail (stats != NULL);
+
+	stats->lookups = p11_counter_get (&index->filter_stats.lookups);
+	stats->rejected = p11_counter_get (&index->filter_stats.rejected);
+	stats->false_positives = p11_counter_get (&index->filter_stats.false_positives);
+}
+
+/*
+ * Called after each modification. Rather than rehashing the whole index
+ * at once, which would stall whoever happens to cross the threshold, the
+ * old buckets are moved over a few at a time. Lookups consult both tables
+ * until the move is complete.
+ */
+static void
+index_resize (p11_index *index)
+{
+	unsigned int steps;
+
+	if (index->rehash) {
+		for (steps = 0; steps < REHASH_STEPS &&
+		     index->rehash_at < index->num_rehash; index->rehash_at++) {
+			if (index->rehash[index->rehash_at].num) {
+				rehash_bucket (index, index->rehash_at);
+				steps++;
+			}
+		}
+
+		if (index->rehash_at >= index->num_rehash) {
+			free_buckets (index->rehash, index->num_rehash);
+			index->rehash = NULL;
+			index->num_rehash = 0;
+			index->rehash_at = 0;
+			index->generation++;
+		}
+
+	} else if (index->num_entries > index->num_buckets) {
+		index_rehash (index, index->num_buckets * 2 + 1);
+
+	} else if (index->num_buckets > MIN_BUCKETS &&
+	           index->num_entries < index->num_buckets / 8) {
+		index_rehash (index, index->num_buckets / 2);
+	}
+
+	if (!index->changes)
+		filter_refresh (index);
+}
+
+void
+p11_index_set_flush (p11_index *index,
+                     p11_index_flush_cb flush)
+{
+	return_if_fail (index != NULL);
+	index->flush = flush;
+}
+
+void
+p11_index_set_indexed (p11_index *index,
+                       const CK_ATTRIBUTE_TYPE *types,
+                       int count)
+{
+	index_object *obj;
+	p11_dictiter iter;
+
+	return_if_fail (index != NULL);
+	return_if_fail (types != NULL || count == 0);
+	return_if_fail (count >= 0 && count <= MAX_INDEXED);
+
+	if (count > 0)
+		memcpy (index->indexed, types, count * sizeof (CK_ATTRIBUTE_TYPE));
+	index->num_indexed = count;
+	filter_clear (index);
+
+	/* Throw away the current buckets and index everything again */
+	free_buckets (index->buckets, index->num_buckets);
+	free_buckets (index->rehash, index->num_rehash);
+	index->rehash = NULL;
+	index->num_rehash = 0;
+	index->rehash_at = 0;
+	index->num_entries = 0;
+	index->generation++;
+
+	index->num_buckets = MIN_BUCKETS;
+	index->buckets = calloc (index->num_buckets, sizeof (index_bucket));
+	return_if_fail (index->buckets != NULL);
+
+	p11_dict_iterate (index->objects, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&obj)) {
+		index_hash (index, obj);
+		index_resize (index);
+	}
+}
+
 static CK_RV
 index_build (p11_index *index,
              CK_ATTRIBUTE **attrs,
@@ -286,6 +870,17 @@ call_notify (p11_index *index,
 	index->notifying = false;
 }
 
+static void
+call_flush (p11_index *index)
+{
+	if (!index->flush || index->notifying)
+		return;
+
+	index->notifying = true;
+	index->flush (index->data, index);
+	index->notifying = false;
+}
+
 static void
 index_notify (p11_index *index,
               CK_OBJECT_HANDLE handle,
@@ -299,6 +894,7 @@ index_notify (p11_index *index,
 	} else if (!index->changes) {
 		call_notify (index, handle, removed);
 		p11_attrs_free (removed);
+		call_flush (index);
 
 	} else {
 		obj = calloc (1, sizeof (index_object));
@@ -311,6 +907,74 @@ index_notify (p11_index *index,
 	}
 }
 
+/*
+ * Before an object with borrowed or packed values is changed, or its
+ * attributes are handed to someone else, it gets its own copy of the
+ * values.
+ */
+static void
+index_unshare (index_object *obj)
+{
+	CK_ATTRIBUTE *attrs;
+
+	if (!obj->borrowed && !obj->packed)
+		return;
+
+	attrs = p11_attrs_dup (obj->attrs);
+	return_if_fail (attrs != NULL);
+
+	free_attrs (obj);
+	obj->attrs = attrs;
+}
+
+/*
+ * Objects loaded in a batch, such as those from the token files, stay
+ * in the index for a long time, so the attributes of each one are put
+ * in a single block of memory, with the values following the array.
+ * Objects added one at a time are left as they are. If that fails, the
+ * object is fine as it is.
+ */
+static void
+index_pack (p11_index *index,
+            index_object *obj)
+{
+	CK_ATTRIBUTE *packed;
+	unsigned char *value;
+	size_t length;
+	CK_ULONG i;
+
+	if (!index->changes || obj->borrowed || obj->packed)
+		return;
+
+	length = (obj->count + 1) * sizeof (CK_ATTRIBUTE);
+	for (i = 0; i < obj->count; i++) {
+		if (obj->attrs[i].pValue && obj->attrs[i].ulValueLen != (CK_ULONG)-1)
+			length += P11_ATTR_VALUE_ALIGN (obj->attrs[i].ulValueLen);
+	}
+
+	packed = malloc (length);
+	if (packed == NULL)
+		return;
+
+	value = (unsigned char *)(packed + obj->count + 1);
+	for (i = 0; i < obj->count; i++) {
+		memcpy (packed + i, obj->attrs + i, sizeof (CK_ATTRIBUTE));
+		if (obj->attrs[i].pValue && obj->attrs[i].ulValueLen != (CK_ULONG)-1) {
+			memcpy (value, obj->attrs[i].pValue, obj->attrs[i].ulValueLen);
+			packed[i].pValue = value;
+			value += P11_ATTR_VALUE_ALIGN (obj->attrs[i].ulValueLen);
+		}
+	}
+
+	packed[obj->count].type = CKA_INVALID;
+	packed[obj->count].pValue = NULL;
+	packed[obj->count].ulValueLen = 0;
+
+	p11_attrs_free (obj->attrs);
+	obj->attrs = packed;
+	obj->packed = true;
+}
+
 void
 p11_index_batch (p11_index *index)
 {
@@ -342,11 +1006,14 @@ p11_index_finish (p11_index *index)
 
 	p11_dict_iterate (changes, &iter);
 	while (p11_dict_next (&iter, NULL, (void **)&obj)) {
-		index_notify (index, obj->handle, obj->attrs);
-		obj->attrs = NULL;
+		if (index->notify && !index->notifying)
+			call_notify (index, obj->handle, obj->attrs);
 	}
 
 	p11_dict_free (changes);
+	all_compact (index);
+	filter_refresh (index);
+	call_flush (index);
 }
 
 bool
@@ -356,6 +1023,21 @@ p11_index_in_batch (p11_index *index)
 	return index->changes ? true : false;
 }
 
+static void
+index_insert (p11_index *index,
+              index_object *obj)
+{
+	obj->handle = p11_module_next_id ();
+	index->last_handle = obj->handle;
+
+	if (!p11_dict_set (index->objects, &obj->handle, obj))
+		return_if_reached ();
+
+	bucket_insert (&index->all, obj->handle);
+	index_hash (index, obj);
+	index_resize (index);
+}
+
 CK_RV
 p11_index_take (p11_index *index,
                 CK_ATTRIBUTE *attrs,
@@ -378,17 +1060,46 @@ p11_index_take (p11_index *index,
 	}
 
 	return_val_if_fail (obj->attrs != NULL, CKR_GENERAL_ERROR);
-	obj->handle = p11_module_next_id ();
+	index_insert (index, obj);
+	index_pack (index, obj);
 
-	if (!p11_dict_set (index->objects, &obj->handle, obj))
-		return_val_if_reached (CKR_HOST_MEMORY);
+	if (handle)
+		*handle = obj->handle;
 
-	index_hash (index, obj);
+	index_notify (index, obj->handle, NULL);
+	return CKR_OK;
+}
+
+CK_RV
+p11_index_load (p11_index *index,
+                CK_ATTRIBUTE *attrs,
+                CK_OBJECT_HANDLE *handle)
+{
+	index_object *obj;
+
+	return_val_if_fail (index != NULL, CKR_GENERAL_ERROR);
+	return_val_if_fail (attrs != NULL, CKR_GENERAL_ERROR);
+
+	/*
+	 * The object has already been built, so neither the build nor
+	 * the notify callbacks are called. This is used for objects
+	 * loaded from an image of a token.
+	 *
+	 * Only the array of attributes is owned by the index. The values
+	 * point into the image, which the caller keeps around until the
+	 * object is unloaded.
+	 */
+
+	obj = calloc (1, sizeof (index_object));
+	return_val_if_fail (obj != NULL, CKR_HOST_MEMORY);
+
+	obj->attrs = attrs;
+	obj->borrowed = true;
+	index_insert (index, obj);
 
 	if (handle)
 		*handle = obj->handle;
 
-	index_notify (index, obj->handle, NULL);
 	return CKR_OK;
 }
 
@@ -426,13 +1137,19 @@ p11_index_update (p11_index *index,
 		return CKR_OBJECT_HANDLE_INVALID;
 	}
 
+	index_unshare (obj);
+	index_unhash (index, obj);
+
 	rv = index_build (index, &obj->attrs, update);
 	if (rv != CKR_OK) {
+		index_hash (index, obj);
 		p11_attrs_free (update);
 		return rv;
 	}
 
 	index_hash (index, obj);
+	index_resize (index);
+	index_pack (index, obj);
 	index_notify (index, obj->handle, NULL);
 
 	return CKR_OK;
@@ -470,6 +1187,11 @@ p11_index_remove (p11_index *index,
 	if (!p11_dict_steal (index->objects, &handle, NULL, (void **)&obj))
 		return CKR_OBJECT_HANDLE_INVALID;
 
+	index_unshare (obj);
+	all_remove (index, handle);
+	index_unhash (index, obj);
+	index_resize (index);
+
 	/* This takes ownership of the attributes */
 	index_notify (index, handle, obj->attrs);
 	obj->attrs = NULL;
@@ -478,6 +1200,26 @@ p11_index_remove (p11_index *index,
 	return CKR_OK;
 }
 
+CK_RV
+p11_index_unload (p11_index *index,
+                  CK_OBJECT_HANDLE handle)
+{
+	index_object *obj;
+
+	return_val_if_fail (index != NULL, CKR_GENERAL_ERROR);
+
+	/* The counterpart of p11_index_load(), the notify callback isn't called */
+	if (!p11_dict_steal (index->objects, &handle, NULL, (void **)&obj))
+		return CKR_OBJECT_HANDLE_INVALID;
+
+	all_remove (index, handle);
+	index_unhash (index, obj);
+	index_resize (index);
+	free_object (obj);
+
+	return CKR_OK;
+}
+
 static CK_RV
 index_replacev (p11_index *index,
                 CK_OBJECT_HANDLE *handles,
@@ -498,7 +1240,7 @@ index_replacev (p11_index *index,
 			continue;
 
 		handled = false;
-		attr = p11_attrs_find (obj->attrs, key);
+		attr = p11_attrs_find_sorted (obj->attrs, obj->count, key);
 
 		/* The match doesn't have the key, so remove it */
 		if (attr != NULL) {
@@ -510,11 +1252,14 @@ index_replacev (p11_index *index,
 					rv = index_build (index, &attrs, replace[j]);
 					if (rv != CKR_OK)
 						return rv;
-					p11_attrs_free (obj->attrs);
+					index_unhash (index, obj);
+					free_attrs (obj);
 					obj->attrs = attrs;
 					replace[j] = NULL;
 					handled = true;
 					index_hash (index, obj);
+					index_resize (index);
+					index_pack (index, obj);
 					index_notify (index, obj->handle, NULL);
 					break;
 				}
@@ -580,6 +1325,10 @@ p11_index_replace_all (p11_index *index,
 	return rv;
 }
 
+/*
+ * The attributes of objects in the index are sorted by type, and can
+ * be used with p11_attrs_match_sorted().
+ */
 CK_ATTRIBUTE *
 p11_index_lookup (p11_index *index,
                   CK_OBJECT_HANDLE handle)
@@ -599,71 +1348,243 @@ typedef bool (* index_sink) (p11_index *index,
                              index_object *obj,
                              CK_ATTRIBUTE *match,
                              CK_ULONG count,
+                             uint64_t bits,
                              void *data);
 
+/*
+ * The buckets selected for a value: in the current table and the one not
+ * yet rehashed, for each of up to two hashes of the value.
+ */
+#define SELECTED_BUCKETS 4
+
+typedef struct {
+	/* The non-empty buckets, followed by NULL */
+	index_bucket *buckets[SELECTED_BUCKETS];
+
+	/* The most objects that can match, used to order the selection */
+	int num;
+} index_selected;
+
 static void
+selected_add (index_selected *selected,
+              index_bucket *bucket)
+{
+	int i;
+
+	if (!bucket->num)
+		return;
+
+	for (i = 0; i < SELECTED_BUCKETS && selected->buckets[i] != NULL; i++) {
+		if (selected->buckets[i] == bucket)
+			return;
+	}
+
+	return_if_fail (i < SELECTED_BUCKETS);
+	selected->buckets[i] = bucket;
+	selected->num += bucket->num;
+}
+
+static bool
+selected_contains (index_selected *selected,
+                   CK_OBJECT_HANDLE handle)
+{
+	int i;
+
+	for (i = 0; i < SELECTED_BUCKETS && selected->buckets[i] != NULL; i++) {
+		if (bucket_contains (selected->buckets[i], handle))
+			return true;
+	}
+
+	return false;
+}
+
+static bool
+index_select_bucket (p11_index *index,
+                     unsigned int *hashes,
+                     int num_hashes,
+                     index_selected *selected)
+{
+	int i;
+
+	memset (selected, 0, sizeof (index_selected));
+
+	for (i = 0; i < num_hashes; i++) {
+		selected_add (selected, index->buckets + (hashes[i] % index->num_buckets));
+
+		/* Entries not yet moved over while rehashing */
+		if (index->rehash)
+			selected_add (selected, index->rehash + (hashes[i] % index->num_rehash));
+	}
+
+	return selected->num > 0;
+}
+
+/*
+ * Look for the buckets of the indexed attributes in the template. Keep
+ * the smallest ones, ordered by size: we walk the smallest and check
+ * the others. Returns -1 if an empty bucket means nothing can match.
+ *
+ * Before the bucket of a value is looked at, its filter is checked. The
+ * filtered argument is set to -1 when the filters showed that nothing
+ * can match, and 1 when they let through a value that isn't there, or
+ * all the values of a template. Otherwise the filters didn't decide
+ * anything, and it's set to 0.
+ */
+static int
+index_select_buckets (p11_index *index,
+                      CK_ATTRIBUTE *match,
+                      CK_ULONG count,
+                      index_selected *selected,
+                      int *filtered)
+{
+	index_selected candidate;
+	unsigned int hashes[2];
+	int num_hashes;
+	bool maybe;
+	CK_ULONG n;
+	int slot;
+	int num;
+	int i;
+
+	*filtered = 0;
+
+	for (n = 0, num = 0; n < count; n++) {
+		slot = indexed_slot (index, match[n].type);
+		if (slot >= 0) {
+			num_hashes = index_match_hashes (match + n, hashes);
+
+			/* The filters rule out most values that aren't there at all */
+			if (index->filtered) {
+				for (i = 0, maybe = false; i < num_hashes && !maybe; i++)
+					maybe = filter_maybe (index->filters + slot, hashes[i]);
+				if (!maybe) {
+					*filtered = -1;
+					return -1;
+				}
+			}
+
+			/* If any index is empty, then obviously no match */
+			if (!index_select_bucket (index, hashes, num_hashes, &candidate)) {
+				*filtered = index->filtered ? 1 : 0;
+				return -1;
+			}
+
+			for (i = num; i > 0 && selected[i - 1].num > candidate.num; i--) {
+				if (i < MAX_SELECT)
+					selected[i] = selected[i - 1];
+			}
+
+			if (i < MAX_SELECT) {
+				selected[i] = candidate;
+				if (num < MAX_SELECT)
+					num++;
+			}
+		}
+	}
+
+	if (index->filtered && num > 0 && all_indexed (index, match, count))
+		*filtered = 1;
+
+	return num;
+}
+
+/*
+ * Returns what the filters said, so that the callers can count the
+ * lookups that the filters let through, but matched nothing.
+ */
+static int
 index_select (p11_index *index,
               CK_ATTRIBUTE *match,
               CK_ULONG count,
               index_sink sink,
               void *data)
 {
-	index_bucket *buckets[NUM_BUCKETS];
+	index_selected selected[MAX_SELECT];
+	index_bucket *bucket;
 	CK_OBJECT_HANDLE handle;
 	index_object *obj;
-	unsigned int hash;
 	p11_dictiter iter;
-	CK_ULONG n;
-	int num, at;
-	int i, j;
-
-	/* First look for any matching buckets */
-	for (n = 0, num = 0; n < count && num < MAX_SELECT; n++) {
-		if (is_indexable (index, match[n].type)) {
-			hash = p11_attr_hash (match + n);
-			buckets[num] = index->buckets + (hash % NUM_BUCKETS);
+	uint64_t bits;
+	int filtered;
+	int num;
+	int i, j, k;
 
-			/* If any index is empty, then obviously no match */
-			if (!buckets[num]->num)
-				return;
+	num = index_select_buckets (index, match, count, selected, &filtered);
+	if (num < 0)
+		return filtered;
 
-			num++;
-		}
-	}
+	bits = p11_attrs_bits (match, count);
 
 	/* Fall back on selecting all the items, if no index */
 	if (num == 0) {
 		p11_dict_iterate (index->objects, &iter);
 		while (p11_dict_next (&iter, NULL, (void *)&obj)) {
-			if (!sink (index, obj, match, count, data))
-				return;
+			if (!sink (index, obj, match, count, bits, data))
+				return filtered;
 		}
-		return;
+		return filtered;
 	}
 
-	for (i = 0; i < buckets[0]->num; i++) {
-		/* A candidate match from first bucket */
-		handle = buckets[0]->elem[i];
+	for (k = 0; k < SELECTED_BUCKETS && selected[0].buckets[k] != NULL; k++) {
+		bucket = selected[0].buckets[k];
 
-		/* Check if the candidate is in other buckets */
-		for (j = 1; j < num; j++) {
-			assert (buckets[j]->elem); /* checked above */
-			at = binary_search (buckets[j]->elem, 0, buckets[j]->num, handle);
-			if (at >= buckets[j]->num || buckets[j]->elem[at] != handle) {
-				handle = 0;
-				break;
+		for (i = 0; i < bucket->num; i++) {
+			/* A candidate match from the smallest bucket */
+			handle = bucket->elem[i];
+
+			/* Already seen in one of the previous buckets */
+			for (j = 0; j < k; j++) {
+				if (bucket_contains (selected[0].buckets[j], handle))
+					break;
+			}
+			if (j < k)
+				continue;
+
+			/* Check if the candidate is in other buckets */
+			for (j = 1; j < num; j++) {
+				if (!selected_contains (selected + j, handle)) {
+					handle = 0;
+					break;
+				}
 			}
-		}
 
-		/* Matched all the buckets, now actually match attrs */
-		if (handle != 0) {
-			obj = p11_dict_get (index->objects, &handle);
-			if (obj != NULL) {
-				if (!sink (index, obj, match, count, data))
-					return;
+			/* Matched all the buckets, now actually match attrs */
+			if (handle != 0) {
+				obj = p11_dict_get (index->objects, &handle);
+				if (obj != NULL) {
+					if (!sink (index, obj, match, count, bits, data))
+						return filtered;
+				}
 			}
 		}
 	}
+
+	return filtered;
+}
+
+/*
+ * The bits of the match are checked first, which rules out most objects
+ * that don't have all the attribute types without looking at them.
+ */
+static bool
+index_object_match (index_object *obj,
+                    CK_ATTRIBUTE *match,
+                    CK_ULONG count,
+                    uint64_t bits)
+{
+	CK_ATTRIBUTE *attr;
+	CK_ULONG i;
+
+	if ((obj->bits & bits) != bits)
+		return false;
+
+	for (i = 0; i < count; i++) {
+		attr = p11_attrs_find_sorted (obj->attrs, obj->count, match[i].type);
+		if (!attr || !p11_attr_equal (attr, match + i))
+			return false;
+	}
+
+	return true;
 }
 
 static bool
@@ -671,11 +1592,12 @@ sink_one_match (p11_index *index,
                 index_object *obj,
                 CK_ATTRIBUTE *match,
                 CK_ULONG count,
+                uint64_t bits,
                 void *data)
 {
 	CK_OBJECT_HANDLE *result = data;
 
-	if (p11_attrs_matchn (obj->attrs, match, count)) {
+	if (index_object_match (obj, match, count, bits)) {
 		*result = obj->handle;
 		return false;
 	}
@@ -689,13 +1611,15 @@ p11_index_find (p11_index *index,
                 int count)
 {
 	CK_OBJECT_HANDLE handle = 0UL;
+	int filtered;
 
 	return_val_if_fail (index != NULL, 0UL);
 
 	if (count < 0)
 		count = p11_attrs_count (match);
 
-	index_select (index, match, count, sink_one_match, &handle);
+	filtered = index_select (index, match, count, sink_one_match, &handle);
+	filter_count (index, filtered, handle != 0UL);
 	return handle;
 }
 
@@ -704,11 +1628,12 @@ sink_if_match (p11_index *index,
                index_object *obj,
                CK_ATTRIBUTE *match,
                CK_ULONG count,
+               uint64_t bits,
                void *data)
 {
 	index_bucket *handles = data;
 
-	if (p11_attrs_matchn (obj->attrs, match, count))
+	if (index_object_match (obj, match, count, bits))
 		bucket_push (handles, obj->handle);
 	return true;
 }
@@ -719,13 +1644,15 @@ p11_index_find_all (p11_index *index,
                     int count)
 {
 	index_bucket handles = { NULL, 0 };
+	int filtered;
 
 	return_val_if_fail (index != NULL, NULL);
 
 	if (count < 0)
 		count = p11_attrs_count (match);
 
-	index_select (index, match, count, sink_if_match, &handles);
+	filtered = index_select (index, match, count, sink_if_match, &handles);
+	filter_count (index, filtered, handles.num > 0);
 
 	/* Null terminate */
 	bucket_push (&handles, 0UL);
@@ -737,6 +1664,7 @@ sink_any (p11_index *index,
           index_object *obj,
           CK_ATTRIBUTE *match,
           CK_ULONG count,
+          uint64_t bits,
           void *data)
 {
 	index_bucket *handles = data;
@@ -754,7 +1682,7 @@ p11_index_snapshot (p11_index *index,
 
 	return_val_if_fail (index != NULL, NULL);
 
-	if (count < 0)
+	if (count == (CK_ULONG)-1)
 		count = p11_attrs_count (attrs);
 
 	index_select (index, attrs, count, sink_any, &handles);
@@ -765,3 +1693,162 @@ p11_index_snapshot (p11_index *index,
 	bucket_push (&handles, 0UL);
 	return handles.elem;
 }
+
+struct _p11_index_iter {
+	p11_index *index;
+	CK_ATTRIBUTE *match;
+	CK_ULONG count;
+
+	/* The buckets being walked, and when they were selected */
+	index_selected selected[MAX_SELECT];
+	int num_selected;
+	unsigned int generation;
+
+	/* The last handle returned, and the first one past the view */
+	CK_OBJECT_HANDLE last;
+	CK_OBJECT_HANDLE limit;
+	bool done;
+
+	/* What the filters said when first selecting, for the stats */
+	int filtered;
+	bool found;
+};
+
+p11_index_iter *
+p11_index_iter_new (p11_index *index,
+                    CK_ATTRIBUTE *match,
+                    CK_ULONG count)
+{
+	p11_index_iter *iter;
+
+	return_val_if_fail (index != NULL, NULL);
+
+	iter = calloc (1, sizeof (p11_index_iter));
+	return_val_if_fail (iter != NULL, NULL);
+
+	iter->index = index;
+	iter->match = p11_attrs_buildn (NULL, match, count);
+	if (iter->match == NULL) {
+		free (iter);
+		return_val_if_reached (NULL);
+	}
+	iter->count = p11_attrs_count (iter->match);
+
+	/* Objects added after this point are not part of the view */
+	iter->limit = index->last_handle + 1;
+	iter->num_selected = -1;
+
+	return iter;
+}
+
+static bool
+iter_select (p11_index_iter *iter)
+{
+	p11_index *index = iter->index;
+	int filtered;
+	int num;
+
+	num = index_select_buckets (index, iter->match, iter->count,
+	                            iter->selected, &filtered);
+	if (iter->num_selected < 0)
+		iter->filtered = filtered;
+	iter->num_selected = num;
+	iter->generation = index->generation;
+
+	if (iter->num_selected < 0)
+		return false;
+
+	/* Walk all the objects, if no index */
+	if (iter->num_selected == 0) {
+		memset (iter->selected, 0, sizeof (index_selected));
+		iter->selected[0].buckets[0] = &index->all;
+		iter->selected[0].num = index->all.num;
+		iter->num_selected = 1;
+	}
+
+	return true;
+}
+
+static CK_OBJECT_HANDLE
+iter_done (p11_index_iter *iter)
+{
+	iter->done = true;
+	filter_count (iter->index, iter->filtered, iter->found);
+	return 0;
+}
+
+static CK_OBJECT_HANDLE
+bucket_next (index_bucket *bucket,
+             CK_OBJECT_HANDLE after)
+{
+	int at;
+
+	if (bucket == NULL || !bucket->num)
+		return 0;
+
+	at = binary_search (bucket->elem, 0, bucket->num, after + 1);
+	return at < bucket->num ? bucket->elem[at] : 0;
+}
+
+/*
+ * Handles are returned in ascending order, so that we can pick up where
+ * we left off even if the index changed in between. Objects are only
+ * candidates, and should be matched by the caller.
+ */
+CK_OBJECT_HANDLE
+p11_index_iter_next (p11_index_iter *iter)
+{
+	index_selected *selected;
+	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_HANDLE other;
+	int j;
+
+	return_val_if_fail (iter != NULL, 0);
+
+	if (iter->done)
+		return 0;
+
+	/* The buckets were replaced or moved while rehashing */
+	if (iter->num_selected < 0 || iter->generation != iter->index->generation) {
+		if (!iter_select (iter))
+			return iter_done (iter);
+	}
+
+	selected = iter->selected;
+
+	for (;;) {
+		/* The next candidate from the smallest selection */
+		handle = 0;
+		for (j = 0; j < SELECTED_BUCKETS && selected[0].buckets[j] != NULL; j++) {
+			other = bucket_next (selected[0].buckets[j], iter->last);
+			if (handle == 0 || (other != 0 && other < handle))
+				handle = other;
+		}
+
+		if (handle == 0 || handle >= iter->limit)
+			return iter_done (iter);
+
+		iter->last = handle;
+
+		/* Check if the candidate is in other buckets */
+		for (j = 1; j < iter->num_selected; j++) {
+			if (!selected_contains (selected + j, handle))
+				break;
+		}
+
+		if (j == iter->num_selected && p11_dict_get (iter->index->objects, &handle)) {
+			iter->found = true;
+			return handle;
+		}
+	}
+}
+
+void
+p11_index_iter_free (p11_index_iter *iter)
+{
+	if (iter == NULL)
+		return;
+
+	p11_attrs_free (iter->match);
+	free (iter);
+}
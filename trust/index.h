@@ -48,8 +48,29 @@
  */
 #define CKA_X_GENERATED (CKA_X_VENDOR + 8000)
 
+/*
+ * The path of the file that an object was loaded from. When that file
+ * changes or goes away, the objects with this origin are replaced.
+ */
+#define CKA_X_ORIGIN (CKA_X_VENDOR + 8001)
+
 typedef struct _p11_index p11_index;
 
+typedef struct _p11_index_iter p11_index_iter;
+
+/*
+ * Lookups decided by the Bloom filters of the index: the ones they
+ * showed can't match anything, and the ones they let through that found
+ * nothing. Only lookups for indexed attributes are counted. The false
+ * positive rate of the filters is false_positives / (rejected +
+ * false_positives). Lookups running concurrently count them atomically.
+ */
+typedef struct {
+	unsigned long lookups;
+	unsigned long rejected;
+	unsigned long false_positives;
+} p11_index_filter_stats;
+
 typedef CK_RV   (* p11_index_build_cb)   (void *data,
                                           p11_index *index,
                                           CK_ATTRIBUTE **attrs,
@@ -60,14 +81,24 @@ typedef void    (* p11_index_notify_cb)  (void *data,
                                           CK_OBJECT_HANDLE handle,
                                           CK_ATTRIBUTE *attrs);
 
+typedef void    (* p11_index_flush_cb)   (void *data,
+                                          p11_index *index);
+
 p11_index *        p11_index_new         (p11_index_build_cb build,
                                           p11_index_notify_cb notify,
                                           void *data);
 
+void               p11_index_set_flush   (p11_index *index,
+                                          p11_index_flush_cb flush);
+
 void               p11_index_free        (p11_index *index);
 
 int                p11_index_size        (p11_index *index);
 
+void               p11_index_set_indexed (p11_index *index,
+                                          const CK_ATTRIBUTE_TYPE *types,
+                                          int count);
+
 void               p11_index_batch       (p11_index *index);
 
 void               p11_index_finish      (p11_index *index);
@@ -78,6 +109,10 @@ CK_RV              p11_index_take        (p11_index *index,
                                           CK_ATTRIBUTE *attrs,
                                           CK_OBJECT_HANDLE *handle);
 
+CK_RV              p11_index_load        (p11_index *index,
+                                          CK_ATTRIBUTE *attrs,
+                                          CK_OBJECT_HANDLE *handle);
+
 CK_RV              p11_index_add         (p11_index *index,
                                           CK_ATTRIBUTE *attrs,
                                           CK_ULONG count,
@@ -104,6 +139,9 @@ CK_RV              p11_index_replace_all (p11_index *index,
 CK_RV              p11_index_remove      (p11_index *index,
                                           CK_OBJECT_HANDLE handle);
 
+CK_RV              p11_index_unload      (p11_index *index,
+                                          CK_OBJECT_HANDLE handle);
+
 CK_ATTRIBUTE *     p11_index_lookup      (p11_index *index,
                                           CK_OBJECT_HANDLE handle);
 
@@ -120,4 +158,15 @@ CK_OBJECT_HANDLE * p11_index_snapshot    (p11_index *index,
                                           CK_ATTRIBUTE *attrs,
                                           CK_ULONG count);
 
+p11_index_iter *   p11_index_iter_new    (p11_index *index,
+                                          CK_ATTRIBUTE *match,
+                                          CK_ULONG count);
+
+CK_OBJECT_HANDLE   p11_index_iter_next   (p11_index_iter *iter);
+
+void               p11_index_iter_free   (p11_index_iter *iter);
+
+void               p11_index_get_filter_stats (p11_index *index,
+                                               p11_index_filter_stats *stats);
+
 #endif /* P11_INDEX_H_ */
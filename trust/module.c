@@ -51,6 +51,7 @@
 #include "pkcs11x.h"
 #include "session.h"
 #include "token.h"
+#include "x509.h"
 
 #include <assert.h>
 #include <ctype.h>
@@ -65,17 +66,26 @@
 /* Initial slot id: non-zero and non-one */
 #define BASE_SLOT_ID   18UL
 
+/*
+ * The module state is protected by the library reader/writer lock.
+ * Functions that only look things up take it for reading, so that
+ * many threads can do so at once. State belonging to a single session,
+ * such as its find operation, is not protected against concurrent use
+ * of that same session, which PKCS#11 leaves up to the caller.
+ */
 static struct _Shared {
 	p11_dict *sessions;
 	p11_array *tokens;
 	char *paths;
+	char *cache;
 } gl = { NULL, NULL };
 
 /* Used during FindObjects */
 typedef struct _FindObjects {
 	CK_ATTRIBUTE *match;
-	CK_OBJECT_HANDLE *snapshot;
-	CK_ULONG iterator;
+	p11_index_iter *iters[2];
+	int current;
+	CK_OBJECT_HANDLE pending;
 } FindObjects;
 
 static CK_FUNCTION_LIST sys_function_list;
@@ -85,7 +95,8 @@ find_objects_free (void *data)
 {
 	FindObjects *find = data;
 	p11_attrs_free (find->match);
-	free (find->snapshot);
+	p11_index_iter_free (find->iters[0]);
+	p11_index_iter_free (find->iters[1]);
 	free (find);
 }
 
@@ -116,11 +127,13 @@ lookup_object_inlock (p11_session *session,
 
 	assert (session != NULL);
 
-	attrs = p11_index_lookup (session->index, handle);
-	if (attrs) {
-		if (index)
-			*index = session->index;
-		return attrs;
+	if (session->index) {
+		attrs = p11_index_lookup (session->index, handle);
+		if (attrs) {
+			if (index)
+				*index = session->index;
+			return attrs;
+		}
 	}
 
 	attrs = p11_index_lookup (p11_token_index (session->token), handle);
@@ -159,9 +172,9 @@ check_slot (CK_SLOT_ID id)
 {
 	bool ret;
 
-	p11_lock ();
+	p11_lock_read ();
 	ret = lookup_slot_inlock (id, NULL) == CKR_OK;
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	return ret;
 }
@@ -236,6 +249,9 @@ create_tokens_inlock (p11_array *tokens,
 			token = p11_token_new (slot, path, label);
 			return_val_if_fail (token != NULL, false);
 
+			if (gl.cache)
+				p11_token_set_cache (token, gl.cache);
+
 			if (!p11_array_push (tokens, token))
 				return_val_if_reached (false);
 
@@ -264,6 +280,10 @@ parse_argument (char *arg,
 		free (gl.paths);
 		gl.paths = value ? strdup (value) : NULL;
 
+	} else if (strcmp (arg, "cache") == 0) {
+		free (gl.cache);
+		gl.cache = value ? strdup (value) : NULL;
+
 	} else {
 		p11_message ("unrecognized module argument: %s", arg);
 	}
@@ -282,7 +302,7 @@ sys_C_Finalize (CK_VOID_PTR reserved)
 		rv = CKR_ARGUMENTS_BAD;
 
 	} else {
-		p11_lock ();
+		p11_lock_write ();
 
 			if (!gl.sessions) {
 				rv = CKR_CRYPTOKI_NOT_INITIALIZED;
@@ -291,6 +311,9 @@ sys_C_Finalize (CK_VOID_PTR reserved)
 				free (gl.paths);
 				gl.paths = NULL;
 
+				free (gl.cache);
+				gl.cache = NULL;
+
 				p11_dict_free (gl.sessions);
 				gl.sessions = NULL;
 
@@ -300,7 +323,7 @@ sys_C_Finalize (CK_VOID_PTR reserved)
 				rv = CKR_OK;
 			}
 
-		p11_unlock ();
+		p11_unlock_rw ();
 	}
 
 	p11_debug ("out: 0x%lx", rv);
@@ -320,7 +343,7 @@ sys_C_Initialize (CK_VOID_PTR init_args)
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = CKR_OK;
 
@@ -368,7 +391,7 @@ sys_C_Initialize (CK_VOID_PTR init_args)
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	if (rv != CKR_OK)
 		sys_C_Finalize (NULL);
@@ -388,12 +411,12 @@ sys_C_GetInfo (CK_INFO_PTR info)
 
 	return_val_if_fail (info != NULL, CKR_ARGUMENTS_BAD);
 
-	p11_lock ();
+	p11_lock_read ();
 
 		if (!gl.sessions)
 			rv = CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	if (rv == CKR_OK) {
 		memset (info, 0, sizeof (*info));
@@ -433,12 +456,12 @@ sys_C_GetSlotList (CK_BBOOL token_present,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		if (!gl.sessions)
 			rv = CKR_CRYPTOKI_NOT_INITIALIZED;
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	if (rv != CKR_OK) {
 		/* already failed */
@@ -475,7 +498,7 @@ sys_C_GetSlotInfo (CK_SLOT_ID id,
 	return_val_if_fail (info != NULL, CKR_ARGUMENTS_BAD);
 
 	p11_debug ("in");
-	p11_lock ();
+	p11_lock_read ();
 
 	rv = lookup_slot_inlock (id, &token);
 	if (rv == CKR_OK) {
@@ -496,7 +519,7 @@ sys_C_GetSlotInfo (CK_SLOT_ID id,
 		memcpy (info->slotDescription, path, length);
 	}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 	p11_debug ("out: 0x%lx", rv);
 
 	return rv;
@@ -515,7 +538,7 @@ sys_C_GetTokenInfo (CK_SLOT_ID id,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 	rv = lookup_slot_inlock (id, &token);
 	if (rv == CKR_OK) {
@@ -548,7 +571,7 @@ sys_C_GetTokenInfo (CK_SLOT_ID id,
 		memcpy (info->label, label, length);
 	}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 	p11_debug ("out: 0x%lx", rv);
 
 	return rv;
@@ -616,7 +639,7 @@ sys_C_OpenSession (CK_SLOT_ID id,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_slot_inlock (id, &token);
 		if (rv != CKR_OK) {
@@ -640,7 +663,7 @@ sys_C_OpenSession (CK_SLOT_ID id,
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -654,7 +677,7 @@ sys_C_CloseSession (CK_SESSION_HANDLE handle)
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		if (!gl.sessions) {
 			rv = CKR_CRYPTOKI_NOT_INITIALIZED;
@@ -666,7 +689,7 @@ sys_C_CloseSession (CK_SESSION_HANDLE handle)
 			rv = CKR_SESSION_HANDLE_INVALID;
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -684,7 +707,7 @@ sys_C_CloseAllSessions (CK_SLOT_ID id)
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_slot_inlock (id, &token);
 		if (rv == CKR_OK) {
@@ -695,7 +718,7 @@ sys_C_CloseAllSessions (CK_SLOT_ID id)
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -725,7 +748,7 @@ sys_C_GetSessionInfo (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -736,7 +759,7 @@ sys_C_GetSessionInfo (CK_SESSION_HANDLE handle,
 		}
 
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -791,13 +814,13 @@ sys_C_Login (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, NULL);
 		if (rv == CKR_OK)
 			rv = CKR_USER_TYPE_INVALID;
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -811,13 +834,13 @@ sys_C_Logout (CK_SESSION_HANDLE handle)
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, NULL);
 		if (rv == CKR_OK)
 			rv = CKR_USER_NOT_LOGGED_IN;
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -831,6 +854,7 @@ sys_C_CreateObject (CK_SESSION_HANDLE handle,
                     CK_OBJECT_HANDLE_PTR new_object)
 {
 	p11_session *session;
+	p11_index *index;
 	CK_BBOOL token;
 	CK_RV rv;
 
@@ -838,7 +862,7 @@ sys_C_CreateObject (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -846,10 +870,16 @@ sys_C_CreateObject (CK_SESSION_HANDLE handle,
 				rv = CKR_TOKEN_WRITE_PROTECTED;
 		}
 
+		if (rv == CKR_OK) {
+			index = p11_session_index (session);
+			if (index == NULL)
+				rv = CKR_HOST_MEMORY;
+		}
+
 		if (rv == CKR_OK)
-			rv = p11_index_add (session->index, template, count, new_object);
+			rv = p11_index_add (index, template, count, new_object);
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -866,6 +896,7 @@ sys_C_CopyObject (CK_SESSION_HANDLE handle,
 	CK_BBOOL vfalse = CK_FALSE;
 	CK_ATTRIBUTE token = { CKA_TOKEN, &vfalse, sizeof (vfalse) };
 	p11_session *session;
+	p11_index *index;
 	CK_ATTRIBUTE *original;
 	CK_ATTRIBUTE *attrs;
 	CK_BBOOL val;
@@ -875,7 +906,7 @@ sys_C_CopyObject (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -889,14 +920,20 @@ sys_C_CopyObject (CK_SESSION_HANDLE handle,
 				rv = CKR_TOKEN_WRITE_PROTECTED;
 		}
 
+		if (rv == CKR_OK) {
+			index = p11_session_index (session);
+			if (index == NULL)
+				rv = CKR_HOST_MEMORY;
+		}
+
 		if (rv == CKR_OK) {
 			attrs = p11_attrs_dup (original);
 			attrs = p11_attrs_buildn (attrs, template, count);
 			attrs = p11_attrs_build (attrs, &token, NULL);
-			rv = p11_index_take (session->index, attrs, new_object);
+			rv = p11_index_take (index, attrs, new_object);
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -912,18 +949,20 @@ sys_C_DestroyObject (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
-			rv = p11_index_remove (session->index, object);
+			rv = CKR_OBJECT_HANDLE_INVALID;
+			if (session->index)
+				rv = p11_index_remove (session->index, object);
 			if (rv == CKR_OBJECT_HANDLE_INVALID) {
 				if (p11_index_lookup (p11_token_index (session->token), object))
 					rv = CKR_TOKEN_WRITE_PROTECTED;
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -942,7 +981,7 @@ sys_C_GetObjectSize (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -954,7 +993,7 @@ sys_C_GetObjectSize (CK_SESSION_HANDLE handle,
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -977,7 +1016,7 @@ sys_C_GetAttributeValue (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in: %lu, %lu", handle, object);
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -1002,7 +1041,8 @@ sys_C_GetAttributeValue (CK_SESSION_HANDLE handle,
 				}
 
 				if (result->ulValueLen >= attr->ulValueLen) {
-					memcpy (result->pValue, attr->pValue, attr->ulValueLen);
+					if (attr->ulValueLen)
+						memcpy (result->pValue, attr->pValue, attr->ulValueLen);
 					result->ulValueLen = attr->ulValueLen;
 					continue;
 				}
@@ -1012,7 +1052,7 @@ sys_C_GetAttributeValue (CK_SESSION_HANDLE handle,
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	if (p11_debugging) {
 		string = p11_attrs_to_string (template, count);
@@ -1034,24 +1074,58 @@ sys_C_SetAttributeValue (CK_SESSION_HANDLE handle,
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_write ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
-			rv = p11_index_set (session->index, object, template, count);
+			rv = CKR_OBJECT_HANDLE_INVALID;
+			if (session->index)
+				rv = p11_index_set (session->index, object, template, count);
 			if (rv == CKR_OBJECT_HANDLE_INVALID) {
 				if (p11_index_lookup (p11_token_index (session->token), object))
 					rv = CKR_TOKEN_WRITE_PROTECTED;
 			}
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
 	return rv;
 }
 
+static bool
+find_wants_generated (CK_ATTRIBUTE *template,
+                      CK_ULONG count)
+{
+	CK_OBJECT_CLASS klass;
+
+	if (!p11_attrs_findn_ulong (template, count, CKA_CLASS, &klass))
+		return true;
+
+	return klass == CKO_NSS_TRUST || klass == CKO_X_TRUST_ASSERTION;
+}
+
+/*
+ * Looking for a distrusted certificate by its value, or by its issuer
+ * and serial number, is answered from the blacklist of the token.
+ */
+static bool
+find_wants_distrusted (CK_ATTRIBUTE *match)
+{
+	CK_OBJECT_CLASS klass;
+	CK_BBOOL distrusted;
+
+	if (!p11_attrs_find_ulong (match, CKA_CLASS, &klass) || klass != CKO_CERTIFICATE)
+		return false;
+	if (!p11_attrs_find_bool (match, CKA_X_DISTRUSTED, &distrusted) || !distrusted)
+		return false;
+
+	return p11_attrs_find_valid (match, CKA_VALUE) ||
+	       (p11_attrs_find_valid (match, CKA_ISSUER) &&
+	        p11_attrs_find_valid (match, CKA_SERIAL_NUMBER));
+}
+
 static CK_RV
 sys_C_FindObjectsInit (CK_SESSION_HANDLE handle,
                        CK_ATTRIBUTE_PTR template,
@@ -1061,11 +1135,14 @@ sys_C_FindObjectsInit (CK_SESSION_HANDLE handle,
 	CK_BBOOL want_token_objects;
 	CK_BBOOL want_session_objects;
 	CK_BBOOL token;
+	bool generate;
+	bool load;
 	FindObjects *find;
 	p11_session *session;
 	char *string;
 	CK_RV rv;
 	int n = 0;
+	int i;
 
 	if (p11_debugging) {
 		string = p11_attrs_to_string (template, count);
@@ -1073,29 +1150,52 @@ sys_C_FindObjectsInit (CK_SESSION_HANDLE handle,
 		free (string);
 	}
 
-	p11_lock ();
+	/* Are we searching for token objects? */
+	if (p11_attrs_findn_bool (template, count, CKA_TOKEN, &token)) {
+		want_token_objects = token;
+		want_session_objects = !token;
+	} else {
+		want_token_objects = CK_TRUE;
+		want_session_objects = CK_TRUE;
+	}
 
-		/* Are we searching for token objects? */
-		if (p11_attrs_findn_bool (template, count, CKA_TOKEN, &token)) {
-			want_token_objects = token;
-			want_session_objects = !token;
-		} else {
-			want_token_objects = CK_TRUE;
-			want_session_objects = CK_TRUE;
-		}
+	/* Generated trust objects are built the first time they're looked for */
+	generate = want_token_objects && find_wants_generated (template, count);
+
+	p11_lock_read ();
+
+		rv = lookup_session (handle, &session);
+		load = (rv == CKR_OK && want_token_objects &&
+		        (p11_token_changed (session->token) ||
+		         (generate && p11_token_generate_needed (session->token))));
+
+	p11_unlock_rw ();
+
+	/*
+	 * Load from disk if the token hasn't been loaded yet, or if it has
+	 * noticed that its files changed. This only parses the changed files.
+	 */
+	if (load) {
+		p11_lock_write ();
+
+			rv = lookup_session (handle, &session);
+			if (rv == CKR_OK && p11_token_changed (session->token))
+				p11_token_load (session->token);
+			if (rv == CKR_OK && generate)
+				p11_token_generate (session->token);
+
+		p11_unlock_rw ();
+	}
+
+	p11_lock_read ();
 
 		rv = lookup_session (handle, &session);
 
-		/* Refresh from disk if this session hasn't yet */
 		if (rv == CKR_OK) {
-			if (want_session_objects)
+			if (want_session_objects && session->index)
 				indices[n++] = session->index;
-			if (want_token_objects) {
-				if (!session->loaded)
-					p11_token_load (session->token);
-				session->loaded = CK_TRUE;
+			if (want_token_objects)
 				indices[n++] = p11_token_index (session->token);
-			}
 
 			find = calloc (1, sizeof (FindObjects));
 			warn_if_fail (find != NULL);
@@ -1105,19 +1205,36 @@ sys_C_FindObjectsInit (CK_SESSION_HANDLE handle,
 				find->match = p11_attrs_buildn (NULL, template, count);
 				warn_if_fail (find->match != NULL);
 
-				/* Build a session snapshot of all objects */
-				find->iterator = 0;
-				find->snapshot = p11_index_snapshot (indices[0], indices[1], template, count);
-				warn_if_fail (find->snapshot != NULL);
+				/* Matched against the sorted attributes of the index */
+				if (find->match)
+					p11_attrs_sort (find->match, p11_attrs_count (find->match));
+
+				/* Not on the blacklist, so no token object can match */
+				if (want_token_objects && find->match &&
+				    find_wants_distrusted (find->match) &&
+				    !p11_token_is_distrusted (session->token, find->match))
+					n--;
+
+				/* Objects are matched as they are iterated */
+				for (i = 0; i < n; i++) {
+					find->iters[i] = find->match ? p11_index_iter_new (indices[i], find->match,
+					                                                   p11_attrs_count (find->match)) : NULL;
+					warn_if_fail (find->iters[i] != NULL);
+					if (!find->iters[i])
+						rv = CKR_HOST_MEMORY;
+				}
 			}
 
-			if (!find || !find->snapshot || !find->match)
+			if (!find || !find->match)
 				rv = CKR_HOST_MEMORY;
-			else
+
+			if (rv == CKR_OK)
 				p11_session_set_operation (session, find_objects_free, find);
+			else if (find)
+				find_objects_free (find);
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -1128,38 +1245,30 @@ static bool
 match_for_broken_nss_serial_number_lookups (CK_ATTRIBUTE *attr,
                                             CK_ATTRIBUTE *match)
 {
-	unsigned char der[32];
-	unsigned char *val_val;
-	size_t der_len;
-	size_t val_len;
-	int len_len;
+	const unsigned char *value;
+	size_t length;
 
 	if (!match->pValue || !match->ulValueLen ||
 	    match->ulValueLen == CKA_INVALID ||
 	    attr->ulValueLen == CKA_INVALID)
 		return false;
 
-	der_len = sizeof (der);
-	der[0] = ASN1_TAG_INTEGER | ASN1_CLASS_UNIVERSAL;
-	len_len = der_len - 1;
-	asn1_length_der (match->ulValueLen, der + 1, &len_len);
-	assert (len_len < (der_len - 1));
-	der_len = 1 + len_len;
-
-	val_val = attr->pValue;
-	val_len = attr->ulValueLen;
-
-	if (der_len + match->ulValueLen != val_len)
+	/* The index hashes serial numbers by their contents, compare the same */
+	if (!p11_x509_integer_value (attr->pValue, attr->ulValueLen, &value, &length))
 		return false;
 
-	if (memcmp (der, val_val, der_len) != 0 ||
-	    memcmp (match->pValue, val_val + der_len, match->ulValueLen) != 0)
+	if (length != match->ulValueLen ||
+	    memcmp (match->pValue, value, length) != 0)
 		return false;
 
 	p11_debug ("worked around serial number lookup that's not DER encoded");
 	return true;
 }
 
+/*
+ * Both the attributes and the match are sorted by type, so they are
+ * walked together, see p11_attrs_match_sorted().
+ */
 static bool
 find_objects_match (CK_ATTRIBUTE *attrs,
                     CK_ATTRIBUTE *match)
@@ -1167,9 +1276,10 @@ find_objects_match (CK_ATTRIBUTE *attrs,
 	CK_OBJECT_CLASS klass;
 	CK_ATTRIBUTE *attr;
 
-	for (; !p11_attrs_terminator (match); match++) {
-		attr = p11_attrs_find ((CK_ATTRIBUTE *)attrs, match->type);
-		if (!attr)
+	for (attr = attrs; !p11_attrs_terminator (match); match++) {
+		while (attr->type < match->type)
+			attr++;
+		if (attr->type != match->type)
 			return false;
 		if (p11_attr_equal (attr, match))
 			continue;
@@ -1196,6 +1306,60 @@ find_objects_match (CK_ATTRIBUTE *attrs,
 	return true;
 }
 
+static CK_OBJECT_HANDLE
+find_objects_next_inlock (p11_session *session,
+                          FindObjects *find,
+                          CK_ATTRIBUTE **attrs)
+{
+	CK_OBJECT_HANDLE object;
+
+	/* Matched by an earlier call that had no room for it */
+	if (find->pending) {
+		object = find->pending;
+		find->pending = 0;
+		*attrs = lookup_object_inlock (session, object, NULL);
+		if (*attrs != NULL)
+			return object;
+	}
+
+	while (find->current < 2) {
+		if (find->iters[find->current])
+			object = p11_index_iter_next (find->iters[find->current]);
+		else
+			object = 0;
+		if (!object) {
+			find->current++;
+			continue;
+		}
+
+		*attrs = lookup_object_inlock (session, object, NULL);
+		if (*attrs == NULL)
+			continue;
+
+		if (find_objects_match (*attrs, find->match))
+			return object;
+	}
+
+	return 0;
+}
+
+static CK_RV
+lookup_find_inlock (CK_SESSION_HANDLE handle,
+                    p11_session **session,
+                    FindObjects **find)
+{
+	CK_RV rv;
+
+	rv = lookup_session (handle, session);
+	if (rv == CKR_OK) {
+		if ((*session)->cleanup != find_objects_free)
+			rv = CKR_OPERATION_NOT_INITIALIZED;
+		*find = (*session)->operation;
+	}
+
+	return rv;
+}
+
 static CK_RV
 sys_C_FindObjects (CK_SESSION_HANDLE handle,
                    CK_OBJECT_HANDLE_PTR objects,
@@ -1207,45 +1371,124 @@ sys_C_FindObjects (CK_SESSION_HANDLE handle,
 	FindObjects *find = NULL;
 	p11_session *session;
 	CK_ULONG matched;
-	p11_index *index;
 	CK_RV rv;
 
 	return_val_if_fail (count != NULL, CKR_ARGUMENTS_BAD);
 
 	p11_debug ("in: %lu, %lu", handle, max_count);
 
-	p11_lock ();
+	p11_lock_read ();
 
-		rv = lookup_session (handle, &session);
+		rv = lookup_find_inlock (handle, &session, &find);
 		if (rv == CKR_OK) {
-			if (session->cleanup != find_objects_free)
-				rv = CKR_OPERATION_NOT_INITIALIZED;
-			find = session->operation;
+			matched = 0;
+			while (matched < max_count) {
+				object = find_objects_next_inlock (session, find, &attrs);
+				if (!object)
+					break;
+				objects[matched++] = object;
+			}
+
+			*count = matched;
 		}
 
+	p11_unlock_rw ();
+
+	p11_debug ("out: 0x%lx, %lu", handle, *count);
+
+	return rv;
+}
+
+static CK_RV
+sys_C_X_FindObjectsAttributes (CK_FUNCTION_LIST_PTR module,
+                               CK_SESSION_HANDLE handle,
+                               CK_OBJECT_HANDLE_PTR objects,
+                               CK_ULONG max_count,
+                               CK_ULONG_PTR count,
+                               CK_ATTRIBUTE_PTR template,
+                               CK_ULONG template_count,
+                               CK_BYTE_PTR buffer,
+                               CK_ULONG_PTR buffer_len)
+{
+	CK_OBJECT_HANDLE object;
+	CK_ATTRIBUTE *attrs;
+	CK_ATTRIBUTE *result;
+	CK_ATTRIBUTE *attr;
+	FindObjects *find = NULL;
+	p11_session *session;
+	CK_ULONG matched;
+	CK_ULONG needed;
+	CK_ULONG used;
+	bool missing;
+	CK_ULONG i;
+	CK_RV rv;
+
+	return_val_if_fail (count != NULL, CKR_ARGUMENTS_BAD);
+	return_val_if_fail (buffer_len != NULL, CKR_ARGUMENTS_BAD);
+	return_val_if_fail (template != NULL || template_count == 0, CKR_ARGUMENTS_BAD);
+
+	p11_debug ("in: %lu, %lu, %lu", handle, max_count, *buffer_len);
+
+	p11_lock_read ();
+
+		rv = lookup_find_inlock (handle, &session, &find);
 		if (rv == CKR_OK) {
 			matched = 0;
+			used = 0;
+			missing = false;
+
 			while (matched < max_count) {
-				object = find->snapshot[find->iterator];
+				object = find_objects_next_inlock (session, find, &attrs);
 				if (!object)
 					break;
 
-				find->iterator++;
+				result = template + (matched * template_count);
+				for (i = 0, needed = 0; i < template_count; i++) {
+					attr = p11_attrs_find (attrs, result[i].type);
+					if (attr && attr->ulValueLen != (CK_ULONG)-1)
+						needed += P11_ATTR_VALUE_ALIGN (attr->ulValueLen);
+				}
 
-				attrs = lookup_object_inlock (session, object, &index);
-				if (attrs == NULL)
-					continue;
+				/* Leave the object for the next call */
+				if (used + needed > *buffer_len) {
+					find->pending = object;
+					if (matched == 0) {
+						rv = CKR_BUFFER_TOO_SMALL;
+						used = needed;
+					}
+					break;
+				}
 
-				if (find_objects_match (attrs, find->match)) {
-					objects[matched] = object;
-					matched++;
+				/* The same values as C_GetAttributeValue() returns */
+				for (i = 0; i < template_count; i++) {
+					attr = p11_attrs_find (attrs, result[i].type);
+					if (attr == NULL) {
+						result[i].pValue = NULL;
+						result[i].ulValueLen = (CK_ULONG)-1;
+						missing = true;
+					} else if (attr->ulValueLen == (CK_ULONG)-1) {
+						result[i].pValue = NULL;
+						result[i].ulValueLen = attr->ulValueLen;
+					} else {
+						result[i].pValue = buffer + used;
+						result[i].ulValueLen = attr->ulValueLen;
+						if (attr->ulValueLen)
+							memcpy (result[i].pValue, attr->pValue, attr->ulValueLen);
+						used += P11_ATTR_VALUE_ALIGN (attr->ulValueLen);
+					}
 				}
+
+				objects[matched++] = object;
 			}
 
 			*count = matched;
+			*buffer_len = used;
+
+			if (rv == CKR_OK && missing)
+				rv = CKR_ATTRIBUTE_TYPE_INVALID;
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx, %lu", handle, *count);
 
@@ -1260,7 +1503,7 @@ sys_C_FindObjectsFinal (CK_SESSION_HANDLE handle)
 
 	p11_debug ("in");
 
-	p11_lock ();
+	p11_lock_read ();
 
 		rv = lookup_session (handle, &session);
 		if (rv == CKR_OK) {
@@ -1270,7 +1513,7 @@ sys_C_FindObjectsFinal (CK_SESSION_HANDLE handle)
 				p11_session_set_operation (session, NULL, NULL);
 		}
 
-	p11_unlock ();
+	p11_unlock_rw ();
 
 	p11_debug ("out: 0x%lx", rv);
 
@@ -1694,10 +1937,31 @@ C_GetFunctionList (CK_FUNCTION_LIST_PTR_PTR list)
 	return sys_C_GetFunctionList (list);
 }
 
+static CK_X_VENDOR_FUNCTION_LIST sys_vendor_function_list = {
+	{ 1, 0 },  /* version */
+	sys_C_X_FindObjectsAttributes,
+};
+
+#ifdef OS_WIN32
+__declspec(dllexport)
+#endif
+
+CK_RV
+C_X_GetVendorFunctionList (CK_X_VENDOR_FUNCTION_LIST **list)
+{
+	return_val_if_fail (list != NULL, CKR_ARGUMENTS_BAD);
+
+	p11_library_init_once ();
+	*list = &sys_vendor_function_list;
+	return CKR_OK;
+}
+
 CK_ULONG
 p11_module_next_id (void)
 {
 	static CK_ULONG unique = 0x10;
+
+	/* Objects and sessions are only added with the write lock held */
 	return (unique)++;
 }
 
@@ -33,10 +33,13 @@
  */
 
 #include "pkcs11.h"
+#include "pkcs11x.h"
 
 #ifndef P11_MODULE_H_
 #define P11_MODULE_H_
 
 CK_ULONG      p11_module_next_id            (void);
 
+CK_RV         C_X_GetVendorFunctionList     (CK_X_VENDOR_FUNCTION_LIST **list);
+
 #endif /* P11_MODULE_H_ */
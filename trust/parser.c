@@ -37,6 +37,8 @@
 #include "array.h"
 #include "asn1.h"
 #include "attrs.h"
+#include "buffer.h"
+#include "compat.h"
 #define P11_DEBUG_FLAG P11_DEBUG_TRUST
 #include "debug.h"
 #include "dict.h"
@@ -55,10 +57,13 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/time.h>
 
 #include <assert.h>
+#include <ctype.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -68,8 +73,12 @@ struct _p11_parser {
 	p11_asn1_cache *asn1_cache;
 	p11_dict *asn1_defs;
 	p11_persist *persist;
+	p11_array *parsed;
+	p11_array *lost;
+	const char *filename;
 	char *basename;
 	int flags;
+	int workers;
 };
 
 #define ID_LENGTH P11_HASH_SHA1_LEN
@@ -133,12 +142,17 @@ populate_trust (p11_parser *parser,
 
 static bool
 lookup_cert_duplicate (p11_index *index,
+                       const char *origin,
                        CK_ATTRIBUTE *attrs,
                        CK_OBJECT_HANDLE *handle,
                        CK_ATTRIBUTE **dupl)
 {
 	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_OBJECT_HANDLE *handles;
 	CK_ATTRIBUTE *value;
+	CK_ATTRIBUTE *other;
+	size_t length;
+	int i;
 
 	CK_ATTRIBUTE match[] = {
 		{ CKA_VALUE, },
@@ -146,23 +160,35 @@ lookup_cert_duplicate (p11_index *index,
 		{ CKA_INVALID },
 	};
 
+	value = p11_attrs_find_valid (attrs, CKA_VALUE);
+	if (value == NULL)
+		return false;
+
+	memcpy (match, value, sizeof (CK_ATTRIBUTE));
+	handles = p11_index_find_all (index, match, -1);
+
 	/*
-	 * TODO: This will need to be adapted when we support reload on
-	 * the fly, but for now since we only load once, we can assume
-	 * that any certs already present in the index are duplicates.
+	 * Certificates loaded from the same origin are not duplicates, but
+	 * rather the previous version of objects that are being reloaded.
 	 */
-
-	value = p11_attrs_find_valid (attrs, CKA_VALUE);
-	if (value != NULL) {
-		memcpy (match, value, sizeof (CK_ATTRIBUTE));
-		*handle = p11_index_find (index, match, -1);
-		if (*handle != 0) {
-			*dupl = p11_index_lookup (index, *handle);
-			return true;
+	*handle = 0;
+	for (i = 0; handles && handles[i] != 0; i++) {
+		*dupl = p11_index_lookup (index, handles[i]);
+		if (*dupl == NULL)
+			continue;
+		if (origin != NULL) {
+			other = p11_attrs_find_valid (*dupl, CKA_X_ORIGIN);
+			length = strlen (origin);
+			if (other && other->ulValueLen == length &&
+			    memcmp (other->pValue, origin, length) == 0)
+				continue;
 		}
+		*handle = handles[i];
+		break;
 	}
 
-	return false;
+	free (handles);
+	return *handle != 0;
 }
 
 static char *
@@ -198,30 +224,50 @@ calc_cert_priority (CK_ATTRIBUTE *attrs)
 }
 
 static void
-sink_object (p11_parser *parser,
-             CK_ATTRIBUTE *attrs)
+message_duplicate (p11_parser *parser,
+                   CK_ATTRIBUTE *dupl)
+{
+	char *label;
+
+	/* This is not a good place to be for a well configured system */
+	label = pull_cert_label (dupl);
+	p11_message ("duplicate '%s' certificate found in: %s",
+	             label ? label : "?", parser->basename);
+	free (label);
+}
+
+static CK_ATTRIBUTE *
+origin_attrs (CK_ATTRIBUTE *attrs,
+              const char *filename)
+{
+	CK_ATTRIBUTE origin = { CKA_X_ORIGIN, (void *)filename, 0 };
+
+	if (filename == NULL)
+		return attrs;
+
+	origin.ulValueLen = strlen (filename);
+	return p11_attrs_build (attrs, &origin, NULL);
+}
+
+static void
+insert_object (p11_parser *parser,
+               CK_ATTRIBUTE *attrs)
 {
 	CK_OBJECT_HANDLE handle;
 	CK_OBJECT_CLASS klass;
 	CK_ATTRIBUTE *dupl;
-	char *label;
 	CK_RV rv;
 
 	/* By default not replacing anything */
 	handle = 0;
 
+	attrs = origin_attrs (attrs, parser->filename);
+	return_if_fail (attrs != NULL);
+
 	if (p11_attrs_find_ulong (attrs, CKA_CLASS, &klass) &&
 	    klass == CKO_CERTIFICATE) {
-		attrs = populate_trust (parser, attrs);
-		return_if_fail (attrs != NULL);
-
-		if (lookup_cert_duplicate (parser->index, attrs, &handle, &dupl)) {
-
-			/* This is not a good place to be for a well configured system */
-			label = pull_cert_label (dupl);
-			p11_message ("duplicate '%s' certificate found in: %s",
-			             label ? label : "?", parser->basename);
-			free (label);
+		if (lookup_cert_duplicate (parser->index, NULL, attrs, &handle, &dupl)) {
+			message_duplicate (parser, dupl);
 
 			/*
 			 * Nevertheless we provide predictable behavior about what
@@ -241,6 +287,59 @@ sink_object (p11_parser *parser,
 		p11_message ("couldn't load file into objects: %s", parser->basename);
 }
 
+static void
+sink_parsed (p11_parser *parser,
+             CK_ATTRIBUTE *attrs)
+{
+	/* Without an index, objects are collected for p11_parser_sink() */
+	if (parser->index == NULL) {
+		if (parser->parsed == NULL) {
+			parser->parsed = p11_array_new (p11_attrs_free);
+			return_if_fail (parser->parsed != NULL);
+		}
+		if (!p11_array_push (parser->parsed, attrs))
+			return_if_reached ();
+		return;
+	}
+
+	insert_object (parser, attrs);
+}
+
+static void
+sink_object (p11_parser *parser,
+             CK_ATTRIBUTE *attrs)
+{
+	CK_OBJECT_CLASS klass;
+
+	if (p11_attrs_find_ulong (attrs, CKA_CLASS, &klass) &&
+	    klass == CKO_CERTIFICATE) {
+		attrs = populate_trust (parser, attrs);
+		return_if_fail (attrs != NULL);
+	}
+
+	sink_parsed (parser, attrs);
+}
+
+/* Move the parsed certificate ASN.1 over for use by this parser */
+static void
+take_parsed_asn1 (p11_parser *parser,
+                  p11_asn1_cache *asn1_cache,
+                  CK_ATTRIBUTE *attrs)
+{
+	CK_ATTRIBUTE *value;
+	node_asn *node;
+
+	value = p11_attrs_find_valid (attrs, CKA_VALUE);
+	if (value != NULL && asn1_cache != NULL && asn1_cache != parser->asn1_cache) {
+		node = p11_asn1_cache_steal (asn1_cache, "PKIX1.Certificate",
+		                             value->pValue, value->ulValueLen);
+		if (node != NULL) {
+			p11_asn1_cache_take (parser->asn1_cache, node, "PKIX1.Certificate",
+			                     value->pValue, value->ulValueLen);
+		}
+	}
+}
+
 static CK_ATTRIBUTE *
 certificate_attrs (p11_parser *parser,
                    CK_ATTRIBUTE *id,
@@ -259,6 +358,29 @@ certificate_attrs (p11_parser *parser,
 	return p11_attrs_build (NULL, &klass, &modifiable, &certificate_type, &value, id, NULL);
 }
 
+/*
+ * The parsed certificate ASN.1 stays in the cache for later use by the
+ * builder, and the same certificate in another file isn't decoded again.
+ */
+static node_asn *
+decode_certificate (p11_parser *parser,
+                    const unsigned char *der,
+                    size_t der_len,
+                    char *message)
+{
+	node_asn *cert;
+
+	cert = p11_asn1_cache_get (parser->asn1_cache, "PKIX1.Certificate", der, der_len);
+	if (cert != NULL)
+		return cert;
+
+	cert = p11_asn1_decode (parser->asn1_defs, "PKIX1.Certificate", der, der_len, message);
+	if (cert != NULL)
+		p11_asn1_cache_take (parser->asn1_cache, cert, "PKIX1.Certificate", der, der_len);
+
+	return cert;
+}
+
 static int
 parse_der_x509_certificate (p11_parser *parser,
                             const unsigned char *data,
@@ -268,10 +390,9 @@ parse_der_x509_certificate (p11_parser *parser,
 	CK_BYTE idv[ID_LENGTH];
 	CK_ATTRIBUTE id = { CKA_ID, idv, sizeof (idv) };
 	CK_ATTRIBUTE *attrs;
-	CK_ATTRIBUTE *value;
 	node_asn *cert;
 
-	cert = p11_asn1_decode (parser->asn1_defs, "PKIX1.Certificate", data, length, message);
+	cert = decode_certificate (parser, data, length, message);
 	if (cert == NULL)
 		return P11_PARSE_UNRECOGNIZED;
 
@@ -282,11 +403,6 @@ parse_der_x509_certificate (p11_parser *parser,
 	attrs = certificate_attrs (parser, &id, data, length);
 	return_val_if_fail (attrs != NULL, P11_PARSE_FAILURE);
 
-	value = p11_attrs_find_valid (attrs, CKA_VALUE);
-	return_val_if_fail (value != NULL, P11_PARSE_FAILURE);
-	p11_asn1_cache_take (parser->asn1_cache, cert, "PKIX1.Certificate",
-	                     value->pValue, value->ulValueLen);
-
 	sink_object (parser, attrs);
 	return P11_PARSE_SUCCESS;
 }
@@ -562,7 +678,6 @@ parse_openssl_trusted_certificate (p11_parser *parser,
 	CK_ATTRIBUTE *attrs;
 	CK_BYTE idv[ID_LENGTH];
 	CK_ATTRIBUTE id = { CKA_ID, idv, sizeof (idv) };
-	CK_ATTRIBUTE *value;
 	char *label = NULL;
 	node_asn *cert;
 	node_asn *aux;
@@ -581,15 +696,13 @@ parse_openssl_trusted_certificate (p11_parser *parser,
 	if (cert_len <= 0)
 		return P11_PARSE_UNRECOGNIZED;
 
-	cert = p11_asn1_decode (parser->asn1_defs, "PKIX1.Certificate", data, cert_len, message);
+	cert = decode_certificate (parser, data, cert_len, message);
 	if (cert == NULL)
 		return P11_PARSE_UNRECOGNIZED;
 
 	aux = p11_asn1_decode (parser->asn1_defs, "OPENSSL.CertAux", data + cert_len, length - cert_len, message);
-	if (aux == NULL) {
-		asn1_delete_structure (&cert);
+	if (aux == NULL)
 		return P11_PARSE_UNRECOGNIZED;
-	}
 
 	/* The CKA_ID links related objects */
 	if (!p11_x509_calc_keyid (cert, data, cert_len, idv))
@@ -598,12 +711,6 @@ parse_openssl_trusted_certificate (p11_parser *parser,
 	attrs = certificate_attrs (parser, &id, data, cert_len);
 	return_val_if_fail (attrs != NULL, P11_PARSE_FAILURE);
 
-	/* Cache the parsed certificate ASN.1 for later use by the builder */
-	value = p11_attrs_find_valid (attrs, CKA_VALUE);
-	return_val_if_fail (value != NULL, P11_PARSE_FAILURE);
-	p11_asn1_cache_take (parser->asn1_cache, cert, "PKIX1.Certificate",
-	                     value->pValue, value->ulValueLen);
-
 	/* Pull the label out of the CertAux */
 	len = 0;
 	ret = asn1_read_value (aux, "alias", NULL, &len);
@@ -636,7 +743,8 @@ on_pem_block (const char *type,
 	p11_parser *parser = user_data;
 	int ret;
 
-	p11_index_batch (parser->index);
+	if (parser->index)
+		p11_index_batch (parser->index);
 
 	if (strcmp (type, "CERTIFICATE") == 0) {
 		ret = parse_der_x509_certificate (parser, contents, length);
@@ -649,12 +757,162 @@ on_pem_block (const char *type,
 		ret = P11_PARSE_SUCCESS;
 	}
 
-	p11_index_finish (parser->index);
+	if (parser->index)
+		p11_index_finish (parser->index);
 
 	if (ret != P11_PARSE_SUCCESS)
 		p11_message ("Couldn't parse PEM block of type %s", type);
 }
 
+/* The fewest PEM blocks worth decoding in a thread of their own */
+#define PEM_PER_WORKER 16
+
+typedef struct {
+	char *type;
+	unsigned char *der;
+	size_t length;
+} pem_block;
+
+typedef struct {
+	p11_parser *parser;
+	p11_asn1_cache *asn1_cache;
+	p11_array *blocks;
+	int first;
+	int last;
+	p11_thread_t thread;
+	bool started;
+} pem_worker;
+
+static void
+pem_block_free (void *data)
+{
+	pem_block *block = data;
+	free (block->type);
+	free (block->der);
+	free (block);
+}
+
+static void
+on_pem_collect (const char *type,
+                const unsigned char *contents,
+                size_t length,
+                void *user_data)
+{
+	p11_array *blocks = user_data;
+	pem_block *block;
+
+	block = calloc (1, sizeof (pem_block));
+	return_if_fail (block != NULL);
+	block->type = strdup (type);
+	return_if_fail (block->type != NULL);
+	block->der = memdup (contents, length);
+	return_if_fail (block->der != NULL);
+	block->length = length;
+
+	if (!p11_array_push (blocks, block))
+		return_if_reached ();
+}
+
+static void *
+pem_worker_thread (void *data)
+{
+	pem_worker *worker = data;
+	pem_block *block;
+	int i;
+
+	for (i = worker->first; i < worker->last; i++) {
+		block = worker->blocks->elem[i];
+		on_pem_block (block->type, block->der, block->length, worker->parser);
+	}
+
+	return NULL;
+}
+
+/*
+ * The blocks are split into ranges in file order. The first range is
+ * parsed by this parser, and the others in threads each with their own
+ * parser. Their objects are then sunk here range after range, just as if
+ * the whole file had been parsed in order.
+ */
+static int
+parse_pem_parallel (p11_parser *parser,
+                    const unsigned char *data,
+                    size_t length)
+{
+	pem_worker *workers;
+	p11_array *blocks;
+	p11_array *parsed;
+	int num_workers;
+	int num;
+	int i;
+	int j;
+
+	blocks = p11_array_new (pem_block_free);
+	return_val_if_fail (blocks != NULL, 0);
+
+	p11_pem_parse ((const char *)data, length, on_pem_collect, blocks);
+	num = blocks->num;
+
+	num_workers = num / PEM_PER_WORKER;
+	if (num_workers > parser->workers)
+		num_workers = parser->workers;
+	if (num_workers < 1)
+		num_workers = 1;
+
+	workers = calloc (num_workers, sizeof (pem_worker));
+	return_val_if_fail (workers != NULL, 0);
+
+	for (i = 0; i < num_workers; i++) {
+		workers[i].blocks = blocks;
+		workers[i].first = (num * i) / num_workers;
+		workers[i].last = (num * (i + 1)) / num_workers;
+		if (i == 0) {
+			workers[i].parser = parser;
+			continue;
+		}
+
+		workers[i].asn1_cache = p11_asn1_cache_new ();
+		return_val_if_fail (workers[i].asn1_cache != NULL, 0);
+		workers[i].parser = p11_parser_new (NULL, workers[i].asn1_cache);
+		return_val_if_fail (workers[i].parser != NULL, 0);
+		workers[i].parser->filename = parser->filename;
+		workers[i].parser->basename = strdup (parser->basename);
+		workers[i].parser->flags = parser->flags;
+
+		workers[i].started = (p11_thread_create (&workers[i].thread,
+		                                         pem_worker_thread,
+		                                         workers + i) == 0);
+	}
+
+	pem_worker_thread (workers + 0);
+
+	for (i = 1; i < num_workers; i++) {
+		if (workers[i].started)
+			p11_thread_join (workers[i].thread);
+		else
+			pem_worker_thread (workers + i);
+
+		parsed = p11_parser_parsed (workers[i].parser);
+		for (j = 0; parsed != NULL && j < parsed->num; j++) {
+			take_parsed_asn1 (parser, workers[i].asn1_cache, parsed->elem[j]);
+			sink_parsed (parser, parsed->elem[j]);
+			parsed->elem[j] = NULL;
+		}
+
+		p11_array_free (parsed);
+		free (workers[i].parser->basename);
+		p11_parser_free (workers[i].parser);
+		p11_asn1_cache_free (workers[i].asn1_cache);
+	}
+
+	p11_debug ("%s: decoded %d pem blocks with %d workers",
+	           parser->basename, num, num_workers);
+
+	free (workers);
+	p11_array_free (blocks);
+	return num;
+}
+
 static int
 parse_pem_certificates (p11_parser *parser,
                         const unsigned char *data,
@@ -662,7 +920,10 @@ parse_pem_certificates (p11_parser *parser,
 {
 	int num;
 
-	num = p11_pem_parse ((const char *)data, length, on_pem_block, parser);
+	if (parser->workers > 1)
+		num = parse_pem_parallel (parser, data, length);
+	else
+		num = p11_pem_parse ((const char *)data, length, on_pem_block, parser);
 
 	if (num == 0)
 		return P11_PARSE_UNRECOGNIZED;
@@ -700,37 +961,149 @@ parse_p11_kit_persist (p11_parser *parser,
 	return ret ? P11_PARSE_SUCCESS : P11_PARSE_FAILURE;
 }
 
-static parser_func all_parsers[] = {
-	parse_p11_kit_persist,
-	parse_pem_certificates,
-	parse_der_x509_certificate,
-	NULL,
+static const struct {
+	const char *name;
+	parser_func parse;
+} all_parsers[] = {
+	{ "p11-kit", parse_p11_kit_persist },
+	{ "pem", parse_pem_certificates },
+	{ "der", parse_der_x509_certificate },
+	{ NULL, },
+};
+
+enum {
+	FORMAT_UNKNOWN = -1,
+	FORMAT_PERSIST = 0,
+	FORMAT_PEM = 1,
+	FORMAT_DER = 2,
 };
 
+/*
+ * Guess the format from the leading bytes, so that usually only one
+ * parser has to be tried. A DER certificate starts with a SEQUENCE whose
+ * length takes more than one byte. Whitespace and comments are skipped
+ * in front of the text formats. PEM followed by p11-kit sections is
+ * left to the p11-kit parser, which is tried first.
+ */
+static int
+sniff_format (const unsigned char *data,
+              size_t length)
+{
+	static const char pem_begin[] = "-----BEGIN ";
+	size_t at;
+
+	if (length >= 2 && data[0] == 0x30 && data[1] >= 0x81 && data[1] <= 0x84)
+		return FORMAT_DER;
+
+	for (at = 0; at < length; at++) {
+		if (data[at] == '#') {
+			while (at < length && data[at] != '\n')
+				at++;
+		} else if (!isspace (data[at])) {
+			break;
+		}
+	}
+
+	if (at < length && data[at] == '[')
+		return FORMAT_PERSIST;
+	if (length - at >= sizeof (pem_begin) - 1 &&
+	    memcmp (data + at, pem_begin, sizeof (pem_begin) - 1) == 0 &&
+	    !p11_persist_magic (data, length))
+		return FORMAT_PEM;
+
+	return FORMAT_UNKNOWN;
+}
+
+static uint64_t
+parse_time_usec (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+}
+
+static int
+parse_format (p11_parser *parser,
+              int format,
+              const unsigned char *data,
+              size_t length)
+{
+	uint64_t started = 0;
+	int ret;
+
+	if (p11_debugging)
+		started = parse_time_usec ();
+
+	if (parser->index)
+		p11_index_batch (parser->index);
+	ret = (all_parsers[format].parse) (parser, data, length);
+	if (parser->index)
+		p11_index_finish (parser->index);
+
+	if (p11_debugging) {
+		p11_debug ("%s: %s as %s in %llu us", parser->basename,
+		           ret == P11_PARSE_SUCCESS ? "parsed" :
+		           ret == P11_PARSE_UNRECOGNIZED ? "not recognized" : "failed to parse",
+		           all_parsers[format].name,
+		           (unsigned long long)(parse_time_usec () - started));
+	}
+
+	return ret;
+}
+
 p11_parser *
 p11_parser_new (p11_index *index,
                 p11_asn1_cache *asn1_cache)
 {
 	p11_parser parser = { 0, };
 
-	return_val_if_fail (index != NULL, NULL);
 	return_val_if_fail (asn1_cache != NULL, NULL);
 
 	parser.index = index;
 	parser.asn1_defs = p11_asn1_cache_defs (asn1_cache);
 	parser.asn1_cache = asn1_cache;
+	parser.workers = 1;
 
 	return memdup (&parser, sizeof (parser));
 }
 
+void
+p11_parser_set_workers (p11_parser *parser,
+                        int workers)
+{
+	return_if_fail (parser != NULL);
+	parser->workers = workers < 1 ? 1 : workers;
+}
+
 void
 p11_parser_free (p11_parser *parser)
 {
 	return_if_fail (parser != NULL);
 	p11_persist_free (parser->persist);
+	p11_array_free (parser->parsed);
+	p11_array_free (parser->lost);
 	free (parser);
 }
 
+static void
+parse_begin (p11_parser *parser,
+             const char *filename,
+             int flags)
+{
+	parser->filename = filename;
+	parser->basename = p11_path_base (filename);
+	parser->flags = flags;
+}
+
+static void
+parse_end (p11_parser *parser)
+{
+	free (parser->basename);
+	parser->filename = NULL;
+	parser->basename = NULL;
+	parser->flags = 0;
+}
+
 int
 p11_parse_memory (p11_parser *parser,
                   const char *filename,
@@ -739,30 +1112,147 @@ p11_parse_memory (p11_parser *parser,
                   size_t length)
 {
 	int ret = P11_PARSE_UNRECOGNIZED;
-	char *base;
+	int format;
 	int i;
 
 	return_val_if_fail (parser != NULL, P11_PARSE_FAILURE);
 
-	base = p11_path_base (filename);
-	parser->basename = base;
-	parser->flags = flags;
+	parse_begin (parser, filename, flags);
+
+	/* The format we sniffed usually parses, otherwise try them all */
+	format = sniff_format (data, length);
+	if (format != FORMAT_UNKNOWN)
+		ret = parse_format (parser, format, data, length);
+
+	for (i = 0; ret == P11_PARSE_UNRECOGNIZED && all_parsers[i].parse != NULL; i++) {
+		if (i != format)
+			ret = parse_format (parser, i, data, length);
+	}
+
+	parse_end (parser);
+	return ret;
+}
+
+#define PARSE_CHUNK 16384
+
+/*
+ * A device such as /dev/zero never ends, so stop reading a stream after
+ * this much. Trust bundles are far smaller.
+ */
+#define PARSE_STREAM_MAX (64 * 1024 * 1024)
+
+static ssize_t
+parse_read (int fd,
+            p11_buffer *buffer,
+            size_t *total)
+{
+	unsigned char *data;
+	ssize_t res;
+
+	if (*total >= PARSE_STREAM_MAX) {
+		errno = EFBIG;
+		return -1;
+	}
+
+	data = p11_buffer_append (buffer, PARSE_CHUNK);
+	return_val_if_fail (data != NULL, -1);
+
+	do {
+		res = read (fd, data, PARSE_CHUNK);
+	} while (res < 0 && errno == EINTR);
+
+	buffer->len -= PARSE_CHUNK - (res > 0 ? res : 0);
+	if (res > 0)
+		*total += res;
+	return res;
+}
 
-	for (i = 0; all_parsers[i] != NULL; i++) {
+/*
+ * Certificates are handed to the sink one PEM block at a time, so only
+ * the current block and one chunk of input are held in memory.
+ */
+static int
+parse_pem_stream (p11_parser *parser,
+                  int fd,
+                  p11_buffer *buffer,
+                  size_t *total)
+{
+	p11_pem_stream *stream;
+	unsigned int num;
+	ssize_t res;
+
+	stream = p11_pem_stream_new (on_pem_block, parser);
+	return_val_if_fail (stream != NULL, P11_PARSE_FAILURE);
+
+	if (parser->index)
 		p11_index_batch (parser->index);
-		ret = (all_parsers[i]) (parser, data, length);
+
+	do {
+		p11_pem_stream_feed (stream, (const char *)buffer->data, buffer->len);
+		p11_buffer_reset (buffer, PARSE_CHUNK);
+		res = parse_read (fd, buffer, total);
+	} while (res > 0);
+
+	num = p11_pem_stream_finish (stream);
+
+	if (parser->index)
 		p11_index_finish (parser->index);
 
-		if (ret != P11_PARSE_UNRECOGNIZED)
-			break;
+	if (res < 0) {
+		p11_message ("couldn't read file: %s: %s", parser->filename, strerror (errno));
+		return P11_PARSE_FAILURE;
 	}
 
-	p11_asn1_cache_flush (parser->asn1_cache);
+	p11_debug ("%s: streamed %u pem blocks", parser->basename, num);
+	return num == 0 ? P11_PARSE_UNRECOGNIZED : P11_PARSE_SUCCESS;
+}
 
-	free (base);
-	parser->basename = NULL;
-	parser->flags = 0;
+/*
+ * Pipes, sockets and devices like stdin cannot be mapped, so read them
+ * instead. The leading chunk is enough to tell whether the input is PEM,
+ * which can be parsed as it arrives. Other formats are read completely.
+ */
+static int
+parse_stream (p11_parser *parser,
+              const char *filename,
+              int flags)
+{
+	p11_buffer buffer;
+	size_t total = 0;
+	ssize_t res;
+	int ret;
+	int fd;
 
+	fd = open (filename, O_RDONLY);
+	if (fd < 0) {
+		p11_message ("couldn't open file: %s: %s", filename, strerror (errno));
+		return P11_PARSE_FAILURE;
+	}
+
+	if (!p11_buffer_init (&buffer, PARSE_CHUNK))
+		return_val_if_reached (P11_PARSE_FAILURE);
+
+	res = parse_read (fd, &buffer, &total);
+
+	if (res > 0 && sniff_format (buffer.data, buffer.len) == FORMAT_PEM) {
+		parse_begin (parser, filename, flags);
+		ret = parse_pem_stream (parser, fd, &buffer, &total);
+		parse_end (parser);
+
+	} else {
+		while (res > 0)
+			res = parse_read (fd, &buffer, &total);
+
+		if (res < 0) {
+			p11_message ("couldn't read file: %s: %s", filename, strerror (errno));
+			ret = P11_PARSE_FAILURE;
+		} else {
+			ret = p11_parse_memory (parser, filename, flags, buffer.data, buffer.len);
+		}
+	}
+
+	p11_buffer_uninit (&buffer);
+	close (fd);
 	return ret;
 }
 
@@ -771,6 +1261,7 @@ p11_parse_file (p11_parser *parser,
                 const char *filename,
                 int flags)
 {
+	struct stat sb;
 	p11_mmap *map;
 	void *data;
 	size_t size;
@@ -779,6 +1270,9 @@ p11_parse_file (p11_parser *parser,
 	return_val_if_fail (parser != NULL, P11_PARSE_FAILURE);
 	return_val_if_fail (filename != NULL, P11_PARSE_FAILURE);
 
+	if (stat (filename, &sb) == 0 && !S_ISREG (sb.st_mode) && !S_ISDIR (sb.st_mode))
+		return parse_stream (parser, filename, flags);
+
 	map = p11_mmap_open (filename, &data, &size);
 	if (map == NULL) {
 		p11_message ("couldn't open and map file: %s: %s", filename, strerror (errno));
@@ -790,3 +1284,180 @@ p11_parse_file (p11_parser *parser,
 	p11_mmap_close (map);
 	return ret;
 }
+
+p11_array *
+p11_parser_parsed (p11_parser *parser)
+{
+	p11_array *parsed;
+
+	return_val_if_fail (parser != NULL, NULL);
+
+	parsed = parser->parsed;
+	parser->parsed = NULL;
+	return parsed;
+}
+
+p11_array *
+p11_parser_lost (p11_parser *parser)
+{
+	p11_array *lost;
+
+	return_val_if_fail (parser != NULL, NULL);
+
+	lost = parser->lost;
+	parser->lost = NULL;
+	return lost;
+}
+
+/*
+ * Remember the file a certificate was dropped from, because a duplicate
+ * in another file won. If the other file changes, the certificate may
+ * have to come back.
+ */
+static void
+sink_lost (p11_parser *parser,
+           const char *origin,
+           size_t length)
+{
+	char *path;
+
+	if (parser->lost == NULL) {
+		parser->lost = p11_array_new (free);
+		return_if_fail (parser->lost != NULL);
+	}
+
+	path = strndup (origin, length);
+	return_if_fail (path != NULL);
+
+	if (!p11_array_push (parser->lost, path))
+		return_if_reached ();
+}
+
+static bool
+sink_filter_duplicate (p11_parser *parser,
+                       const char *filename,
+                       p11_dict *certs,
+                       p11_array *replace,
+                       CK_ATTRIBUTE *attrs)
+{
+	CK_OBJECT_HANDLE handle;
+	CK_OBJECT_CLASS klass;
+	CK_ATTRIBUTE *origin;
+	CK_ATTRIBUTE *value;
+	CK_ATTRIBUTE *dupl;
+	int i;
+
+	if (!p11_attrs_find_ulong (attrs, CKA_CLASS, &klass) ||
+	    klass != CKO_CERTIFICATE)
+		return false;
+
+	value = p11_attrs_find_valid (attrs, CKA_VALUE);
+	if (value == NULL)
+		return false;
+
+	/*
+	 * The same predictable behavior as insert_object(), whether the
+	 * duplicate is earlier in this file, or was loaded from another.
+	 * If we have a lower or equal priority then just go away.
+	 */
+	dupl = p11_dict_get (certs, value);
+	if (dupl != NULL) {
+		message_duplicate (parser, dupl);
+		if (calc_cert_priority (attrs) <= calc_cert_priority (dupl))
+			return true;
+		for (i = 0; i < replace->num; i++) {
+			if (replace->elem[i] == dupl) {
+				p11_dict_remove (certs, p11_attrs_find_valid (dupl, CKA_VALUE));
+				p11_array_remove (replace, i);
+				break;
+			}
+		}
+
+	} else if (lookup_cert_duplicate (parser->index, filename, attrs, &handle, &dupl)) {
+		message_duplicate (parser, dupl);
+		if (calc_cert_priority (attrs) <= calc_cert_priority (dupl)) {
+			sink_lost (parser, filename, strlen (filename));
+			return true;
+		}
+		origin = p11_attrs_find_valid (dupl, CKA_X_ORIGIN);
+		if (origin != NULL)
+			sink_lost (parser, origin->pValue, origin->ulValueLen);
+		if (p11_index_remove (parser->index, handle) != CKR_OK)
+			return_val_if_reached (true);
+	}
+
+	if (!p11_dict_set (certs, value, attrs))
+		return_val_if_reached (true);
+	return false;
+}
+
+void
+p11_parser_sink (p11_parser *parser,
+                 const char *filename,
+                 p11_array *parsed,
+                 p11_asn1_cache *asn1_cache)
+{
+	CK_ATTRIBUTE *attrs;
+	p11_array *replace;
+	p11_dict *certs;
+	CK_RV rv;
+	int i;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_X_ORIGIN, (void *)filename, 0 },
+		{ CKA_INVALID },
+	};
+
+	return_if_fail (parser != NULL);
+	return_if_fail (parser->index != NULL);
+	return_if_fail (filename != NULL);
+	return_if_fail (parsed != NULL);
+
+	match[0].ulValueLen = strlen (filename);
+
+	replace = p11_array_new (p11_attrs_free);
+	return_if_fail (replace != NULL);
+
+	/* Certificates in this file, by their CKA_VALUE */
+	certs = p11_dict_new (p11_attr_hash, p11_attr_equal, NULL, NULL);
+	return_if_fail (certs != NULL);
+
+	parser->basename = p11_path_base (filename);
+	p11_index_batch (parser->index);
+
+	for (i = 0; i < parsed->num; i++) {
+		attrs = parsed->elem[i];
+		parsed->elem[i] = NULL;
+
+		/* The builder uses the parsed certificate ASN.1 */
+		take_parsed_asn1 (parser, asn1_cache, attrs);
+
+		attrs = origin_attrs (attrs, filename);
+		return_if_fail (attrs != NULL);
+
+		if (sink_filter_duplicate (parser, filename, certs, replace, attrs)) {
+			p11_attrs_free (attrs);
+			continue;
+		}
+
+		if (!p11_array_push (replace, attrs))
+			return_if_reached ();
+	}
+
+	p11_dict_free (certs);
+
+	/*
+	 * Objects previously loaded from this file are replaced. The ones
+	 * with the same CKA_VALUE are rebuilt in place and keep their handle,
+	 * those no longer in the file are removed.
+	 */
+	rv = p11_index_replace_all (parser->index, match, CKA_VALUE, replace);
+	if (rv != CKR_OK)
+		p11_message ("couldn't load file into objects: %s", parser->basename);
+
+	p11_index_finish (parser->index);
+	p11_array_free (replace);
+
+	free (parser->basename);
+	parser->basename = NULL;
+}
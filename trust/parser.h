@@ -60,6 +60,9 @@ p11_parser *  p11_parser_new       (p11_index *index,
 
 void          p11_parser_free      (p11_parser *parser);
 
+void          p11_parser_set_workers (p11_parser *parser,
+                                      int workers);
+
 int           p11_parse_memory     (p11_parser *parser,
                                     const char *filename,
                                     int flags,
@@ -70,4 +73,13 @@ int           p11_parse_file       (p11_parser *parser,
                                     const char *filename,
                                     int flags);
 
+p11_array *   p11_parser_parsed    (p11_parser *parser);
+
+p11_array *   p11_parser_lost      (p11_parser *parser);
+
+void          p11_parser_sink      (p11_parser *parser,
+                                    const char *filename,
+                                    p11_array *parsed,
+                                    p11_asn1_cache *asn1_cache);
+
 #endif
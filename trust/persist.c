@@ -43,8 +43,6 @@
 #include "persist.h"
 #include "url.h"
 
-#include "basic.asn.h"
-
 #include <libtasn1.h>
 
 #include <stdlib.h>
@@ -54,7 +52,7 @@
 
 struct _p11_persist {
 	p11_dict *constants;
-	node_asn *asn1_defs;
+	p11_dict *asn1_defs;
 
 	/* Used during parsing */
 	p11_lexer lexer;
@@ -90,7 +88,7 @@ p11_persist_free (p11_persist *persist)
 	if (!persist)
 		return;
 	p11_dict_free (persist->constants);
-	asn1_delete_structure (&persist->asn1_defs);
+	p11_asn1_defs_unref (persist->asn1_defs);
 	free (persist);
 }
 
@@ -196,7 +194,6 @@ parse_oid (p11_persist *persist,
            p11_lexer *lexer,
            CK_ATTRIBUTE *attr)
 {
-	char message[ASN1_MAX_ERROR_DESCRIPTION_SIZE] = { 0, };
 	node_asn *asn;
 	size_t length;
 	char *value;
@@ -217,20 +214,12 @@ parse_oid (p11_persist *persist,
 	}
 
 	if (!persist->asn1_defs) {
-		ret = asn1_array2tree (basic_asn1_tab, &persist->asn1_defs, message);
-		if (ret != ASN1_SUCCESS) {
-			p11_debug_precond ("failed to load BASIC definitions: %s: %s\n",
-			                   asn1_strerror (ret), message);
-			return false;
-		}
+		persist->asn1_defs = p11_asn1_defs_load ();
+		return_val_if_fail (persist->asn1_defs != NULL, false);
 	}
 
-	ret = asn1_create_element (persist->asn1_defs, "BASIC.ObjectIdentifier", &asn);
-	if (ret != ASN1_SUCCESS) {
-		p11_debug_precond ("failed to create ObjectIdentifier element: %s\n",
-		                   asn1_strerror (ret));
-		return false;
-	}
+	asn = p11_asn1_create (persist->asn1_defs, "BASIC.ObjectIdentifier");
+	return_val_if_fail (asn != NULL, false);
 
 	ret = asn1_write_value (asn, "", value, 1);
 	if (ret == ASN1_VALUE_NOT_VALID) {
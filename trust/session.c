@@ -57,6 +57,19 @@ p11_session_new (p11_token *token)
 	return_val_if_fail (session != NULL, NULL);
 
 	session->handle = p11_module_next_id ();
+	session->token = token;
+
+	/* The session index is created when the first object is */
+	return session;
+}
+
+p11_index *
+p11_session_index (p11_session *session)
+{
+	assert (session != NULL);
+
+	if (session->index)
+		return session->index;
 
 	session->builder = p11_builder_new (P11_BUILDER_FLAG_NONE);
 	return_val_if_fail (session->builder, NULL);
@@ -64,11 +77,15 @@ p11_session_new (p11_token *token)
 	session->index = p11_index_new (p11_builder_build,
 	                                p11_builder_changed,
 	                                session->builder);
-	return_val_if_fail (session->index != NULL, NULL);
+	if (session->index == NULL) {
+		p11_builder_free (session->builder);
+		session->builder = NULL;
+		return_val_if_reached (NULL);
+	}
 
-	session->token = token;
+	p11_index_set_flush (session->index, p11_builder_flush);
 
-	return session;
+	return session->index;
 }
 
 void
@@ -77,8 +94,10 @@ p11_session_free (void *data)
 	p11_session *session = data;
 
 	p11_session_set_operation (session, NULL, NULL);
-	p11_builder_free (session->builder);
-	p11_index_free (session->index);
+	if (session->builder)
+		p11_builder_free (session->builder);
+	if (session->index)
+		p11_index_free (session->index);
 
 	free (session);
 }
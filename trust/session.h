@@ -44,10 +44,11 @@ typedef void (* p11_session_cleanup) (void *data);
 
 typedef struct {
 	CK_SESSION_HANDLE handle;
+
+	/* NULL until the first session object is created */
 	p11_index *index;
 	p11_builder *builder;
 	p11_token *token;
-	CK_BBOOL loaded;
 
 	/* Used by various operations */
 	p11_session_cleanup cleanup;
@@ -58,6 +59,8 @@ p11_session *     p11_session_new           (p11_token *token);
 
 void              p11_session_free          (void *data);
 
+p11_index *       p11_session_index         (p11_session *session);
+
 void              p11_session_set_operation (p11_session *session,
                                              p11_session_cleanup cleanup,
                                              void *operation);
@@ -0,0 +1,223 @@
+/*
+ * Copyright (c) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#define CRYPTOKI_EXPORTS
+
+#include "config.h"
+#include "compat.h"
+#include "debug.h"
+#include "pkcs11.h"
+
+#include <sys/time.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/*
+ * Measures how certificate lookups in the trust module scale with the
+ * number of threads doing them. Each thread repeatedly finds a
+ * certificate by its subject and retrieves its value, in its own session.
+ */
+
+static CK_FUNCTION_LIST *module;
+static CK_SLOT_ID slot;
+static CK_BYTE subject[4096];
+static CK_ULONG subject_len;
+static long count;
+
+static double
+now (void)
+{
+	struct timeval tv;
+	gettimeofday (&tv, NULL);
+	return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+static CK_RV
+lookup (CK_SESSION_HANDLE session,
+        CK_ATTRIBUTE *match,
+        CK_ULONG count)
+{
+	CK_BYTE value[16384];
+	CK_ATTRIBUTE attr = { CKA_VALUE, value, sizeof (value) };
+	CK_OBJECT_HANDLE objects[8];
+	CK_ULONG found;
+	CK_ULONG i;
+	CK_RV rv;
+
+	rv = module->C_FindObjectsInit (session, match, count);
+	if (rv != CKR_OK)
+		return rv;
+
+	rv = module->C_FindObjects (session, objects, 8, &found);
+	for (i = 0; rv == CKR_OK && i < found; i++) {
+		attr.ulValueLen = sizeof (value);
+		rv = module->C_GetAttributeValue (session, objects[i], &attr, 1);
+	}
+
+	module->C_FindObjectsFinal (session);
+	return rv;
+}
+
+static void *
+lookup_thread (void *data)
+{
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_SUBJECT, subject, subject_len },
+	};
+
+	CK_SESSION_HANDLE session;
+	CK_RV rv;
+	long i;
+
+	rv = module->C_OpenSession (slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	return_val_if_fail (rv == CKR_OK, NULL);
+
+	for (i = 0; i < count; i++) {
+		rv = lookup (session, match, 2);
+		return_val_if_fail (rv == CKR_OK, NULL);
+	}
+
+	module->C_CloseSession (session);
+	return NULL;
+}
+
+static CK_RV
+first_subject (void)
+{
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_ATTRIBUTE match = { CKA_CLASS, &klass, sizeof (klass) };
+	CK_ATTRIBUTE attr = { CKA_SUBJECT, subject, sizeof (subject) };
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE object;
+	CK_ULONG found;
+	CK_RV rv;
+
+	rv = module->C_OpenSession (slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+	return_val_if_fail (rv == CKR_OK, rv);
+
+	rv = module->C_FindObjectsInit (session, &match, 1);
+	if (rv == CKR_OK)
+		rv = module->C_FindObjects (session, &object, 1, &found);
+	if (rv == CKR_OK && found != 1)
+		rv = CKR_OBJECT_HANDLE_INVALID;
+	module->C_FindObjectsFinal (session);
+
+	if (rv == CKR_OK)
+		rv = module->C_GetAttributeValue (session, object, &attr, 1);
+	subject_len = attr.ulValueLen;
+
+	module->C_CloseSession (session);
+	return rv;
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	CK_C_INITIALIZE_ARGS args;
+	p11_thread_t *threads;
+	CK_ULONG num;
+	char *arguments;
+	double start;
+	double secs;
+	int max_threads;
+	int nthreads;
+	int i;
+	CK_RV rv;
+
+	if (argc < 2 || argc > 4) {
+		fprintf (stderr, "usage: frob-lookups path [threads] [count]\n");
+		return 2;
+	}
+
+	max_threads = argc >= 3 ? atoi (argv[2]) : 8;
+	count = argc >= 4 ? atol (argv[3]) : 10000;
+	if (max_threads < 1 || count < 1) {
+		fprintf (stderr, "frob-lookups: invalid threads or count\n");
+		return 2;
+	}
+
+	rv = C_GetFunctionList (&module);
+	return_val_if_fail (rv == CKR_OK, 1);
+
+	memset (&args, 0, sizeof (args));
+	if (asprintf (&arguments, "paths='%s'", argv[1]) < 0)
+		return_val_if_reached (1);
+	args.pReserved = arguments;
+	args.flags = CKF_OS_LOCKING_OK;
+
+	rv = module->C_Initialize (&args);
+	return_val_if_fail (rv == CKR_OK, 1);
+	free (arguments);
+
+	num = 1;
+	rv = module->C_GetSlotList (CK_TRUE, &slot, &num);
+	return_val_if_fail (rv == CKR_OK && num == 1, 1);
+
+	/* Also loads the token, before we start timing */
+	rv = first_subject ();
+	if (rv != CKR_OK) {
+		fprintf (stderr, "frob-lookups: couldn't find a certificate: 0x%lx\n", rv);
+		return 1;
+	}
+
+	threads = calloc (max_threads, sizeof (p11_thread_t));
+	return_val_if_fail (threads != NULL, 1);
+
+	for (nthreads = 1; nthreads <= max_threads; nthreads *= 2) {
+		start = now ();
+
+		for (i = 0; i < nthreads; i++) {
+			if (p11_thread_create (threads + i, lookup_thread, NULL) != 0)
+				return_val_if_reached (1);
+		}
+		for (i = 0; i < nthreads; i++)
+			p11_thread_join (threads[i]);
+
+		secs = now () - start;
+		printf ("%d threads: %ld lookups in %.3f seconds, %.0f lookups per second\n",
+		        nthreads, nthreads * count, secs, secs > 0 ? nthreads * count / secs : 0);
+	}
+
+	free (threads);
+
+	rv = module->C_Finalize (NULL);
+	return_val_if_fail (rv == CKR_OK, 1);
+
+	return 0;
+}
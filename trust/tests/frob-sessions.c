@@ -0,0 +1,110 @@
+/*
+ * Copyright (c) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#define CRYPTOKI_EXPORTS
+
+#include "config.h"
+#include "compat.h"
+#include "debug.h"
+#include "pkcs11.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/*
+ * Measures how many sessions per second the trust module can
+ * open and close. Loads the trust module linked into this program.
+ */
+
+int
+main (int argc,
+      char *argv[])
+{
+	CK_FUNCTION_LIST *module;
+	CK_C_INITIALIZE_ARGS args;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+	CK_ULONG count;
+	char *arguments;
+	clock_t start;
+	double secs;
+	long num;
+	long i;
+	CK_RV rv;
+
+	if (argc < 2 || argc > 3) {
+		fprintf (stderr, "usage: frob-sessions path [count]\n");
+		return 2;
+	}
+
+	num = argc == 3 ? atol (argv[2]) : 100000;
+
+	rv = C_GetFunctionList (&module);
+	return_val_if_fail (rv == CKR_OK, 1);
+
+	memset (&args, 0, sizeof (args));
+	if (asprintf (&arguments, "paths='%s'", argv[1]) < 0)
+		return_val_if_reached (1);
+	args.pReserved = arguments;
+	args.flags = CKF_OS_LOCKING_OK;
+
+	rv = module->C_Initialize (&args);
+	return_val_if_fail (rv == CKR_OK, 1);
+	free (arguments);
+
+	count = 1;
+	rv = module->C_GetSlotList (CK_TRUE, &slot, &count);
+	return_val_if_fail (rv == CKR_OK && count == 1, 1);
+
+	start = clock ();
+
+	for (i = 0; i < num; i++) {
+		rv = module->C_OpenSession (slot, CKF_SERIAL_SESSION, NULL, NULL, &session);
+		return_val_if_fail (rv == CKR_OK, 1);
+		rv = module->C_CloseSession (session);
+		return_val_if_fail (rv == CKR_OK, 1);
+	}
+
+	secs = (double)(clock () - start) / CLOCKS_PER_SEC;
+	printf ("%ld sessions opened and closed in %.3f seconds\n", num, secs);
+	if (secs > 0)
+		printf ("%.0f sessions per second\n", num / secs);
+
+	rv = module->C_Finalize (NULL);
+	return_val_if_fail (rv == CKR_OK, 1);
+
+	return 0;
+}
@@ -79,6 +79,7 @@ setup (void *unused)
 
 	test.index = p11_index_new (p11_builder_build, p11_builder_changed, test.builder);
 	assert_ptr_not_null (test.index);
+	p11_index_set_flush (test.index, p11_builder_flush);
 }
 
 static void
@@ -1581,6 +1582,148 @@ test_changed_staple_ku (void)
 	test_check_attrs (nss_trust_ds_and_np, attrs);
 }
 
+static int nss_trust_built = 0;
+static int changes_notified = 0;
+static int flushes = 0;
+
+static CK_RV
+on_build_count (void *data,
+                p11_index *index,
+                CK_ATTRIBUTE **attrs,
+                CK_ATTRIBUTE *merge)
+{
+	CK_OBJECT_CLASS klass;
+	CK_RV rv;
+
+	rv = p11_builder_build (data, index, attrs, merge);
+	if (rv == CKR_OK && p11_attrs_find_ulong (*attrs, CKA_CLASS, &klass) &&
+	    klass == CKO_NSS_TRUST)
+		nss_trust_built++;
+
+	return rv;
+}
+
+static void
+on_changed_count (void *data,
+                  p11_index *index,
+                  CK_OBJECT_HANDLE handle,
+                  CK_ATTRIBUTE *attrs)
+{
+	changes_notified++;
+	p11_builder_changed (data, index, handle, attrs);
+}
+
+static void
+on_flush_count (void *data,
+                p11_index *index)
+{
+	flushes++;
+	p11_builder_flush (data, index);
+}
+
+static void
+test_changed_rebuilt_once (void)
+{
+	static unsigned char eku_server_and_client[] = {
+		0x30, 0x14, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x01, 0x06, 0x08, 0x2b, 0x06,
+		0x01, 0x05, 0x05, 0x07, 0x03, 0x02,
+	};
+
+	static unsigned char eku_client_email[] = {
+		0x30, 0x0a, 0x06, 0x08, 0x2b, 0x06, 0x01, 0x05, 0x05, 0x07, 0x03, 0x04,
+	};
+
+	static unsigned char ku_ca[] = {
+		0x03, 0x03, 0x07, 0x06, 0x00,
+	};
+
+	CK_ATTRIBUTE cert[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_CERTIFICATE_TYPE, &x509, sizeof (x509) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_TRUSTED, &truev, sizeof (truev) },
+		{ CKA_ID, NULL, 0 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE eku[] = {
+		{ CKA_CLASS, &certificate_extension, sizeof (certificate_extension), },
+		{ CKA_OBJECT_ID, (void *)P11_OID_EXTENDED_KEY_USAGE, sizeof (P11_OID_EXTENDED_KEY_USAGE) },
+		{ CKA_VALUE, eku_server_and_client, sizeof (eku_server_and_client) },
+		{ CKA_ID, NULL, 0 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE reject[] = {
+		{ CKA_CLASS, &certificate_extension, sizeof (certificate_extension), },
+		{ CKA_OBJECT_ID, (void *)P11_OID_OPENSSL_REJECT, sizeof (P11_OID_OPENSSL_REJECT) },
+		{ CKA_VALUE, eku_client_email, sizeof (eku_client_email) },
+		{ CKA_ID, NULL, 0 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE ku[] = {
+		{ CKA_CLASS, &certificate_extension, sizeof (certificate_extension), },
+		{ CKA_OBJECT_ID, (void *)P11_OID_KEY_USAGE, sizeof (P11_OID_KEY_USAGE) },
+		{ CKA_VALUE, ku_ca, sizeof (ku_ca) },
+		{ CKA_ID, NULL, 0 },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &nss_trust, sizeof (nss_trust) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE *objects[] = { cert, eku, reject, ku, NULL };
+	CK_ATTRIBUTE *attr;
+	p11_index *index;
+	char id[16];
+	CK_RV rv;
+	int i, j;
+
+	index = p11_index_new (on_build_count, on_changed_count, test.builder);
+	assert_ptr_not_null (index);
+	p11_index_set_flush (index, on_flush_count);
+
+	/*
+	 * Each certificate is touched by itself and by its key usage extensions,
+	 * but its compat objects are only built once, when the batch finishes.
+	 */
+	nss_trust_built = changes_notified = flushes = 0;
+	p11_index_batch (index);
+	for (i = 0; i < 100; i++) {
+		snprintf (id, sizeof (id), "cert-%d", i);
+		for (j = 0; objects[j] != NULL; j++) {
+			attr = p11_attrs_find (objects[j], CKA_ID);
+			attr->pValue = id;
+			attr->ulValueLen = strlen (id);
+			rv = p11_index_take (index, p11_attrs_dup (objects[j]), NULL);
+			assert_num_eq (CKR_OK, rv);
+		}
+	}
+	assert_num_eq (0, changes_notified);
+	assert_num_eq (0, nss_trust_built);
+	p11_index_finish (index);
+
+	assert_num_eq (400, changes_notified);
+	assert_num_eq (1, flushes);
+	assert_num_eq (100, nss_trust_built);
+	assert (p11_index_find (index, match, -1) != 0);
+
+	/* A change outside of a batch is built right away */
+	attr = p11_attrs_find (eku, CKA_ID);
+	attr->pValue = "cert-0";
+	attr->ulValueLen = 6;
+	rv = p11_index_take (index, p11_attrs_dup (eku), NULL);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (401, changes_notified);
+	assert_num_eq (2, flushes);
+	assert_num_eq (101, nss_trust_built);
+
+	p11_index_free (index);
+}
+
 int
 main (int argc,
       char *argv[])
@@ -1617,5 +1760,6 @@ main (int argc,
 	p11_test (test_changed_staple_ca, "/builder/changed_staple_ca");
 	p11_test (test_changed_staple_ku, "/builder/changed_staple_ku");
 	p11_test (test_changed_dup_certificates, "/builder/changed_dup_certificates");
+	p11_test (test_changed_rebuilt_once, "/builder/changed_rebuilt_once");
 	return p11_test_run (argc, argv);
 }
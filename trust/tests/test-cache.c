@@ -0,0 +1,383 @@
+/*
+ * Copyright (C) 2013 Red Hat Inc.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ *     * Redistributions of source code must retain the above
+ *       copyright notice, this list of conditions and the
+ *       following disclaimer.
+ *     * Redistributions in binary form must reproduce the
+ *       above copyright notice, this list of conditions and
+ *       the following disclaimer in the documentation and/or
+ *       other materials provided with the distribution.
+ *     * The names of contributors to this software may not be
+ *       used to endorse or promote products derived from this
+ *       software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+ * "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+ * LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS
+ * FOR A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE
+ * COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING,
+ * BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS
+ * OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED
+ * AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY,
+ * OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF
+ * THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH
+ * DAMAGE.
+ *
+ * Author: Stef Walter <stefw@redhat.com>
+ */
+
+#include "config.h"
+#include "test.h"
+#include "test-trust.h"
+
+#include "attrs.h"
+#include "cache.h"
+#include "parser.h"
+#include "path.h"
+#include "pkcs11x.h"
+#include "token.h"
+
+#include <sys/stat.h>
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+struct {
+	char *directory;
+	struct stat sb;
+	p11_array *objects;
+} test;
+
+static void
+setup (void *unused)
+{
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_BBOOL vtrue = CK_TRUE;
+
+	CK_ATTRIBUTE cacert3[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_LABEL, "", 0 },
+		{ CKA_TRUSTED, &vtrue, sizeof (vtrue) },
+		{ CKA_INVALID },
+	};
+
+	test.directory = p11_path_expand ("$TEMP/test-cache.XXXXXX");
+	if (!mkdtemp (test.directory))
+		assert_fail ("mkdtemp() failed", strerror (errno));
+
+	memset (&test.sb, 0, sizeof (test.sb));
+	test.sb.st_ino = 5;
+	test.sb.st_size = 100;
+	test.sb.st_mtime = 1000;
+
+	test.objects = p11_array_new (p11_attrs_free);
+	assert_ptr_not_null (test.objects);
+	if (!p11_array_push (test.objects, p11_attrs_dup (cacert3)))
+		assert_not_reached ();
+}
+
+static void
+teardown (void *unused)
+{
+	struct dirent *dp;
+	char *path;
+	DIR *dir;
+
+	dir = opendir (test.directory);
+	assert_ptr_not_null (dir);
+
+	while ((dp = readdir (dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		path = p11_path_build (test.directory, dp->d_name, NULL);
+		if (unlink (path) < 0)
+			assert_fail ("unlink() failed", strerror (errno));
+		free (path);
+	}
+
+	closedir (dir);
+
+	if (rmdir (test.directory) < 0)
+		assert_fail ("rmdir() failed", strerror (errno));
+	free (test.directory);
+	p11_array_free (test.objects);
+}
+
+static char *
+cache_file (void)
+{
+	struct dirent *dp;
+	char *path = NULL;
+	DIR *dir;
+
+	dir = opendir (test.directory);
+	assert_ptr_not_null (dir);
+
+	while ((dp = readdir (dir)) != NULL) {
+		if (dp->d_name[0] == '.')
+			continue;
+		assert (path == NULL);
+		path = p11_path_build (test.directory, dp->d_name, NULL);
+	}
+
+	closedir (dir);
+	assert_ptr_not_null (path);
+	return path;
+}
+
+static void
+store_and_write (void)
+{
+	p11_cache *cache;
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert_ptr_not_null (cache);
+
+	p11_cache_store (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                 P11_PARSE_SUCCESS, test.objects);
+
+	assert (p11_cache_write (cache));
+	p11_cache_free (cache);
+}
+
+static void
+test_lookup (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	CK_ATTRIBUTE *attrs;
+	int result;
+
+	store_and_write ();
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert_ptr_not_null (cache);
+
+	assert (p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                          &result, &parsed));
+	assert_num_eq (P11_PARSE_SUCCESS, result);
+	assert_num_eq (1, parsed->num);
+
+	attrs = parsed->elem[0];
+	assert_num_eq (p11_attrs_count (test.objects->elem[0]), p11_attrs_count (attrs));
+	test_check_attrs (test.objects->elem[0], attrs);
+
+	p11_array_free (parsed);
+	p11_cache_free (cache);
+}
+
+static void
+test_unrecognized (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	int result;
+
+	cache = p11_cache_new (test.directory, "/source");
+	p11_cache_store (cache, "/source/file", &test.sb, P11_PARSE_FLAG_NONE,
+	                 P11_PARSE_UNRECOGNIZED, NULL);
+	assert (p11_cache_write (cache));
+	p11_cache_free (cache);
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert (p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_NONE,
+	                          &result, &parsed));
+	assert_num_eq (P11_PARSE_UNRECOGNIZED, result);
+	assert_num_eq (0, parsed->num);
+
+	p11_array_free (parsed);
+	p11_cache_free (cache);
+}
+
+static void
+test_stale (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	struct stat sb;
+	int result;
+
+	store_and_write ();
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert_ptr_not_null (cache);
+
+	memcpy (&sb, &test.sb, sizeof (sb));
+	sb.st_mtime = 1001;
+	assert (!p11_cache_lookup (cache, "/source/file", &sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+
+	memcpy (&sb, &test.sb, sizeof (sb));
+	sb.st_size = 101;
+	assert (!p11_cache_lookup (cache, "/source/file", &sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+
+	memcpy (&sb, &test.sb, sizeof (sb));
+	sb.st_ino = 6;
+	assert (!p11_cache_lookup (cache, "/source/file", &sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+
+	assert (!p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_BLACKLIST,
+	                           &result, &parsed));
+	assert (!p11_cache_lookup (cache, "/source/other", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+
+	p11_cache_free (cache);
+}
+
+static void
+test_recently_modified (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	int result;
+
+	/* Can't tell whether such a file changes again in the same second */
+	test.sb.st_mtime = time (NULL);
+	store_and_write ();
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert (!p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+	p11_cache_free (cache);
+}
+
+static void
+test_drop_unused (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	int result;
+
+	store_and_write ();
+
+	/* Nothing looked up, so the entry is dropped */
+	cache = p11_cache_new (test.directory, "/source");
+	assert (p11_cache_write (cache));
+	p11_cache_free (cache);
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert (!p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+	p11_cache_free (cache);
+}
+
+static void
+test_truncated (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	struct stat sb;
+	char *path;
+	int result;
+
+	store_and_write ();
+
+	path = cache_file ();
+	assert (stat (path, &sb) >= 0);
+	assert (truncate (path, sb.st_size - 10) >= 0);
+	free (path);
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert (!p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+	p11_cache_free (cache);
+}
+
+static void
+test_other_writable (void)
+{
+	p11_array *parsed;
+	p11_cache *cache;
+	char *path;
+	int result;
+
+	store_and_write ();
+
+	path = cache_file ();
+	assert (chmod (path, 0666) >= 0);
+	free (path);
+
+	cache = p11_cache_new (test.directory, "/source");
+	assert (!p11_cache_lookup (cache, "/source/file", &test.sb, P11_PARSE_FLAG_ANCHOR,
+	                           &result, &parsed));
+	p11_cache_free (cache);
+}
+
+static void
+test_token (void)
+{
+	CK_ATTRIBUTE match = { CKA_INVALID, };
+	CK_OBJECT_HANDLE *handles;
+	p11_token *token;
+	p11_token *cached;
+	p11_array *parsed;
+	p11_cache *cache;
+	CK_ATTRIBUTE *attrs;
+	struct stat sb;
+	int result;
+	int i;
+
+	parsed = NULL;
+	token = p11_token_new (333, SRCDIR "/input", "Label");
+	p11_token_set_cache (token, test.directory);
+	assert_num_eq (7, p11_token_load (token));
+
+	/* The unchanged files are now in the cache */
+	cache = p11_cache_new (test.directory, SRCDIR "/input");
+	assert (stat (SRCDIR "/input/cacert-ca.der", &sb) >= 0);
+	assert (p11_cache_lookup (cache, SRCDIR "/input/cacert-ca.der", &sb,
+	                          P11_PARSE_FLAG_NONE, &result, &parsed) ||
+	        sb.st_mtime >= time (NULL) - 1);
+	p11_array_free (parsed);
+	p11_cache_free (cache);
+
+	/* And loading from the cache results in the same objects */
+	cached = p11_token_new (333, SRCDIR "/input", "Label");
+	p11_token_set_cache (cached, test.directory);
+	assert_num_eq (7, p11_token_load (cached));
+
+	assert_num_eq (p11_index_size (p11_token_index (token)),
+	               p11_index_size (p11_token_index (cached)));
+
+	handles = p11_index_find_all (p11_token_index (token), &match, 0);
+	assert_ptr_not_null (handles);
+
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (p11_token_index (token), handles[i]);
+		assert (p11_index_find (p11_token_index (cached), attrs, -1) != 0);
+	}
+
+	free (handles);
+	p11_token_free (cached);
+	p11_token_free (token);
+}
+
+int
+main (int argc,
+      char *argv[])
+{
+	p11_fixture (setup, teardown);
+	p11_test (test_lookup, "/cache/lookup");
+	p11_test (test_unrecognized, "/cache/unrecognized");
+	p11_test (test_stale, "/cache/stale");
+	p11_test (test_recently_modified, "/cache/recently-modified");
+	p11_test (test_drop_unused, "/cache/drop-unused");
+	p11_test (test_truncated, "/cache/truncated");
+	p11_test (test_other_writable, "/cache/other-writable");
+	p11_test (test_token, "/cache/token");
+	return p11_test_run (argc, argv);
+}
@@ -112,6 +112,58 @@ test_add_lookup (void)
 	test_check_attrs (original, check);
 }
 
+static void
+test_load_borrowed (void)
+{
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE update[] = {
+		{ CKA_LABEL, "boo", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE *check;
+	CK_ATTRIBUTE *value;
+	CK_OBJECT_HANDLE handle;
+	CK_RV rv;
+
+	/* Only the array belongs to the index, the values are used in place */
+	rv = p11_index_load (test.index, memdup (original, sizeof (original)), &handle);
+	assert (rv == CKR_OK);
+	check = p11_index_lookup (test.index, handle);
+	test_check_attrs (original, check);
+	value = p11_attrs_find_valid (check, CKA_VALUE);
+	assert_ptr_eq (original[1].pValue, value->pValue);
+
+	/* Changing the object gives it its own values */
+	rv = p11_index_update (test.index, handle, p11_attrs_dup (update));
+	assert (rv == CKR_OK);
+	check = p11_index_lookup (test.index, handle);
+	test_check_attr (update, p11_attrs_find_valid (check, CKA_LABEL));
+	value = p11_attrs_find_valid (check, CKA_VALUE);
+	assert (value->pValue != original[1].pValue);
+
+	/* Neither unloading nor removing frees the borrowed values */
+	rv = p11_index_load (test.index, memdup (original, sizeof (original)), &handle);
+	assert (rv == CKR_OK);
+	rv = p11_index_unload (test.index, handle);
+	assert (rv == CKR_OK);
+
+	rv = p11_index_load (test.index, memdup (original, sizeof (original)), &handle);
+	assert (rv == CKR_OK);
+	rv = p11_index_remove (test.index, handle);
+	assert (rv == CKR_OK);
+
+	/* And the rest are freed along with the index */
+	rv = p11_index_load (test.index, memdup (original, sizeof (original)), &handle);
+	assert (rv == CKR_OK);
+	assert_num_eq (2, p11_index_size (test.index));
+}
+
 static void
 test_size (void)
 {
@@ -247,6 +299,60 @@ test_remove (void)
 	assert_ptr_eq (NULL, check);
 }
 
+static void
+test_pack (void)
+{
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE change = { CKA_LABEL, "naay", 4 };
+
+	CK_ATTRIBUTE changed[] = {
+		{ CKA_LABEL, "naay", 4 },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE *attrs;
+	CK_ATTRIBUTE *check;
+	CK_OBJECT_HANDLE handle;
+	CK_RV rv;
+
+	p11_index_batch (test.index);
+
+	attrs = p11_attrs_dup (original);
+	rv = p11_index_take (test.index, attrs, &handle);
+	assert (rv == CKR_OK);
+
+	p11_index_finish (test.index);
+
+	/* Packed with the values after the attributes */
+	check = p11_index_lookup (test.index, handle);
+	test_check_attrs (original, check);
+	assert_ptr_eq (check + 3, check[0].pValue);
+	assert_ptr_eq ((char *)check[0].pValue + P11_ATTR_VALUE_ALIGN (3), check[1].pValue);
+
+	/* Still possible to change it afterwards */
+	p11_index_batch (test.index);
+	attrs = p11_attrs_build (NULL, &change, NULL);
+	rv = p11_index_update (test.index, handle, attrs);
+	assert (rv == CKR_OK);
+	p11_index_finish (test.index);
+
+	check = p11_index_lookup (test.index, handle);
+	test_check_attrs (changed, check);
+	assert_ptr_eq (check + 3, check[0].pValue);
+
+	rv = p11_index_remove (test.index, handle);
+	assert (rv == CKR_OK);
+
+	check = p11_index_lookup (test.index, handle);
+	assert_ptr_eq (NULL, check);
+}
+
 static void
 test_set (void)
 {
@@ -541,6 +647,604 @@ test_find_realloc (void)
 	free (check);
 }
 
+static void
+test_find_resize (void)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 10000;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE check;
+	CK_RV rv;
+	int next;
+	int i;
+
+	handles = calloc (NUM, sizeof (CK_OBJECT_HANDLE));
+	assert_ptr_not_null (handles);
+
+	/* Lookups while the index is growing, and being rehashed */
+	for (i = 0; i < NUM; i++) {
+		attrs[1].pValue = &i;
+		rv = p11_index_add (test.index, attrs, 2, handles + i);
+		assert_num_eq (CKR_OK, rv);
+
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (handles[i], check);
+	}
+
+	for (i = 0; i < NUM; i++) {
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (handles[i], check);
+	}
+
+	/* Lookups while the index is shrinking */
+	for (i = 0; i < NUM; i++) {
+		rv = p11_index_remove (test.index, handles[i]);
+		assert_num_eq (CKR_OK, rv);
+
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (0, check);
+
+		next = i + 1;
+		if (next < NUM) {
+			match[0].pValue = &next;
+			check = p11_index_find (test.index, match, -1);
+			assert_num_eq (handles[next], check);
+		}
+	}
+
+	assert_num_eq (0, p11_index_size (test.index));
+	free (handles);
+}
+
+static void
+test_find_filtered (void)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 1000;
+	p11_index_filter_stats stats;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE check;
+	p11_index_iter *iter;
+	CK_RV rv;
+	int i;
+
+	handles = calloc (NUM, sizeof (CK_OBJECT_HANDLE));
+	assert_ptr_not_null (handles);
+
+	p11_index_batch (test.index);
+	for (i = 0; i < NUM; i++) {
+		attrs[1].pValue = &i;
+		rv = p11_index_add (test.index, attrs, 2, handles + i);
+		assert_num_eq (CKR_OK, rv);
+	}
+	p11_index_finish (test.index);
+
+	/* Everything that's there is found */
+	for (i = 0; i < NUM; i++) {
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (handles[i], check);
+	}
+
+	p11_index_get_filter_stats (test.index, &stats);
+	assert_num_eq (NUM, stats.lookups);
+	assert_num_eq (0, stats.rejected);
+	assert_num_eq (0, stats.false_positives);
+
+	/* And most of what isn't there is ruled out by the filters */
+	for (i = NUM; i < NUM * 2; i++) {
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (0, check);
+	}
+
+	p11_index_get_filter_stats (test.index, &stats);
+	assert_num_eq (NUM * 2, stats.lookups);
+	assert_num_eq (NUM, stats.rejected + stats.false_positives);
+	assert (stats.false_positives < NUM / 20);
+
+	/* Same when iterating */
+	i = NUM * 2;
+	match[0].pValue = &i;
+	iter = p11_index_iter_new (test.index, match, 1);
+	assert_ptr_not_null (iter);
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	p11_index_get_filter_stats (test.index, &stats);
+	assert_num_eq (NUM * 2 + 1, stats.lookups);
+
+	/* Removed values are still found to be gone */
+	for (i = 0; i < NUM; i += 2) {
+		rv = p11_index_remove (test.index, handles[i]);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	for (i = 0; i < NUM; i++) {
+		match[0].pValue = &i;
+		check = p11_index_find (test.index, match, -1);
+		assert_num_eq (i % 2 ? handles[i] : 0, check);
+	}
+
+	free (handles);
+}
+
+static void
+test_find_selective (void)
+{
+	CK_OBJECT_CLASS klass = CKO_DATA;
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_VALUE, "value", 5 },
+		{ CKA_OBJECT_ID, "oid", 3 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	/* The selective attribute last, more indexed attributes than are selected */
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_VALUE, "value", 5 },
+		{ CKA_OBJECT_ID, "oid", 3 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_none[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_VALUE, "value", 5 },
+		{ CKA_OBJECT_ID, "other", 5 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 1000;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE *check;
+	CK_RV rv;
+	int i;
+
+	handles = calloc (NUM, sizeof (CK_OBJECT_HANDLE));
+	assert_ptr_not_null (handles);
+
+	for (i = 0; i < NUM; i++) {
+		attrs[3].pValue = &i;
+		rv = p11_index_add (test.index, attrs, 4, handles + i);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	for (i = 0; i < NUM; i++) {
+		match[3].pValue = &i;
+		check = p11_index_find_all (test.index, match, -1);
+		assert (handles_are (check, handles[i], 0UL));
+		free (check);
+
+		match_none[3].pValue = &i;
+		assert_num_eq (0, p11_index_find (test.index, match_none, -1));
+	}
+
+	free (handles);
+}
+
+static void
+test_set_indexed (void)
+{
+	CK_ATTRIBUTE first[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_SUBJECT, "one", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE second[] = {
+		{ CKA_LABEL, "even", 4 },
+		{ CKA_SUBJECT, "two", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_subject[] = {
+		{ CKA_SUBJECT, "two", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_label[] = {
+		{ CKA_LABEL, "odd", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE_TYPE types[] = {
+		CKA_SUBJECT,
+		CKA_LABEL,
+	};
+
+	CK_OBJECT_HANDLE one;
+	CK_OBJECT_HANDLE two;
+	CK_OBJECT_HANDLE three;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE check;
+	CK_RV rv;
+
+	rv = p11_index_add (test.index, first, 2, &one);
+	assert_num_eq (CKR_OK, rv);
+
+	/* Objects already in the index are indexed again */
+	p11_index_set_indexed (test.index, types, 2);
+
+	rv = p11_index_add (test.index, second, 2, &two);
+	assert_num_eq (CKR_OK, rv);
+
+	check = p11_index_find (test.index, match_subject, -1);
+	assert_num_eq (two, check);
+
+	check = p11_index_find (test.index, match_label, -1);
+	assert_num_eq (one, check);
+
+	/* And updated objects too */
+	rv = p11_index_set (test.index, two, match_label, 1);
+	assert_num_eq (CKR_OK, rv);
+
+	check = p11_index_find (test.index, match_subject, -1);
+	assert_num_eq (two, check);
+
+	handles = p11_index_find_all (test.index, match_label, -1);
+	assert (handles_are (handles, one, two, 0UL));
+	free (handles);
+
+	rv = p11_index_remove (test.index, one);
+	assert_num_eq (CKR_OK, rv);
+
+	handles = p11_index_find_all (test.index, match_label, -1);
+	assert (handles_are (handles, two, 0UL));
+	free (handles);
+
+	/* Nothing indexed, every lookup scans */
+	p11_index_set_indexed (test.index, NULL, 0);
+
+	rv = p11_index_add (test.index, first, 2, &three);
+	assert_num_eq (CKR_OK, rv);
+
+	handles = p11_index_find_all (test.index, match_label, -1);
+	assert (handles_are (handles, two, three, 0UL));
+	free (handles);
+}
+
+static void
+test_iter (void)
+{
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_none[] = {
+		{ CKA_VALUE, "nine", 4 },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 16;
+	CK_OBJECT_HANDLE expected[NUM];
+	p11_index_iter *iter;
+	int i;
+
+	for (i = 0; i < NUM; i++)
+		p11_index_add (test.index, original, 2, expected + i);
+
+	/* No template, walks all objects */
+	iter = p11_index_iter_new (test.index, NULL, 0);
+	assert_ptr_not_null (iter);
+	for (i = 0; i < NUM; i++)
+		assert_num_eq (expected[i], p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	/* Walks an indexed bucket */
+	iter = p11_index_iter_new (test.index, match, 1);
+	assert_ptr_not_null (iter);
+	for (i = 0; i < NUM; i++)
+		assert_num_eq (expected[i], p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	iter = p11_index_iter_new (test.index, match_none, 1);
+	assert_ptr_not_null (iter);
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+}
+
+static void
+test_iter_serial (void)
+{
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_SERIAL_NUMBER, "\x02\x03\x01\x02\x03", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_der[] = {
+		{ CKA_SERIAL_NUMBER, "\x02\x03\x01\x02\x03", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_decoded[] = {
+		{ CKA_SERIAL_NUMBER, "\x01\x02\x03", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE_TYPE types[] = {
+		CKA_SERIAL_NUMBER,
+	};
+
+	CK_OBJECT_HANDLE handle;
+	p11_index_iter *iter;
+	CK_RV rv;
+
+	p11_index_set_indexed (test.index, types, 1);
+
+	rv = p11_index_add (test.index, original, 2, &handle);
+	assert_num_eq (CKR_OK, rv);
+
+	assert_num_eq (handle, p11_index_find (test.index, match_der, -1));
+
+	/* Both encodings of the serial number select the same bucket */
+	iter = p11_index_iter_new (test.index, match_der, 1);
+	assert_ptr_not_null (iter);
+	assert_num_eq (handle, p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	iter = p11_index_iter_new (test.index, match_decoded, 1);
+	assert_ptr_not_null (iter);
+	assert_num_eq (handle, p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	/* But only the stored encoding matches the attribute */
+	assert_num_eq (0, p11_index_find (test.index, match_decoded, -1));
+}
+
+static void
+test_iter_serial_ambiguous (void)
+{
+	/* The contents of this serial number happen to be DER themselves */
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_SERIAL_NUMBER, "\x02\x03\x02\x01\x05", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match_contents[] = {
+		{ CKA_SERIAL_NUMBER, "\x02\x01\x05", 3 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE_TYPE types[] = {
+		CKA_SERIAL_NUMBER,
+	};
+
+	CK_OBJECT_HANDLE handle;
+	p11_index_iter *iter;
+	CK_RV rv;
+
+	p11_index_set_indexed (test.index, types, 1);
+
+	/* The filters are built at the end of the batch */
+	p11_index_batch (test.index);
+	rv = p11_index_add (test.index, original, 2, &handle);
+	assert_num_eq (CKR_OK, rv);
+	p11_index_finish (test.index);
+
+	/* Looking up the contents still selects the object */
+	iter = p11_index_iter_new (test.index, match_contents, 1);
+	assert_ptr_not_null (iter);
+	assert_num_eq (handle, p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	/* But only the stored encoding matches the attribute */
+	assert_num_eq (0, p11_index_find (test.index, match_contents, -1));
+}
+
+static void
+test_iter_removed (void)
+{
+	CK_ATTRIBUTE original[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 16;
+	CK_OBJECT_HANDLE handles[NUM];
+	CK_OBJECT_HANDLE handle;
+	p11_index_iter *iter;
+	CK_RV rv;
+	int i;
+
+	for (i = 0; i < NUM; i++)
+		p11_index_add (test.index, original, 2, handles + i);
+
+	/* Remove every other object, in a batch and out of one */
+	p11_index_batch (test.index);
+	for (i = 1; i < NUM / 2; i += 2) {
+		rv = p11_index_remove (test.index, handles[i]);
+		assert_num_eq (CKR_OK, rv);
+	}
+	p11_index_finish (test.index);
+	for (; i < NUM; i += 2) {
+		rv = p11_index_remove (test.index, handles[i]);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	iter = p11_index_iter_new (test.index, NULL, 0);
+	assert_ptr_not_null (iter);
+	for (i = 0; i < NUM; i += 2)
+		assert_num_eq (handles[i], p11_index_iter_next (iter));
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	/* Starting to iterate doesn't use up a handle */
+	iter = p11_index_iter_new (test.index, NULL, 0);
+	p11_index_add (test.index, original, 2, &handle);
+	assert_num_eq (handles[NUM - 1] + 1, handle);
+	assert_num_eq (handles[0], p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+}
+
+static void
+test_iter_changed (void)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_LABEL, "yay", 3 },
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 1000;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE handle;
+	p11_index_iter *iters[2];
+	CK_RV rv;
+	int i, j;
+
+	handles = calloc (NUM, sizeof (CK_OBJECT_HANDLE));
+	assert_ptr_not_null (handles);
+
+	for (i = 0; i < NUM; i++) {
+		attrs[1].pValue = &i;
+		rv = p11_index_add (test.index, attrs, 3, handles + i);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	iters[0] = p11_index_iter_new (test.index, NULL, 0);
+	assert_ptr_not_null (iters[0]);
+	iters[1] = p11_index_iter_new (test.index, match, 1);
+	assert_ptr_not_null (iters[1]);
+
+	for (i = 0; i < NUM; i += 2) {
+		for (j = 0; j < 2; j++) {
+			handle = p11_index_iter_next (iters[j]);
+			assert_num_eq (handles[i], handle);
+		}
+
+		/* Added objects are not seen, and make the index grow */
+		for (j = 0; j < 10; j++) {
+			rv = p11_index_add (test.index, attrs, 3, NULL);
+			assert_num_eq (CKR_OK, rv);
+		}
+
+		/* Removed objects are skipped */
+		if (i + 1 < NUM) {
+			rv = p11_index_remove (test.index, handles[i + 1]);
+			assert_num_eq (CKR_OK, rv);
+		}
+	}
+
+	for (j = 0; j < 2; j++) {
+		assert_num_eq (0, p11_index_iter_next (iters[j]));
+		p11_index_iter_free (iters[j]);
+	}
+
+	free (handles);
+}
+
+static void
+test_iter_rehash (void)
+{
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE other[] = {
+		{ CKA_ID, NULL, sizeof (int) },
+		{ CKA_VALUE, NULL, sizeof (int) },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_VALUE, "eight", 5 },
+		{ CKA_INVALID }
+	};
+
+	static const int NUM = 200;
+	CK_OBJECT_HANDLE *handles;
+	CK_OBJECT_HANDLE handle;
+	p11_index_iter *iter;
+	int added = NUM;
+	CK_RV rv;
+	int i, j;
+
+	handles = calloc (NUM, sizeof (CK_OBJECT_HANDLE));
+	assert_ptr_not_null (handles);
+
+	for (i = 0; i < NUM; i++) {
+		attrs[0].pValue = &i;
+		rv = p11_index_add (test.index, attrs, 2, handles + i);
+		assert_num_eq (CKR_OK, rv);
+	}
+
+	iter = p11_index_iter_new (test.index, match, 1);
+	assert_ptr_not_null (iter);
+
+	for (i = 0; i < NUM; i++) {
+		handle = p11_index_iter_next (iter);
+		assert_num_eq (handles[i], handle);
+
+		/*
+		 * Objects that don't match make the index grow, and the
+		 * buckets being walked get moved while it is rehashed.
+		 */
+		for (j = 0; j < 5; j++, added++) {
+			other[0].pValue = &added;
+			other[1].pValue = &added;
+			rv = p11_index_add (test.index, other, 2, NULL);
+			assert_num_eq (CKR_OK, rv);
+		}
+	}
+
+	assert_num_eq (0, p11_index_iter_next (iter));
+	p11_index_iter_free (iter);
+
+	free (handles);
+}
+
 static void
 test_replace_all (void)
 {
@@ -989,8 +1693,10 @@ main (int argc,
 	p11_fixture (setup, teardown);
 	p11_test (test_add_lookup, "/index/add_lookup");
 	p11_test (test_take_lookup, "/index/take_lookup");
+	p11_test (test_load_borrowed, "/index/load_borrowed");
 	p11_test (test_size, "/index/size");
 	p11_test (test_remove, "/index/remove");
+	p11_test (test_pack, "/index/pack");
 	p11_test (test_snapshot, "/index/snapshot");
 	p11_test (test_snapshot_base, "/index/snapshot_base");
 	p11_test (test_set, "/index/set");
@@ -998,6 +1704,16 @@ main (int argc,
 	p11_test (test_find, "/index/find");
 	p11_test (test_find_all, "/index/find_all");
 	p11_test (test_find_realloc, "/index/find_realloc");
+	p11_test (test_find_resize, "/index/find_resize");
+	p11_test (test_find_filtered, "/index/find_filtered");
+	p11_test (test_find_selective, "/index/find_selective");
+	p11_test (test_set_indexed, "/index/set_indexed");
+	p11_test (test_iter, "/index/iter");
+	p11_test (test_iter_serial, "/index/iter_serial");
+	p11_test (test_iter_serial_ambiguous, "/index/iter_serial_ambiguous");
+	p11_test (test_iter_removed, "/index/iter_removed");
+	p11_test (test_iter_changed, "/index/iter_changed");
+	p11_test (test_iter_rehash, "/index/iter_rehash");
 	p11_test (test_replace_all, "/index/replace_all");
 
 	p11_fixture (NULL, NULL);
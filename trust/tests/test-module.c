@@ -47,6 +47,7 @@
 #include "library.h"
 #include "path.h"
 #include "pkcs11x.h"
+#include "module.h"
 #include "token.h"
 
 #include <assert.h>
@@ -518,6 +519,252 @@ test_find_certificates (void)
 		check_certificate (sessions[i], objects[i]);
 }
 
+static void
+check_attributes (CK_SESSION_HANDLE session,
+                  CK_OBJECT_HANDLE object,
+                  CK_ATTRIBUTE *values)
+{
+	unsigned char value[4096];
+	CK_OBJECT_CLASS klass;
+	CK_RV rv;
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_VALUE, value, sizeof (value) },
+	};
+
+	rv = test.module->C_GetAttributeValue (session, object, attrs, 2);
+	assert_num_eq (CKR_OK, rv);
+
+	assert_num_eq (CKA_CLASS, values[0].type);
+	assert_num_eq (sizeof (klass), values[0].ulValueLen);
+	assert_num_eq (klass, *((CK_OBJECT_CLASS *)values[0].pValue));
+	assert_num_eq (attrs[1].ulValueLen, values[1].ulValueLen);
+	assert (memcmp (value, values[1].pValue, attrs[1].ulValueLen) == 0);
+
+	/* Not an attribute of certificates */
+	assert_ptr_eq (NULL, values[2].pValue);
+	assert_num_eq ((CK_ULONG)-1, values[2].ulValueLen);
+}
+
+static void
+test_find_attributes (void)
+{
+	CK_X_VENDOR_FUNCTION_LIST *vendor;
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_OBJECT_HANDLE objects[16];
+	CK_ATTRIBUTE values[16 * 3];
+	CK_SESSION_HANDLE session;
+	CK_ULONG buffer[2048];
+	CK_ULONG buffer_len;
+	CK_ULONG count;
+	CK_ULONG total;
+	CK_ULONG found;
+	CK_ULONG i;
+	CK_RV rv;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_INVALID, }
+	};
+
+	rv = C_X_GetVendorFunctionList (&vendor);
+	assert_num_eq (CKR_OK, rv);
+
+	rv = test.module->C_OpenSession (test.slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (CKR_OK, rv);
+
+	/* The number of certificates found the usual way */
+	rv = test.module->C_FindObjectsInit (session, match, 1);
+	assert_num_eq (CKR_OK, rv);
+	rv = test.module->C_FindObjects (session, objects, 16, &found);
+	assert_num_eq (CKR_OK, rv);
+	rv = test.module->C_FindObjectsFinal (session);
+	assert_num_eq (CKR_OK, rv);
+	assert (found > 1);
+
+	for (i = 0; i < 16 * 3; i++)
+		values[i].type = (i % 3 == 0) ? CKA_CLASS : (i % 3 == 1) ? CKA_VALUE : CKA_NSS_URL;
+
+	rv = test.module->C_FindObjectsInit (session, match, 1);
+	assert_num_eq (CKR_OK, rv);
+
+	/* No room for the first certificate */
+	buffer_len = 16;
+	rv = (vendor->C_X_FindObjectsAttributes) (test.module, session, objects, 16, &count,
+	                                          values, 3, (CK_BYTE *)buffer, &buffer_len);
+	assert_num_eq (CKR_BUFFER_TOO_SMALL, rv);
+	assert_num_eq (0, count);
+	assert (buffer_len > 16);
+
+	/* Just room for it, and certificates don't have the last attribute */
+	rv = (vendor->C_X_FindObjectsAttributes) (test.module, session, objects, 16, &count,
+	                                          values, 3, (CK_BYTE *)buffer, &buffer_len);
+	assert_num_eq (CKR_ATTRIBUTE_TYPE_INVALID, rv);
+	assert_num_eq (1, count);
+	check_attributes (session, objects[0], values);
+	total = count;
+
+	/* And the rest of them */
+	for (;;) {
+		buffer_len = sizeof (buffer);
+		rv = (vendor->C_X_FindObjectsAttributes) (test.module, session, objects, 16, &count,
+		                                          values, 3, (CK_BYTE *)buffer, &buffer_len);
+		assert (buffer_len <= sizeof (buffer));
+		if (count == 0) {
+			assert_num_eq (CKR_OK, rv);
+			break;
+		}
+		assert_num_eq (CKR_ATTRIBUTE_TYPE_INVALID, rv);
+		for (i = 0; i < count; i++)
+			check_attributes (session, objects[i], values + (i * 3));
+		total += count;
+	}
+
+	assert_num_eq (found, total);
+
+	rv = test.module->C_FindObjectsFinal (session);
+	assert_num_eq (CKR_OK, rv);
+
+	/* Only continues a search */
+	buffer_len = sizeof (buffer);
+	rv = (vendor->C_X_FindObjectsAttributes) (test.module, session, objects, 16, &count,
+	                                          values, 3, (CK_BYTE *)buffer, &buffer_len);
+	assert_num_eq (CKR_OPERATION_NOT_INITIALIZED, rv);
+}
+
+static void
+test_find_attributes_empty (void)
+{
+	CK_X_VENDOR_FUNCTION_LIST *vendor;
+	CK_OBJECT_HANDLE objects[2];
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE handle;
+	CK_ATTRIBUTE values[2];
+	CK_ULONG buffer[64];
+	CK_ULONG buffer_len;
+	CK_ULONG count;
+	CK_RV rv;
+
+	CK_ATTRIBUTE original[] = {
+		{ CKA_CLASS, &data, sizeof (data) },
+		{ CKA_LABEL, "empty", 5 },
+		{ CKA_VALUE, NULL, 0 },
+		{ CKA_INVALID }
+	};
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_VALUE, buffer, sizeof (buffer) },
+	};
+
+	rv = C_X_GetVendorFunctionList (&vendor);
+	assert_num_eq (CKR_OK, rv);
+
+	rv = test.module->C_OpenSession (test.slots[0], CKF_SERIAL_SESSION, NULL, NULL, &session);
+	assert_num_eq (CKR_OK, rv);
+
+	rv = test.module->C_CreateObject (session, original, 3, &handle);
+	assert_num_eq (CKR_OK, rv);
+
+	/* An attribute without a value is there for C_GetAttributeValue() */
+	rv = test.module->C_GetAttributeValue (session, handle, attrs, 1);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (0, attrs[0].ulValueLen);
+
+	/* And the same when finding objects together with their attributes */
+	rv = test.module->C_FindObjectsInit (session, original + 1, 1);
+	assert_num_eq (CKR_OK, rv);
+
+	values[0].type = CKA_VALUE;
+	values[1].type = CKA_VALUE;
+	buffer_len = sizeof (buffer);
+	rv = (vendor->C_X_FindObjectsAttributes) (test.module, session, objects, 2, &count,
+	                                          values, 1, (CK_BYTE *)buffer, &buffer_len);
+	assert_num_eq (CKR_OK, rv);
+	assert_num_eq (1, count);
+	assert_num_eq (handle, objects[0]);
+	assert_num_eq (0, values[0].ulValueLen);
+
+	rv = test.module->C_FindObjectsFinal (session);
+	assert_num_eq (CKR_OK, rv);
+}
+
+static void
+test_find_distrusted (void)
+{
+	CK_OBJECT_CLASS klass = CKO_CERTIFICATE;
+	CK_BBOOL vtrue = CK_TRUE;
+	unsigned char value[4096];
+	unsigned char issuer[1024];
+	unsigned char serial[128];
+	CK_ATTRIBUTE *lookup;
+	CK_ULONG count;
+	CK_RV rv;
+	int i;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &klass, sizeof (klass) },
+		{ CKA_X_DISTRUSTED, &vtrue, sizeof (vtrue) },
+		{ CKA_INVALID, }
+	};
+
+	CK_ATTRIBUTE attrs[] = {
+		{ CKA_VALUE, value, sizeof (value) },
+		{ CKA_ISSUER, issuer, sizeof (issuer) },
+		{ CKA_SERIAL_NUMBER, serial, sizeof (serial) },
+		{ CKA_INVALID, }
+	};
+
+	CK_ATTRIBUTE cacert3[] = {
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_ISSUER, (void *)test_cacert3_ca_issuer, sizeof (test_cacert3_ca_issuer) },
+		{ CKA_SERIAL_NUMBER, (void *)test_cacert3_ca_serial, sizeof (test_cacert3_ca_serial) },
+		{ CKA_INVALID, }
+	};
+
+	CK_OBJECT_HANDLE objects[16];
+	CK_SESSION_HANDLE sessions[16];
+	CK_OBJECT_HANDLE distrusted[16];
+	CK_SESSION_HANDLE distrusted_sessions[16];
+	CK_ULONG num;
+
+	num = find_objects (match, distrusted_sessions, distrusted, 16);
+	assert_num_eq (2, num);
+
+	for (i = 0; i < num; i++) {
+		attrs[0].ulValueLen = sizeof (value);
+		attrs[1].ulValueLen = sizeof (issuer);
+		attrs[2].ulValueLen = sizeof (serial);
+		rv = test.module->C_GetAttributeValue (distrusted_sessions[i], distrusted[i], attrs, 3);
+		assert_num_eq (CKR_OK, rv);
+
+		/* Looked up by value */
+		lookup = p11_attrs_build (NULL, match, match + 1, attrs, NULL);
+		count = find_objects (lookup, sessions, objects, 16);
+		assert_num_eq (1, count);
+		assert_num_eq (distrusted[i], objects[0]);
+		p11_attrs_free (lookup);
+
+		/* Looked up by issuer and serial number */
+		lookup = p11_attrs_build (NULL, match, match + 1, attrs + 1, attrs + 2, NULL);
+		count = find_objects (lookup, sessions, objects, 16);
+		assert_num_eq (1, count);
+		assert_num_eq (distrusted[i], objects[0]);
+		p11_attrs_free (lookup);
+	}
+
+	/* An anchor isn't on the blacklist */
+	lookup = p11_attrs_build (NULL, match, match + 1, cacert3, NULL);
+	count = find_objects (lookup, sessions, objects, 16);
+	assert_num_eq (0, count);
+	p11_attrs_free (lookup);
+
+	lookup = p11_attrs_build (NULL, match, match + 1, cacert3 + 1, cacert3 + 2, NULL);
+	count = find_objects (lookup, sessions, objects, 16);
+	assert_num_eq (0, count);
+	p11_attrs_free (lookup);
+}
+
 static void
 test_find_builtin (void)
 {
@@ -940,6 +1187,9 @@ main (int argc,
 	p11_test (test_close_all_sessions, "/module/close_all_sessions");
 	p11_test (test_find_certificates, "/module/find_certificates");
 	p11_test (test_find_builtin, "/module/find_builtin");
+	p11_test (test_find_attributes, "/module/find_attributes");
+	p11_test (test_find_attributes_empty, "/module/find_attributes_empty");
+	p11_test (test_find_distrusted, "/module/find_distrusted");
 	p11_test (test_lookup_invalid, "/module/lookup_invalid");
 	p11_test (test_remove_token, "/module/remove_token");
 	p11_test (test_setattr_token, "/module/setattr_token");
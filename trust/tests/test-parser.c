@@ -40,13 +40,23 @@
 #include <stdio.h>
 #include <string.h>
 
+#ifdef OS_UNIX
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
 #include "array.h"
 #include "attrs.h"
+#include "buffer.h"
 #include "builder.h"
 #include "debug.h"
 #include "message.h"
 #include "oid.h"
 #include "parser.h"
+#include "path.h"
 #include "pkcs11x.h"
 
 struct {
@@ -147,6 +157,295 @@ test_parse_pem_certificate (void)
 	test_check_attrs (expected, cert);
 }
 
+static void
+test_parse_cached (void)
+{
+	p11_asn1_cache_stats stats;
+	int ret;
+
+	ret = p11_parse_file (test.parser, SRCDIR "/files/cacert3.der",
+	                      P11_PARSE_FLAG_NONE);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+
+	/* The parsed certificate stays in the cache after the file */
+	assert_ptr_not_null (p11_asn1_cache_get (test.cache, "PKIX1.Certificate",
+	                                         test_cacert3_ca_der, sizeof (test_cacert3_ca_der)));
+
+	/* And the same certificate in another file isn't decoded again */
+	ret = p11_parse_file (test.parser, SRCDIR "/files/cacert3.pem",
+	                      P11_PARSE_FLAG_NONE);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+
+	p11_asn1_cache_get_stats (test.cache, &stats);
+	assert_num_eq (2, stats.hits);
+	assert_num_eq (1, stats.misses);
+	assert_num_eq (0, stats.evictions);
+}
+
+static void
+test_parse_pem_preamble (void)
+{
+	p11_buffer buffer;
+	p11_mmap *map;
+	void *data;
+	size_t size;
+	int ret;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	map = p11_mmap_open (SRCDIR "/files/cacert3.pem", &data, &size);
+	assert_ptr_not_null (map);
+
+	/* Comments in front of the PEM are skipped when sniffing the format */
+	p11_buffer_init (&buffer, 0);
+	p11_buffer_add (&buffer, "# A comment\n\n", -1);
+	p11_buffer_add (&buffer, data, size);
+	ret = p11_parse_memory (test.parser, "comment.pem", P11_PARSE_FLAG_NONE,
+	                        buffer.data, buffer.len);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+	assert (p11_index_find (test.index, match, -1) != 0);
+	p11_buffer_uninit (&buffer);
+
+	/* Other text isn't sniffed, but all the formats are tried */
+	p11_buffer_init (&buffer, 0);
+	p11_buffer_add (&buffer, "Certificate:\n    Data:\n", -1);
+	p11_buffer_add (&buffer, data, size);
+	p11_message_quiet ();
+	ret = p11_parse_memory (test.parser, "preamble.pem", P11_PARSE_FLAG_NONE,
+	                        buffer.data, buffer.len);
+	p11_message_loud ();
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+	p11_buffer_uninit (&buffer);
+
+	p11_mmap_close (map);
+}
+
+static void
+test_parse_pem_persist (void)
+{
+	p11_buffer buffer;
+	p11_mmap *map;
+	void *data;
+	size_t size;
+	int ret;
+
+	/*
+	 * PEM followed by p11-kit sections is left to the p11-kit parser,
+	 * just as when all the formats were tried in turn. It doesn't allow
+	 * a certificate outside of a section.
+	 */
+	p11_buffer_init (&buffer, 0);
+	map = p11_mmap_open (SRCDIR "/files/cacert3.pem", &data, &size);
+	assert_ptr_not_null (map);
+	p11_buffer_add (&buffer, data, size);
+	p11_mmap_close (map);
+	map = p11_mmap_open (SRCDIR "/input/verisign-v1.p11-kit", &data, &size);
+	assert_ptr_not_null (map);
+	p11_buffer_add (&buffer, data, size);
+	p11_mmap_close (map);
+
+	p11_message_quiet ();
+	ret = p11_parse_memory (test.parser, "mixed.pem", P11_PARSE_FLAG_NONE,
+	                        buffer.data, buffer.len);
+	p11_message_loud ();
+	assert_num_eq (P11_PARSE_FAILURE, ret);
+	assert_num_eq (0, p11_index_size (test.index));
+	p11_buffer_uninit (&buffer);
+}
+
+static p11_array *
+parse_bundle_with_workers (p11_buffer *bundle,
+                           int workers,
+                           p11_asn1_cache *cache)
+{
+	p11_parser *parser;
+	p11_array *parsed;
+	int ret;
+
+	parser = p11_parser_new (NULL, cache);
+	assert_ptr_not_null (parser);
+	p11_parser_set_workers (parser, workers);
+
+	ret = p11_parse_memory (parser, "bundle.pem", P11_PARSE_FLAG_ANCHOR,
+	                        bundle->data, bundle->len);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+
+	parsed = p11_parser_parsed (parser);
+	assert_ptr_not_null (parsed);
+	p11_parser_free (parser);
+	return parsed;
+}
+
+static void
+test_parse_pem_workers (void)
+{
+	static const char *files[] = {
+		SRCDIR "/files/cacert3.pem",
+		SRCDIR "/files/thawte.pem",
+		SRCDIR "/files/cacert3-trusted.pem",
+		SRCDIR "/files/distrusted.pem",
+	};
+
+	p11_asn1_cache *sequential_cache;
+	p11_asn1_cache *parallel_cache;
+	p11_array *sequential;
+	p11_array *parallel;
+	CK_OBJECT_CLASS klass;
+	CK_ATTRIBUTE *value;
+	p11_buffer bundle;
+	p11_mmap *map;
+	void *data;
+	size_t size;
+	int i;
+
+	/* Enough blocks for several workers */
+	p11_buffer_init (&bundle, 0);
+	for (i = 0; i < 64; i++) {
+		map = p11_mmap_open (files[i % 4], &data, &size);
+		assert_ptr_not_null (map);
+		p11_buffer_add (&bundle, data, size);
+		p11_mmap_close (map);
+	}
+
+	sequential_cache = p11_asn1_cache_new ();
+	parallel_cache = p11_asn1_cache_new ();
+
+	p11_message_quiet ();
+	sequential = parse_bundle_with_workers (&bundle, 1, sequential_cache);
+	parallel = parse_bundle_with_workers (&bundle, 4, parallel_cache);
+	p11_message_loud ();
+
+	/* The same objects in the same order */
+	assert_num_eq (sequential->num, parallel->num);
+	for (i = 0; i < sequential->num; i++) {
+		assert (p11_attrs_match (sequential->elem[i], parallel->elem[i]));
+		assert (p11_attrs_match (parallel->elem[i], sequential->elem[i]));
+
+		/* And the certificate ASN.1 was handed back to the parser's cache */
+		if (p11_attrs_find_ulong (parallel->elem[i], CKA_CLASS, &klass) &&
+		    klass == CKO_CERTIFICATE) {
+			value = p11_attrs_find_valid (parallel->elem[i], CKA_VALUE);
+			assert_ptr_not_null (value);
+			assert_ptr_not_null (p11_asn1_cache_get (parallel_cache, "PKIX1.Certificate",
+			                                         value->pValue, value->ulValueLen));
+		}
+	}
+
+	p11_array_free (sequential);
+	p11_array_free (parallel);
+	p11_asn1_cache_free (sequential_cache);
+	p11_asn1_cache_free (parallel_cache);
+	p11_buffer_uninit (&bundle);
+}
+
+#ifdef OS_UNIX
+
+static pid_t
+pipe_file (const char *fifo,
+           const char *path)
+{
+	p11_mmap *map;
+	void *data;
+	size_t size;
+	size_t off;
+	size_t len;
+	pid_t pid;
+	int fd;
+
+	map = p11_mmap_open (path, &data, &size);
+	assert_ptr_not_null (map);
+
+	pid = fork ();
+	assert (pid >= 0);
+
+	/* Write the file a few bytes at a time, lines are split across reads */
+	if (pid == 0) {
+		fd = open (fifo, O_WRONLY);
+		if (fd < 0)
+			_exit (1);
+		for (off = 0; off < size; off += len) {
+			len = size - off < 7 ? size - off : 7;
+			if (write (fd, (char *)data + off, len) != len)
+				_exit (1);
+		}
+		close (fd);
+		_exit (0);
+	}
+
+	p11_mmap_close (map);
+	return pid;
+}
+
+static void
+test_parse_pipe (void)
+{
+	char *directory;
+	char *fifo;
+	pid_t pid;
+	int status;
+	int ret;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	directory = p11_path_expand ("$TEMP/test-parser.XXXXXX");
+	if (!mkdtemp (directory))
+		assert_fail ("mkdtemp() failed", strerror (errno));
+	fifo = p11_path_build (directory, "fifo", NULL);
+	if (mkfifo (fifo, S_IRUSR | S_IWUSR) < 0)
+		assert_fail ("mkfifo() failed", strerror (errno));
+
+	/* PEM is parsed as it comes through the pipe */
+	pid = pipe_file (fifo, SRCDIR "/files/cacert3.pem");
+	ret = p11_parse_file (test.parser, fifo, P11_PARSE_FLAG_NONE);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+	assert_num_eq (pid, waitpid (pid, &status, 0));
+	assert_num_eq (0, status);
+
+	assert_num_eq (1, p11_index_size (test.index));
+	assert (p11_index_find (test.index, match, -1) != 0);
+
+	/* Other formats are read completely and then parsed */
+	pid = pipe_file (fifo, SRCDIR "/files/cacert3.der");
+	ret = p11_parse_file (test.parser, fifo, P11_PARSE_FLAG_NONE);
+	assert_num_eq (P11_PARSE_SUCCESS, ret);
+	assert_num_eq (pid, waitpid (pid, &status, 0));
+	assert_num_eq (0, status);
+
+	assert_num_eq (1, p11_index_size (test.index));
+	assert (p11_index_find (test.index, match, -1) != 0);
+
+	if (unlink (fifo) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	if (rmdir (directory) < 0)
+		assert_fail ("rmdir() failed", strerror (errno));
+	free (fifo);
+	free (directory);
+}
+
+static void
+test_parse_device (void)
+{
+	int ret;
+
+	/* A device that never ends is only read up to a limit */
+	p11_message_quiet ();
+	ret = p11_parse_file (test.parser, "/dev/zero", P11_PARSE_FLAG_NONE);
+	p11_message_loud ();
+
+	assert_num_eq (P11_PARSE_FAILURE, ret);
+	assert_num_eq (0, p11_index_size (test.index));
+}
+
+#endif /* OS_UNIX */
+
 static void
 test_parse_p11_kit_persist (void)
 {
@@ -526,6 +825,14 @@ main (int argc,
 	p11_fixture (setup, teardown);
 	p11_test (test_parse_der_certificate, "/parser/parse_der_certificate");
 	p11_test (test_parse_pem_certificate, "/parser/parse_pem_certificate");
+	p11_test (test_parse_pem_preamble, "/parser/parse_pem_preamble");
+	p11_test (test_parse_pem_persist, "/parser/parse_pem_persist");
+	p11_test (test_parse_cached, "/parser/parse_cached");
+	p11_test (test_parse_pem_workers, "/parser/parse_pem_workers");
+#ifdef OS_UNIX
+	p11_test (test_parse_pipe, "/parser/parse_pipe");
+	p11_test (test_parse_device, "/parser/parse_device");
+#endif
 	p11_test (test_parse_p11_kit_persist, "/parser/parse_p11_kit_persist");
 	p11_test (test_parse_openssl_trusted, "/parser/parse_openssl_trusted");
 	p11_test (test_parse_openssl_distrusted, "/parser/parse_openssl_distrusted");
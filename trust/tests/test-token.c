@@ -36,12 +36,20 @@
 #include "test.h"
 #include "test-trust.h"
 
+#include <sys/stat.h>
+
+#include <errno.h>
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <utime.h>
 
 #include "attrs.h"
 #include "debug.h"
+#include "image.h"
+#include "path.h"
 #include "pkcs11x.h"
 #include "message.h"
 #include "token.h"
@@ -73,11 +81,57 @@ test_token_load (void *path)
 	count = p11_token_load (test.token);
 	assert_num_eq (7, count);
 
-	/* A certificate and trust object for each parsed object + builtin */
+	/* Trust objects are only generated when they are looked for */
 	index = p11_token_index (test.token);
+	assert (p11_token_generate_needed (test.token));
+	assert (((count - 1) * 2) + 1 > p11_index_size (index));
+	p11_token_generate (test.token);
+	assert (!p11_token_generate_needed (test.token));
+
+	/* A certificate and trust object for each parsed object + builtin */
 	assert (((count - 1) * 2) + 1 <= p11_index_size (index));
 }
 
+static void
+test_token_load_parallel (void *path)
+{
+	CK_ATTRIBUTE match = { CKA_INVALID, };
+	CK_OBJECT_HANDLE *handles;
+	p11_token *serial;
+	p11_index *index;
+	p11_index *other;
+	CK_ATTRIBUTE *attrs;
+	int count;
+	int i;
+
+	serial = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (serial);
+	p11_token_set_workers (serial, 1);
+	p11_token_set_workers (test.token, 4);
+
+	count = p11_token_load (test.token);
+	assert_num_eq (7, count);
+	count = p11_token_load (serial);
+	assert_num_eq (7, count);
+
+	/* Parsing files concurrently should result in exactly the same objects */
+	index = p11_token_index (test.token);
+	other = p11_token_index (serial);
+	assert_num_eq (p11_index_size (other), p11_index_size (index));
+
+	handles = p11_index_find_all (other, &match, 0);
+	assert_ptr_not_null (handles);
+
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (other, handles[i]);
+		assert_ptr_not_null (attrs);
+		assert (p11_index_find (index, attrs, -1) != 0);
+	}
+
+	free (handles);
+	p11_token_free (serial);
+}
+
 static void
 test_token_flags (void *path)
 {
@@ -188,6 +242,499 @@ test_token_flags (void *path)
 	}
 }
 
+static void
+test_token_distrusted (void *path)
+{
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	CK_BBOOL truev = CK_TRUE;
+	CK_OBJECT_HANDLE *handles;
+	CK_ATTRIBUTE *attrs;
+	CK_ATTRIBUTE *check;
+	p11_index *index;
+	int i;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_X_DISTRUSTED, &truev, sizeof (truev) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE cacert3[] = {
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_ISSUER, (void *)test_cacert3_ca_issuer, sizeof (test_cacert3_ca_issuer) },
+		{ CKA_SERIAL_NUMBER, (void *)test_cacert3_ca_serial, sizeof (test_cacert3_ca_serial) },
+		{ CKA_INVALID },
+	};
+
+	p11_token_load (test.token);
+	index = p11_token_index (test.token);
+
+	handles = p11_index_find_all (index, match, -1);
+	assert_ptr_not_null (handles);
+
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (index, handles[i]);
+		assert_ptr_not_null (attrs);
+		assert (p11_token_is_distrusted (test.token, attrs));
+
+		/* Either the value, or the issuer and serial number is enough */
+		check = p11_attrs_build (NULL, p11_attrs_find_valid (attrs, CKA_VALUE), NULL);
+		assert (p11_token_is_distrusted (test.token, check));
+		p11_attrs_free (check);
+
+		check = p11_attrs_build (NULL, p11_attrs_find_valid (attrs, CKA_ISSUER),
+		                         p11_attrs_find_valid (attrs, CKA_SERIAL_NUMBER), NULL);
+		assert (p11_token_is_distrusted (test.token, check));
+		p11_attrs_free (check);
+	}
+
+	assert_num_eq (2, i);
+	free (handles);
+
+	assert (!p11_token_is_distrusted (test.token, cacert3));
+	assert (!p11_token_is_distrusted (test.token, cacert3 + 1));
+}
+
+static char *
+write_image (p11_index *index)
+{
+	CK_OBJECT_CLASS builtin = CKO_NSS_BUILTIN_ROOT_LIST;
+	CK_ATTRIBUTE match = { CKA_INVALID, };
+	CK_OBJECT_HANDLE *handles;
+	CK_ATTRIBUTE *attrs;
+	p11_array *objects;
+	p11_buffer buffer;
+	char *filename;
+	int fd;
+	int i;
+
+	CK_ATTRIBUTE builtins[] = {
+		{ CKA_CLASS, &builtin, sizeof (builtin) },
+		{ CKA_INVALID },
+	};
+
+	objects = p11_array_new (p11_attrs_free);
+	handles = p11_index_find_all (index, &match, 0);
+	assert_ptr_not_null (handles);
+
+	/* The token loading the image adds its own builtin objects */
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (index, handles[i]);
+		if (p11_attrs_match (attrs, builtins))
+			continue;
+
+		/* Like p11-kit extract, the origin of the objects isn't included */
+		attrs = p11_attrs_dup (attrs);
+		p11_attrs_remove (attrs, CKA_X_ORIGIN);
+		p11_array_push (objects, attrs);
+	}
+
+	p11_buffer_init (&buffer, 0);
+	p11_image_write (&buffer, objects);
+
+	filename = p11_path_expand ("$TEMP/test-token.XXXXXX");
+	fd = mkstemp (filename);
+	if (fd < 0)
+		assert_fail ("mkstemp() failed", strerror (errno));
+	assert_num_eq (buffer.len, write (fd, buffer.data, buffer.len));
+	close (fd);
+
+	p11_buffer_uninit (&buffer);
+	p11_array_free (objects);
+	free (handles);
+	return filename;
+}
+
+static void
+test_token_load_image (void *path)
+{
+	CK_ATTRIBUTE match = { CKA_INVALID, };
+	CK_OBJECT_HANDLE *handles;
+	p11_token *image;
+	p11_index *index;
+	p11_index *other;
+	CK_ATTRIBUTE *attrs;
+	char *filename;
+	int count;
+	int i;
+
+	count = p11_token_load (test.token);
+	assert_num_eq (7, count);
+
+	index = p11_token_index (test.token);
+	filename = write_image (index);
+
+	image = p11_token_new (333, filename, "Label");
+	assert_ptr_not_null (image);
+
+	/* One image plus the builtin objects */
+	count = p11_token_load (image);
+	assert_num_eq (2, count);
+
+	/* The token loaded from the image has exactly the same objects */
+	other = p11_token_index (image);
+	assert_num_eq (p11_index_size (index), p11_index_size (other));
+
+	handles = p11_index_find_all (index, &match, 0);
+	assert_ptr_not_null (handles);
+
+	/* Other than the file they came from */
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (index, handles[i]);
+		assert_ptr_not_null (attrs);
+		attrs = p11_attrs_dup (attrs);
+		p11_attrs_remove (attrs, CKA_X_ORIGIN);
+		assert (p11_index_find (other, attrs, -1) != 0);
+		p11_attrs_free (attrs);
+	}
+
+	free (handles);
+	p11_token_free (image);
+	unlink (filename);
+	free (filename);
+}
+
+static void
+test_token_load_image_invalid (void *path)
+{
+	p11_index *index;
+	p11_token *image;
+	char *filename;
+	int count;
+	int fd;
+
+	count = p11_token_load (test.token);
+	assert_num_eq (7, count);
+
+	index = p11_token_index (test.token);
+	filename = write_image (index);
+
+	/* Chop off the end of the image */
+	fd = open (filename, O_WRONLY);
+	assert (fd >= 0);
+	assert_num_eq (0, ftruncate (fd, 64));
+	close (fd);
+
+	image = p11_token_new (333, filename, "Label");
+	assert_ptr_not_null (image);
+
+	/* Only the builtin objects */
+	p11_message_quiet ();
+	count = p11_token_load (image);
+	p11_message_loud ();
+	assert_num_eq (1, count);
+	assert_num_eq (1, p11_index_size (p11_token_index (image)));
+
+	p11_token_free (image);
+	unlink (filename);
+	free (filename);
+}
+
+static void
+write_file (const char *path,
+            const unsigned char *data,
+            size_t length,
+            time_t mtime)
+{
+	struct utimbuf times = { mtime, mtime };
+	FILE *f;
+
+	f = fopen (path, "wb");
+	assert_ptr_not_null (f);
+	assert_num_eq (1, fwrite (data, length, 1, f));
+	assert_num_eq (0, fclose (f));
+
+	/* So that the files don't look like they're still changing */
+	if (utime (path, &times) < 0)
+		assert_fail ("utime() failed", strerror (errno));
+}
+
+static void
+test_token_reload (void)
+{
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	CK_OBJECT_HANDLE handle;
+	p11_token *token;
+	p11_index *index;
+	char *directory;
+	char *path;
+	char *anchors;
+	char *first;
+	char *second;
+
+	CK_ATTRIBUTE cacert3[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE verisign[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)verisign_v1_ca, sizeof (verisign_v1_ca) },
+		{ CKA_INVALID },
+	};
+
+	directory = p11_path_expand ("$TEMP/test-token.XXXXXX");
+	if (!mkdtemp (directory))
+		assert_fail ("mkdtemp() failed", strerror (errno));
+
+	/* The token watches its parent, which is private here, not $TEMP */
+	path = p11_path_build (directory, "trust", NULL);
+	if (mkdir (path, S_IRWXU) < 0)
+		assert_fail ("mkdir() failed", strerror (errno));
+	anchors = p11_path_build (path, "anchors", NULL);
+	if (mkdir (anchors, S_IRWXU) < 0)
+		assert_fail ("mkdir() failed", strerror (errno));
+	first = p11_path_build (anchors, "first.der", NULL);
+	second = p11_path_build (anchors, "second.der", NULL);
+
+	write_file (first, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 1000);
+
+	token = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (token);
+	index = p11_token_index (token);
+
+	/* One file plus the builtin objects */
+	assert_num_eq (2, p11_token_load (token));
+	handle = p11_index_find (index, cacert3, -1);
+	assert (handle != 0);
+
+	/* Nothing changed, so nothing is loaded again */
+	assert (!p11_token_changed (token));
+	assert_num_eq (0, p11_token_load (token));
+
+	/* Only the added file is loaded, the other objects stay as they are */
+	write_file (second, verisign_v1_ca, sizeof (verisign_v1_ca), 1000);
+#ifdef __linux__
+	assert (p11_token_changed (token));
+#endif
+	assert_num_eq (1, p11_token_load (token));
+	assert (p11_index_find (index, verisign, -1) != 0);
+	assert_num_eq (handle, p11_index_find (index, cacert3, -1));
+
+	/* Objects from a file that's touched keep their handles */
+	write_file (first, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 2000);
+	assert_num_eq (1, p11_token_load (token));
+	assert_num_eq (handle, p11_index_find (index, cacert3, -1));
+
+	/* Objects from a removed file go away */
+	if (unlink (second) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	assert_num_eq (1, p11_token_load (token));
+	assert_num_eq (0, p11_index_find (index, verisign, -1));
+
+	/* And the objects from a changed file are replaced */
+	write_file (first, verisign_v1_ca, sizeof (verisign_v1_ca), 3000);
+	assert_num_eq (1, p11_token_load (token));
+	assert_num_eq (0, p11_index_find (index, cacert3, -1));
+	assert (p11_index_find (index, verisign, -1) != 0);
+
+	p11_token_free (token);
+
+	if (unlink (first) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	if (rmdir (anchors) < 0 || rmdir (path) < 0 || rmdir (directory) < 0)
+		assert_fail ("rmdir() failed", strerror (errno));
+
+	free (first);
+	free (second);
+	free (anchors);
+	free (path);
+	free (directory);
+}
+
+static void
+assert_same_objects (p11_index *index,
+                     p11_index *other)
+{
+	CK_ATTRIBUTE match = { CKA_INVALID, };
+	CK_OBJECT_HANDLE *handles;
+	CK_ATTRIBUTE *attrs;
+	int i;
+
+	assert_num_eq (p11_index_size (other), p11_index_size (index));
+
+	handles = p11_index_find_all (other, &match, 0);
+	assert_ptr_not_null (handles);
+
+	for (i = 0; handles[i] != 0; i++) {
+		attrs = p11_index_lookup (other, handles[i]);
+		assert_ptr_not_null (attrs);
+		assert (p11_index_find (index, attrs, -1) != 0);
+	}
+
+	free (handles);
+}
+
+static void
+test_token_reload_duplicate (void)
+{
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	CK_BBOOL truev = CK_TRUE;
+	p11_token *token;
+	p11_token *fresh;
+	p11_index *index;
+	char *directory;
+	char *path;
+	char *anchors;
+	char *blacklist;
+	char *anchor;
+	char *distrust;
+	char *other;
+
+	CK_ATTRIBUTE trusted[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_TRUSTED, &truev, sizeof (truev) },
+		{ CKA_INVALID },
+	};
+
+	CK_ATTRIBUTE distrusted[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_X_DISTRUSTED, &truev, sizeof (truev) },
+		{ CKA_INVALID },
+	};
+
+	directory = p11_path_expand ("$TEMP/test-token.XXXXXX");
+	if (!mkdtemp (directory))
+		assert_fail ("mkdtemp() failed", strerror (errno));
+
+	path = p11_path_build (directory, "trust", NULL);
+	if (mkdir (path, S_IRWXU) < 0)
+		assert_fail ("mkdir() failed", strerror (errno));
+	anchors = p11_path_build (path, "anchors", NULL);
+	blacklist = p11_path_build (path, "blacklist", NULL);
+	if (mkdir (anchors, S_IRWXU) < 0 || mkdir (blacklist, S_IRWXU) < 0)
+		assert_fail ("mkdir() failed", strerror (errno));
+	anchor = p11_path_build (anchors, "anchor.der", NULL);
+	distrust = p11_path_build (blacklist, "distrust.der", NULL);
+	other = p11_path_build (path, "other.der", NULL);
+
+	/* The same certificate as an anchor, blacklisted, and without trust */
+	write_file (anchor, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 1000);
+	write_file (distrust, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 1000);
+	write_file (other, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 1000);
+
+	token = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (token);
+	index = p11_token_index (token);
+
+	p11_message_quiet ();
+
+	/* The blacklisted certificate wins over the other two */
+	assert_num_eq (4, p11_token_load (token));
+	assert (p11_index_find (index, distrusted, -1) != 0);
+	assert_num_eq (0, p11_index_find (index, trusted, -1));
+
+	/* Without it the anchor comes back, just as if loaded from scratch */
+	if (unlink (distrust) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	p11_token_load (token);
+	assert_num_eq (0, p11_index_find (index, distrusted, -1));
+	assert (p11_index_find (index, trusted, -1) != 0);
+
+	fresh = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (fresh);
+	p11_token_load (fresh);
+	p11_token_generate (fresh);
+	p11_token_generate (token);
+	assert_same_objects (index, p11_token_index (fresh));
+	p11_token_free (fresh);
+
+	/* And is blacklisted again when the blacklisted file is back */
+	write_file (distrust, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 2000);
+	p11_token_load (token);
+	assert (p11_index_find (index, distrusted, -1) != 0);
+	assert_num_eq (0, p11_index_find (index, trusted, -1));
+
+	/* The anchor also comes back when the blacklisted file changes */
+	write_file (distrust, verisign_v1_ca, sizeof (verisign_v1_ca), 3000);
+	p11_token_load (token);
+	assert_num_eq (0, p11_index_find (index, distrusted, -1));
+	assert (p11_index_find (index, trusted, -1) != 0);
+
+	fresh = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (fresh);
+	p11_token_load (fresh);
+	p11_token_generate (fresh);
+	p11_token_generate (token);
+	assert_same_objects (index, p11_token_index (fresh));
+	p11_token_free (fresh);
+
+	p11_message_loud ();
+	p11_token_free (token);
+
+	if (unlink (anchor) < 0 || unlink (distrust) < 0 || unlink (other) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	if (rmdir (anchors) < 0 || rmdir (blacklist) < 0 ||
+	    rmdir (path) < 0 || rmdir (directory) < 0)
+		assert_fail ("rmdir() failed", strerror (errno));
+
+	free (anchor);
+	free (distrust);
+	free (other);
+	free (anchors);
+	free (blacklist);
+	free (path);
+	free (directory);
+}
+
+#ifdef OS_UNIX
+
+static void
+test_token_skip_pipe (void)
+{
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	p11_token *token;
+	char *directory;
+	char *path;
+	char *anchors;
+	char *anchor;
+	char *fifo;
+
+	CK_ATTRIBUTE cacert3[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_VALUE, (void *)test_cacert3_ca_der, sizeof (test_cacert3_ca_der) },
+		{ CKA_INVALID },
+	};
+
+	directory = p11_path_expand ("$TEMP/test-token.XXXXXX");
+	if (!mkdtemp (directory))
+		assert_fail ("mkdtemp() failed", strerror (errno));
+
+	path = p11_path_build (directory, "trust", NULL);
+	anchors = p11_path_build (path, "anchors", NULL);
+	if (mkdir (path, S_IRWXU) < 0 || mkdir (anchors, S_IRWXU) < 0)
+		assert_fail ("mkdir() failed", strerror (errno));
+	anchor = p11_path_build (anchors, "anchor.der", NULL);
+	fifo = p11_path_build (anchors, "fifo", NULL);
+
+	write_file (anchor, test_cacert3_ca_der, sizeof (test_cacert3_ca_der), 1000);
+	if (mkfifo (fifo, S_IRUSR | S_IWUSR) < 0)
+		assert_fail ("mkfifo() failed", strerror (errno));
+
+	/* A pipe in a directory is not opened, which would block */
+	token = p11_token_new (333, path, "Label");
+	assert_ptr_not_null (token);
+	assert_num_eq (2, p11_token_load (token));
+	assert (p11_index_find (p11_token_index (token), cacert3, -1) != 0);
+	p11_token_free (token);
+
+	if (unlink (anchor) < 0 || unlink (fifo) < 0)
+		assert_fail ("unlink() failed", strerror (errno));
+	if (rmdir (anchors) < 0 || rmdir (path) < 0 || rmdir (directory) < 0)
+		assert_fail ("rmdir() failed", strerror (errno));
+
+	free (anchor);
+	free (fifo);
+	free (anchors);
+	free (path);
+	free (directory);
+}
+
+#endif /* OS_UNIX */
+
 static void
 test_token_path (void *path)
 {
@@ -213,6 +760,17 @@ main (int argc,
 	p11_fixture (setup, teardown);
 	p11_testx (test_token_load, SRCDIR "/input", "/token/load");
 	p11_testx (test_token_flags, SRCDIR "/input", "/token/flags");
+	p11_testx (test_token_distrusted, SRCDIR "/input", "/token/distrusted");
+	p11_testx (test_token_load_parallel, SRCDIR "/input", "/token/load-parallel");
+	p11_testx (test_token_load_image, SRCDIR "/input", "/token/load-image");
+	p11_testx (test_token_load_image_invalid, SRCDIR "/input", "/token/load-image-invalid");
+
+	p11_fixture (NULL, NULL);
+	p11_test (test_token_reload, "/token/reload");
+	p11_test (test_token_reload_duplicate, "/token/reload-duplicate");
+#ifdef OS_UNIX
+	p11_test (test_token_skip_pipe, "/token/skip-pipe");
+#endif
 
 	p11_fixture (setup, teardown);
 	p11_testx (test_token_path, "/wheee", "/token/path");
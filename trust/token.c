@@ -34,13 +34,17 @@
 
 #include "config.h"
 
+#include "array.h"
 #include "asn1.h"
 #include "attrs.h"
 #include "builder.h"
+#include "cache.h"
 #include "compat.h"
 #define P11_DEBUG_FLAG P11_DEBUG_TRUST
 #include "debug.h"
 #include "errno.h"
+#include "hash.h"
+#include "image.h"
 #include "message.h"
 #include "module.h"
 #include "parser.h"
@@ -55,7 +59,14 @@
 #include <dirent.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <time.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#include <poll.h>
+#endif
 #include <string.h>
+#include <unistd.h>
 
 struct _p11_token {
 	p11_parser *parser;
@@ -65,18 +76,99 @@ struct _p11_token {
 	char *label;
 	CK_SLOT_ID slot;
 	int loaded;
+	int workers;
+	char *cache_directory;
+	p11_cache *cache;
+	p11_dict *files;
+	p11_dict *distrusted;
+	int watch;
+	bool replaced;
 };
 
-static int
-loader_load_file (p11_token *token,
-                  const char *filename,
-                  struct stat *sb,
-                  int flags)
-{
+/*
+ * What we know about each file loaded into the token. A file is only
+ * parsed again when it changes, and its objects are removed when it
+ * goes away. A file modified within the last second may change again
+ * without its stat changing, so it's parsed again on the next scan.
+ *
+ * A file that lost a duplicate certificate to another file is parsed
+ * again when the objects of any other file are replaced or removed,
+ * since the certificate it lost may have to come back.
+ *
+ * An image stays mapped while it's loaded, since the values of its
+ * objects are used in place.
+ */
+typedef struct {
+	char *path;
+	struct stat sb;
+	p11_mmap *image;
+	int flags;
+	bool racy;
+	bool seen;
+	bool lost;
+} loader_stat;
+
+/*
+ * Files in a directory are parsed concurrently by up to this many
+ * threads. Each parses into its own batch of objects, which are then
+ * put in the index in directory order, just as if the files had been
+ * parsed one at a time.
+ */
+#define MAX_WORKERS 8
+
+/*
+ * Number of files per worker parsed before their objects are put in
+ * the index. This limits how much parsed ASN.1 is held at once.
+ */
+#define WORKER_FILES 16
+
+typedef struct {
+	char *path;
+	struct stat sb;
+	bool cached;
 	int ret;
+	p11_array *parsed;
+	p11_asn1_cache *asn1_cache;
+} loader_file;
+
+typedef struct {
+	p11_mutex_t mutex;
+	loader_file **files;
+	int num_files;
+	int next;
+	int flags;
+} loader_queue;
+
+typedef struct {
+	p11_thread_t thread;
+	bool started;
+	p11_parser *parser;
+	p11_asn1_cache *asn1_cache;
+	loader_queue *queue;
+} loader_worker;
 
-	ret = p11_parse_file (token->parser, filename, flags);
+/*
+ * Attribute types indexed in the token. In addition to the usual ones
+ * NSS and others look up certificates and trust objects by subject, by
+ * issuer and serial number, and by label. The objects from a file are
+ * looked up by their origin when the file is reloaded.
+ */
+static const CK_ATTRIBUTE_TYPE token_indexed[] = {
+	CKA_CLASS,
+	CKA_VALUE,
+	CKA_OBJECT_ID,
+	CKA_ID,
+	CKA_SUBJECT,
+	CKA_ISSUER,
+	CKA_SERIAL_NUMBER,
+	CKA_LABEL,
+	CKA_X_ORIGIN,
+};
 
+static int
+loader_loaded (const char *filename,
+               int ret)
+{
 	switch (ret) {
 	case P11_PARSE_SUCCESS:
 		p11_debug ("loaded: %s", filename);
@@ -90,6 +182,465 @@ loader_load_file (p11_token *token,
 	}
 }
 
+static bool
+loader_changed (p11_token *token,
+                const char *path,
+                struct stat *sb)
+{
+	loader_stat *ls;
+
+	ls = p11_dict_get (token->files, path);
+	if (ls == NULL)
+		return true;
+
+	ls->seen = true;
+
+	/* A pipe can only be read once, what came through it stays loaded */
+	if (!S_ISREG (sb->st_mode))
+		return false;
+
+	return ls->racy ||
+	       ls->sb.st_dev != sb->st_dev ||
+	       ls->sb.st_ino != sb->st_ino ||
+	       ls->sb.st_size != sb->st_size ||
+	       ls->sb.st_mtime != sb->st_mtime ||
+	       ls->sb.st_ctime != sb->st_ctime;
+}
+
+static void
+loader_stat_free (void *data)
+{
+	loader_stat *ls = data;
+
+	if (ls->image)
+		p11_mmap_close (ls->image);
+	free (ls->path);
+	free (ls);
+}
+
+static loader_stat *
+loader_remember (p11_token *token,
+                 const char *path,
+                 struct stat *sb,
+                 p11_mmap *image,
+                 int flags)
+{
+	loader_stat *ls;
+
+	ls = calloc (1, sizeof (loader_stat));
+	return_val_if_fail (ls != NULL, NULL);
+
+	ls->path = strdup (path);
+	return_val_if_fail (ls->path != NULL, NULL);
+
+	memcpy (&ls->sb, sb, sizeof (struct stat));
+	ls->image = image;
+	ls->flags = flags;
+	ls->racy = (sb->st_mtime >= time (NULL) - 1);
+	ls->seen = true;
+
+	if (!p11_dict_set (token->files, ls->path, ls))
+		return_val_if_reached (NULL);
+
+	return ls;
+}
+
+static void
+loader_remember_lost (p11_token *token)
+{
+	p11_array *lost;
+	loader_stat *ls;
+	int i;
+
+	lost = p11_parser_lost (token->parser);
+	for (i = 0; lost && i < lost->num; i++) {
+		ls = p11_dict_get (token->files, lost->elem[i]);
+		if (ls != NULL)
+			ls->lost = true;
+	}
+
+	p11_array_free (lost);
+}
+
+static void
+loader_unload (p11_token *token,
+               const char *path)
+{
+	CK_OBJECT_HANDLE *handles;
+	p11_array *empty;
+	loader_stat *ls;
+	int i;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_X_ORIGIN, (void *)path, strlen (path) },
+		{ CKA_INVALID },
+	};
+
+	ls = p11_dict_get (token->files, path);
+	if (ls == NULL)
+		return;
+
+	/* Objects from an image weren't built, so they're not torn down either */
+	if (ls->image) {
+		handles = p11_index_find_all (token->index, match, -1);
+		for (i = 0; handles && handles[i] != 0; i++)
+			p11_index_unload (token->index, handles[i]);
+		free (handles);
+
+	} else {
+		empty = p11_array_new (NULL);
+		return_if_fail (empty != NULL);
+		p11_parser_sink (token->parser, path, empty, NULL);
+		p11_array_free (empty);
+		token->replaced = true;
+	}
+
+	p11_debug ("unloaded: %s", path);
+	p11_dict_remove (token->files, path);
+}
+
+static int
+loader_unload_unseen (p11_token *token)
+{
+	p11_dictiter iter;
+	loader_stat *ls;
+	p11_array *gone;
+	char *path;
+	int i;
+
+	gone = p11_array_new (NULL);
+	return_val_if_fail (gone != NULL, -1);
+
+	p11_dict_iterate (token->files, &iter);
+	while (p11_dict_next (&iter, (void **)&path, (void **)&ls)) {
+		if (!ls->seen && !p11_array_push (gone, path))
+			return_val_if_reached (-1);
+	}
+
+	for (i = 0; i < gone->num; i++)
+		loader_unload (token, gone->elem[i]);
+
+	i = gone->num;
+	p11_array_free (gone);
+	return i;
+}
+
+/*
+ * On Linux we use inotify to notice changes to the directories and files
+ * we've loaded, so that they're only scanned again when something changed.
+ * Elsewhere, or when a watch can't be added, they're only loaded once.
+ */
+
+static void
+loader_watch (p11_token *token,
+              const char *path)
+{
+#ifdef __linux__
+	uint32_t mask = IN_CREATE | IN_DELETE | IN_MODIFY | IN_ATTRIB |
+	                IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+	                IN_DELETE_SELF | IN_MOVE_SELF;
+
+	if (token->watch < 0)
+		return;
+
+	if (inotify_add_watch (token->watch, path, mask) < 0 && errno != ENOENT) {
+		p11_debug ("couldn't watch path: %s: %s", path, strerror (errno));
+		close (token->watch);
+		token->watch = -1;
+	}
+#endif
+}
+
+static void
+loader_watch_parent (p11_token *token,
+                     const char *path)
+{
+	char *parent;
+	char *end;
+
+	parent = strdup (path);
+	return_if_fail (parent != NULL);
+
+	end = strrchr (parent, '/');
+	if (end != NULL) {
+		end[end == parent ? 1 : 0] = '\0';
+		loader_watch (token, parent);
+	}
+
+	free (parent);
+}
+
+static bool
+loader_drain_watch (p11_token *token)
+{
+#ifdef __linux__
+	char buffer[4096];
+	bool changed = false;
+	ssize_t ret;
+
+	if (token->watch < 0)
+		return false;
+
+	for (;;) {
+		ret = read (token->watch, buffer, sizeof (buffer));
+		if (ret > 0)
+			changed = true;
+		else if (ret < 0 && errno == EINTR)
+			continue;
+		else
+			break;
+	}
+
+	return changed;
+#else
+	return false;
+#endif
+}
+
+static loader_file *
+loader_file_new (const char *path,
+                 struct stat *sb)
+{
+	loader_file *file;
+
+	file = calloc (1, sizeof (loader_file));
+	return_val_if_fail (file != NULL, NULL);
+
+	file->path = strdup (path);
+	return_val_if_fail (file->path != NULL, NULL);
+
+	memcpy (&file->sb, sb, sizeof (struct stat));
+	return file;
+}
+
+static void
+loader_file_free (void *data)
+{
+	loader_file *file = data;
+	p11_array_free (file->parsed);
+	free (file->path);
+	free (file);
+}
+
+static int
+loader_num_workers (p11_token *token,
+                    int num_files)
+{
+	long workers;
+
+	workers = token->workers;
+	if (workers <= 0) {
+#ifdef OS_UNIX
+		workers = sysconf (_SC_NPROCESSORS_ONLN);
+#else
+		SYSTEM_INFO info;
+		GetSystemInfo (&info);
+		workers = info.dwNumberOfProcessors;
+#endif
+	}
+
+	if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+	if (workers > num_files)
+		workers = num_files;
+	return workers < 1 ? 1 : workers;
+}
+
+static void *
+loader_worker_thread (void *data)
+{
+	loader_worker *worker = data;
+	loader_queue *queue = worker->queue;
+	loader_file *file;
+
+	for (;;) {
+		p11_mutex_lock (&queue->mutex);
+		if (queue->next < queue->num_files)
+			file = queue->files[queue->next++];
+		else
+			file = NULL;
+		p11_mutex_unlock (&queue->mutex);
+
+		if (file == NULL)
+			break;
+		if (file->cached)
+			continue;
+
+		file->ret = p11_parse_file (worker->parser, file->path, queue->flags);
+		file->parsed = p11_parser_parsed (worker->parser);
+		file->asn1_cache = worker->asn1_cache;
+	}
+
+	return NULL;
+}
+
+static int
+loader_load_files (p11_token *token,
+                   p11_array *files,
+                   int num_workers,
+                   int flags)
+{
+	loader_worker workers[MAX_WORKERS];
+	loader_queue queue;
+	loader_file *file;
+	int total = 0;
+	int chunk;
+	int inner;
+	int at;
+	int i;
+
+	if (files->num == 0)
+		return 0;
+
+	p11_mutex_init (&queue.mutex);
+	queue.flags = flags;
+
+	/* Workers left over when there are few files decode within a file */
+	inner = loader_num_workers (token, MAX_WORKERS) / num_workers;
+
+	for (i = 0; i < num_workers; i++) {
+		/* The first worker runs in this thread, and can use the token's cache */
+		if (i == 0)
+			workers[i].asn1_cache = p11_builder_get_cache (token->builder);
+		else
+			workers[i].asn1_cache = p11_asn1_cache_new ();
+		return_val_if_fail (workers[i].asn1_cache != NULL, -1);
+		workers[i].parser = p11_parser_new (NULL, workers[i].asn1_cache);
+		return_val_if_fail (workers[i].parser != NULL, -1);
+		p11_parser_set_workers (workers[i].parser, inner);
+		workers[i].queue = &queue;
+	}
+
+	chunk = num_workers * WORKER_FILES;
+
+	for (at = 0; at < files->num; at += chunk) {
+		queue.files = (loader_file **)files->elem + at;
+		queue.num_files = files->num - at < chunk ? files->num - at : chunk;
+		queue.next = 0;
+
+		/* Files that haven't changed since they were cached are not parsed */
+		for (i = 0; token->cache && i < queue.num_files; i++) {
+			file = queue.files[i];
+			file->cached = p11_cache_lookup (token->cache, file->path, &file->sb,
+			                                 flags, &file->ret, &file->parsed);
+		}
+
+		/* This thread is the first worker, and picks up any slack */
+		for (i = 1; i < num_workers; i++) {
+			workers[i].started = (p11_thread_create (&workers[i].thread,
+			                                         loader_worker_thread,
+			                                         workers + i) == 0);
+		}
+
+		loader_worker_thread (workers + 0);
+
+		for (i = 1; i < num_workers; i++) {
+			if (workers[i].started)
+				p11_thread_join (workers[i].thread);
+		}
+
+		for (i = 0; i < queue.num_files; i++) {
+			file = queue.files[i];
+			if (token->cache && !file->cached && file->ret != P11_PARSE_FAILURE) {
+				p11_cache_store (token->cache, file->path, &file->sb,
+				                 flags, file->ret, file->parsed);
+			}
+			/* Objects from a previous version of the file are replaced */
+			if (p11_dict_get (token->files, file->path)) {
+				if (!file->parsed)
+					file->parsed = p11_array_new (p11_attrs_free);
+				token->replaced = true;
+			}
+			if (file->parsed) {
+				p11_parser_sink (token->parser, file->path,
+				                 file->parsed, file->asn1_cache);
+				p11_array_free (file->parsed);
+				file->parsed = NULL;
+			}
+			loader_remember (token, file->path, &file->sb, NULL, flags);
+			loader_remember_lost (token);
+			total += loader_loaded (file->path, file->ret);
+		}
+
+		for (i = 1; i < num_workers; i++)
+			p11_asn1_cache_flush (workers[i].asn1_cache);
+	}
+
+	for (i = 0; i < num_workers; i++) {
+		p11_parser_free (workers[i].parser);
+		if (i > 0)
+			p11_asn1_cache_free (workers[i].asn1_cache);
+	}
+
+	p11_mutex_uninit (&queue.mutex);
+	return total;
+}
+
+static int
+loader_load_file (p11_token *token,
+                  const char *filename,
+                  struct stat *sb,
+                  int flags)
+{
+	p11_array *files;
+	int ret;
+
+	files = p11_array_new (loader_file_free);
+	return_val_if_fail (files != NULL, -1);
+	if (!p11_array_push (files, loader_file_new (filename, sb)))
+		return_val_if_reached (-1);
+	ret = loader_load_files (token, files, 1, flags);
+	p11_array_free (files);
+	return ret;
+}
+
+/*
+ * Files that lost duplicates are parsed again, so that what they lost
+ * is put back if the file it lost to no longer has it.
+ */
+static int
+loader_load_lost (p11_token *token)
+{
+	p11_dictiter iter;
+	loader_stat *ls;
+	p11_array *lost;
+	struct stat sb;
+	char *path;
+	int total = 0;
+	int flags;
+	int ret;
+	int i;
+
+	lost = p11_array_new (free);
+	return_val_if_fail (lost != NULL, -1);
+
+	p11_dict_iterate (token->files, &iter);
+	while (p11_dict_next (&iter, (void **)&path, (void **)&ls)) {
+		/* A pipe can only be read once */
+		if (!ls->lost || !S_ISREG (ls->sb.st_mode))
+			continue;
+		path = strdup (path);
+		if (!path || !p11_array_push (lost, path))
+			return_val_if_reached (-1);
+	}
+
+	for (i = 0; i < lost->num; i++) {
+		ls = p11_dict_get (token->files, lost->elem[i]);
+		if (ls == NULL)
+			continue;
+
+		/* Loading the file again replaces what we know about it */
+		memcpy (&sb, &ls->sb, sizeof (struct stat));
+		flags = ls->flags;
+		ret = loader_load_file (token, lost->elem[i], &sb, flags);
+		return_val_if_fail (ret >= 0, ret);
+		total += ret;
+	}
+
+	p11_array_free (lost);
+	return total;
+}
+
 static int
 loader_load_directory (p11_token *token,
                        const char *directory,
@@ -97,12 +648,15 @@ loader_load_directory (p11_token *token,
 {
 	struct dirent *dp;
 	struct stat sb;
+	p11_array *files;
 	char *path;
-	int total = 0;
-	int ret;
+	int num_workers;
+	int total;
 	DIR *dir;
 
-	/* First we load all the modules */
+	/* Watch before listing, so that no changes are missed */
+	loader_watch (token, directory);
+
 	dir = opendir (directory);
 	if (!dir) {
 		p11_message ("couldn't list directory: %s: %s",
@@ -110,24 +664,36 @@ loader_load_directory (p11_token *token,
 		return 0;
 	}
 
-	/* We're within a global mutex, so readdir is safe */
+	files = p11_array_new (loader_file_free);
+	return_val_if_fail (files != NULL, -1);
+
+	/*
+	 * Directories are only listed by the thread loading the token, under
+	 * the write lock. The workers only parse the files that were found.
+	 */
 	while ((dp = readdir (dir)) != NULL) {
 		path = p11_path_build (directory, dp->d_name, NULL);
 		return_val_if_fail (path != NULL, -1);
 
+		/* Pipes and devices are only read when they're the token path */
 		if (stat (path, &sb) < 0) {
 			p11_message ("couldn't stat path: %s", path);
 
-		} else if (!S_ISDIR (sb.st_mode)) {
-			ret = loader_load_file (token, path, &sb, flags);
-			return_val_if_fail (ret >= 0, ret);
-			total += ret;
+		} else if (S_ISREG (sb.st_mode) && loader_changed (token, path, &sb)) {
+			if (!p11_array_push (files, loader_file_new (path, &sb)))
+				return_val_if_reached (-1);
 		}
 
 		free (path);
 	}
 
 	closedir (dir);
+
+	/* Only files that are new or changed since last loaded are parsed */
+	num_workers = loader_num_workers (token, files->num);
+	total = loader_load_files (token, files, num_workers, flags);
+
+	p11_array_free (files);
 	return total;
 }
 
@@ -151,15 +717,74 @@ loader_load_subdirectory (p11_token *token,
 	return ret;
 }
 
+static int
+loader_load_image (p11_token *token,
+                   loader_stat *ls,
+                   const unsigned char *data,
+                   size_t size)
+{
+	p11_array *objects;
+	CK_ATTRIBUTE *attrs;
+	CK_ATTRIBUTE *origin;
+	CK_ULONG count;
+	CK_RV rv;
+	int i;
+
+	if (!p11_image_view (data, size, &objects)) {
+		p11_message ("couldn't load invalid or incompatible trust image: %s", ls->path);
+		return 0;
+	}
+
+	/*
+	 * The objects in the image are already built, don't build them again.
+	 * Their values point into the image, and their origin is our path.
+	 */
+	for (i = 0; i < objects->num; i++) {
+		attrs = objects->elem[i];
+		objects->elem[i] = NULL;
+
+		origin = p11_attrs_find (attrs, CKA_X_ORIGIN);
+		if (origin == NULL) {
+			count = p11_attrs_count (attrs);
+			attrs = realloc (attrs, (count + 2) * sizeof (CK_ATTRIBUTE));
+			return_val_if_fail (attrs != NULL, -1);
+			origin = attrs + count;
+			origin[1].type = CKA_INVALID;
+		}
+
+		origin->type = CKA_X_ORIGIN;
+		origin->pValue = ls->path;
+		origin->ulValueLen = strlen (ls->path);
+
+		rv = p11_index_load (token->index, attrs, NULL);
+		return_val_if_fail (rv == CKR_OK, -1);
+	}
+
+	p11_debug ("loaded image: %s: %d objects", ls->path, objects->num);
+	p11_array_free (objects);
+	return 1;
+}
+
 static int
 loader_load_path (p11_token *token,
                   const char *path)
 {
+	loader_stat *ls;
 	struct stat sb;
+	p11_mmap *map;
+	void *data;
+	size_t size;
 	int total;
 	int ret;
 
+	/* Notice when the path itself is created, replaced or removed */
+	loader_watch_parent (token, path);
+
 	if (stat (path, &sb) < 0) {
+		/* Already complained about this, and anything loaded goes away */
+		if (token->loaded)
+			return 0;
+
 		if (errno == ENOENT) {
 			p11_message ("trust certificate path does not exist: %s",
 			             path);
@@ -187,9 +812,28 @@ loader_load_path (p11_token *token,
 		total += ret;
 
 		return total;
-	} else {
+	} else if (loader_changed (token, path, &sb)) {
+		/* A pipe can only be read once, so only regular files are images */
+		map = S_ISREG (sb.st_mode) ? p11_mmap_open (path, &data, &size) : NULL;
+		if (map != NULL) {
+			if (p11_image_check (data, size)) {
+				loader_unload (token, path);
+				ls = loader_remember (token, path, &sb, map, P11_PARSE_FLAG_ANCHOR);
+				return_val_if_fail (ls != NULL, -1);
+				return loader_load_image (token, ls, data, size);
+			}
+			p11_mmap_close (map);
+		}
+
+		/* The path used to be an image, which is not replaced by parsing */
+		ls = p11_dict_get (token->files, path);
+		if (ls && ls->image)
+			loader_unload (token, path);
+
 		return loader_load_file (token, path, &sb, P11_PARSE_FLAG_ANCHOR);
 	}
+
+	return 0;
 }
 
 static int
@@ -217,22 +861,235 @@ load_builtin_objects (p11_token *token)
 	return 1;
 }
 
+/*
+ * The blacklist of the token: digests of the value, and of the issuer
+ * and serial number, of each distrusted certificate. Most certificates
+ * that are checked against it aren't there, and that's answered without
+ * matching any objects. It's rebuilt whenever the token loads changes.
+ */
+
+static bool
+distrust_digest (CK_ATTRIBUTE *cert,
+                 CK_ATTRIBUTE_TYPE type,
+                 unsigned char *digest)
+{
+	CK_ATTRIBUTE *issuer;
+	CK_ATTRIBUTE *serial;
+	CK_ATTRIBUTE *value;
+
+	if (type == CKA_VALUE) {
+		value = p11_attrs_find_valid (cert, CKA_VALUE);
+		if (value == NULL)
+			return false;
+		p11_hash_sha1 (digest, "V", (size_t)1,
+		               value->pValue, (size_t)value->ulValueLen, NULL);
+
+	} else {
+		issuer = p11_attrs_find_valid (cert, CKA_ISSUER);
+		serial = p11_attrs_find_valid (cert, CKA_SERIAL_NUMBER);
+		if (issuer == NULL || serial == NULL)
+			return false;
+		p11_hash_sha1 (digest, "S", (size_t)1,
+		               issuer->pValue, (size_t)issuer->ulValueLen,
+		               serial->pValue, (size_t)serial->ulValueLen, NULL);
+	}
+
+	return true;
+}
+
+static unsigned int
+distrust_hash (const void *data)
+{
+	unsigned int hash;
+
+	/* The digests are already well distributed */
+	memcpy (&hash, data, sizeof (hash));
+	return hash;
+}
+
+static bool
+distrust_equal (const void *one,
+                const void *two)
+{
+	return memcmp (one, two, P11_HASH_SHA1_LEN) == 0;
+}
+
+static void
+distrust_add (p11_token *token,
+              CK_ATTRIBUTE *cert,
+              CK_ATTRIBUTE_TYPE type)
+{
+	unsigned char *digest;
+
+	digest = malloc (P11_HASH_SHA1_LEN);
+	return_if_fail (digest != NULL);
+
+	if (!distrust_digest (cert, type, digest) ||
+	    p11_dict_get (token->distrusted, digest)) {
+		free (digest);
+		return;
+	}
+
+	if (!p11_dict_set (token->distrusted, digest, digest))
+		return_if_reached ();
+}
+
+static void
+distrust_rebuild (p11_token *token)
+{
+	CK_OBJECT_CLASS certificate = CKO_CERTIFICATE;
+	CK_BBOOL truev = CK_TRUE;
+	CK_OBJECT_HANDLE *handles;
+	CK_ATTRIBUTE *cert;
+	int i;
+
+	CK_ATTRIBUTE match[] = {
+		{ CKA_CLASS, &certificate, sizeof (certificate) },
+		{ CKA_X_DISTRUSTED, &truev, sizeof (truev) },
+		{ CKA_INVALID },
+	};
+
+	p11_dict_clear (token->distrusted);
+
+	handles = p11_index_find_all (token->index, match, -1);
+	for (i = 0; handles && handles[i] != 0; i++) {
+		cert = p11_index_lookup (token->index, handles[i]);
+		if (cert != NULL) {
+			distrust_add (token, cert, CKA_VALUE);
+			distrust_add (token, cert, CKA_SERIAL_NUMBER);
+		}
+	}
+	free (handles);
+
+	p11_debug ("%s: %u blacklist entries", token->label,
+	           p11_dict_size (token->distrusted));
+}
+
+bool
+p11_token_is_distrusted (p11_token *token,
+                         CK_ATTRIBUTE *cert)
+{
+	unsigned char digest[P11_HASH_SHA1_LEN];
+
+	return_val_if_fail (token != NULL, false);
+	return_val_if_fail (cert != NULL, false);
+
+	if (distrust_digest (cert, CKA_VALUE, digest) &&
+	    p11_dict_get (token->distrusted, digest))
+		return true;
+
+	if (distrust_digest (cert, CKA_SERIAL_NUMBER, digest) &&
+	    p11_dict_get (token->distrusted, digest))
+		return true;
+
+	return false;
+}
+
 int
 p11_token_load (p11_token *token)
 {
-	int builtins;
+	p11_index_filter_stats filter;
+	p11_asn1_cache_stats stats;
+	p11_dictiter iter;
+	loader_stat *ls;
+	int builtins = 0;
 	int count;
+	int gone;
+	int lost;
+
+	if (!token->loaded) {
+		builtins = load_builtin_objects (token);
+
+#ifdef __linux__
+		token->watch = inotify_init1 (IN_NONBLOCK | IN_CLOEXEC);
+		if (token->watch < 0)
+			p11_debug ("couldn't watch for changes: %s", strerror (errno));
+#endif
 
-	if (token->loaded)
+		if (token->cache_directory)
+			token->cache = p11_cache_new (token->cache_directory, token->path);
+
+	/* Already loaded, so only load what changed since then */
+	} else if (!loader_drain_watch (token)) {
 		return 0;
-	token->loaded = 1;
+	}
 
-	builtins = load_builtin_objects (token);
+	p11_dict_iterate (token->files, &iter);
+	while (p11_dict_next (&iter, NULL, (void **)&ls))
+		ls->seen = false;
+	token->replaced = false;
 
 	count = loader_load_path (token, token->path);
+
+	if (token->cache) {
+		p11_cache_write (token->cache);
+		p11_cache_free (token->cache);
+		token->cache = NULL;
+	}
+
 	return_val_if_fail (count >= 0, count);
 
-	return count + builtins;
+	gone = loader_unload_unseen (token);
+	return_val_if_fail (gone >= 0, gone);
+
+	/* Duplicates lost to objects that were replaced or removed */
+	if (token->replaced) {
+		lost = loader_load_lost (token);
+		return_val_if_fail (lost >= 0, lost);
+		count += lost;
+	}
+
+	if (count + gone > 0) {
+		p11_asn1_cache_get_stats (p11_builder_get_cache (token->builder), &stats);
+		p11_debug ("%s: asn1 cache has %lu hits, %lu misses, %lu evictions",
+		           token->label, stats.hits, stats.misses, stats.evictions);
+		p11_index_get_filter_stats (token->index, &filter);
+		p11_debug ("%s: index filters checked %lu lookups, %lu rejected, %lu false positives",
+		           token->label, filter.lookups, filter.rejected, filter.false_positives);
+	}
+
+	if (count + gone + builtins > 0)
+		distrust_rebuild (token);
+
+	token->loaded = 1;
+	return count + gone + builtins;
+}
+
+bool
+p11_token_changed (p11_token *token)
+{
+	return_val_if_fail (token != NULL, false);
+
+	if (!token->loaded)
+		return true;
+
+#ifdef __linux__
+	if (token->watch >= 0) {
+		struct pollfd pfd = { token->watch, POLLIN, 0 };
+		return poll (&pfd, 1, 0) > 0;
+	}
+#endif
+
+	return false;
+}
+
+/*
+ * The NSS trust objects and trust assertions generated for certificates
+ * are only built once someone looks for them.
+ */
+
+bool
+p11_token_generate_needed (p11_token *token)
+{
+	return_val_if_fail (token != NULL, false);
+	return p11_builder_pending (token->builder);
+}
+
+void
+p11_token_generate (p11_token *token)
+{
+	return_if_fail (token != NULL);
+	p11_builder_generate (token->builder, token->index);
 }
 
 void
@@ -241,9 +1098,15 @@ p11_token_free (p11_token *token)
 	if (!token)
 		return;
 
+	if (token->watch >= 0)
+		close (token->watch);
+
 	p11_index_free (token->index);
 	p11_parser_free (token->parser);
+	p11_dict_free (token->files);
+	p11_dict_free (token->distrusted);
 	p11_builder_free (token->builder);
+	free (token->cache_directory);
 	free (token->path);
 	free (token->label);
 	free (token);
@@ -262,7 +1125,7 @@ p11_token_new (CK_SLOT_ID slot,
 	token = calloc (1, sizeof (p11_token));
 	return_val_if_fail (token != NULL, NULL);
 
-	token->builder = p11_builder_new (P11_BUILDER_FLAG_TOKEN);
+	token->builder = p11_builder_new (P11_BUILDER_FLAG_TOKEN | P11_BUILDER_FLAG_LAZY);
 	return_val_if_fail (token->builder != NULL, NULL);
 
 	token->index = p11_index_new (p11_builder_build,
@@ -270,6 +1133,11 @@ p11_token_new (CK_SLOT_ID slot,
 	                              token->builder);
 	return_val_if_fail (token->index != NULL, NULL);
 
+	p11_index_set_flush (token->index, p11_builder_flush);
+
+	p11_index_set_indexed (token->index, token_indexed,
+	                       sizeof (token_indexed) / sizeof (token_indexed[0]));
+
 	token->parser = p11_parser_new (token->index,
 	                                p11_builder_get_cache (token->builder));
 	return_val_if_fail (token->parser != NULL, NULL);
@@ -280,8 +1148,17 @@ p11_token_new (CK_SLOT_ID slot,
 	token->label = strdup (label);
 	return_val_if_fail (token->label != NULL, NULL);
 
+	token->files = p11_dict_new (p11_dict_str_hash, p11_dict_str_equal,
+	                             NULL, loader_stat_free);
+	return_val_if_fail (token->files != NULL, NULL);
+
+	token->distrusted = p11_dict_new (distrust_hash, distrust_equal,
+	                                  free, NULL);
+	return_val_if_fail (token->distrusted != NULL, NULL);
+
 	token->slot = slot;
 	token->loaded = 0;
+	token->watch = -1;
 
 	p11_debug ("token: %s: %s", token->label, token->path);
 	return token;
@@ -308,6 +1185,24 @@ p11_token_get_slot (p11_token *token)
 	return token->slot;
 }
 
+void
+p11_token_set_workers (p11_token *token,
+                       int workers)
+{
+	return_if_fail (token != NULL);
+	token->workers = workers;
+}
+
+void
+p11_token_set_cache (p11_token *token,
+                     const char *directory)
+{
+	return_if_fail (token != NULL);
+
+	free (token->cache_directory);
+	token->cache_directory = directory ? strdup (directory) : NULL;
+}
+
 p11_index *
 p11_token_index (p11_token *token)
 {
@@ -49,6 +49,15 @@ void            p11_token_free        (p11_token *token);
 
 int             p11_token_load        (p11_token *token);
 
+bool            p11_token_changed     (p11_token *token);
+
+bool            p11_token_generate_needed (p11_token *token);
+
+void            p11_token_generate    (p11_token *token);
+
+bool            p11_token_is_distrusted (p11_token *token,
+                                         CK_ATTRIBUTE *cert);
+
 p11_index *     p11_token_index       (p11_token *token);
 
 const char *    p11_token_get_path    (p11_token *token);
@@ -57,4 +66,10 @@ const char *    p11_token_get_label   (p11_token *token);
 
 CK_SLOT_ID      p11_token_get_slot    (p11_token *token);
 
+void            p11_token_set_workers (p11_token *token,
+                                       int workers);
+
+void            p11_token_set_cache   (p11_token *token,
+                                       const char *directory);
+
 #endif /* P11_TOKEN_H_ */